@@ -0,0 +1,75 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace j2c {
+
+// Multi-producer multi-consumer FIFO with a fixed capacity. Push blocks while the
+// queue is full, which gives producers (directory walks, readers) natural
+// backpressure. After Close() pushes fail and Pop drains what is left.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(const size_t capacity) : _capacity(capacity ? capacity : 1) {}
+
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notFull.wait(lock, [this] { return _closed || _items.size() < _capacity; });
+    if (_closed) {
+      return false;
+    }
+    _items.push_back(std::move(item));
+    _notEmpty.notify_one();
+    return true;
+  }
+
+  bool TryPush(T item) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_closed || _items.size() >= _capacity) {
+      return false;
+    }
+    _items.push_back(std::move(item));
+    _notEmpty.notify_one();
+    return true;
+  }
+
+  // Returns false once the queue is closed and empty
+  bool Pop(T& item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notEmpty.wait(lock, [this] { return _closed || !_items.empty(); });
+    if (_items.empty()) {
+      return false;
+    }
+    item = std::move(_items.front());
+    _items.pop_front();
+    _notFull.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _notEmpty.notify_all();
+    _notFull.notify_all();
+  }
+
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _items.size();
+  }
+
+private:
+  mutable std::mutex _mutex;
+  std::condition_variable _notEmpty;
+  std::condition_variable _notFull;
+  std::deque<T> _items;
+  const size_t _capacity;
+  bool _closed = false;
+};
+
+} // namespace j2c
+
+#endif // BOUNDED_QUEUE_H
@@ -0,0 +1,94 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace j2c {
+
+struct BufferPoolStats {
+    uint64_t acquires;
+    // Acquires served from a retained buffer
+    uint64_t reuses;
+    // Acquires that had to allocate (and prefault) a new buffer
+    uint64_t allocations;
+    // Released buffers freed instead of retained because of the cap
+    uint64_t discards;
+    size_t retainedBytes;
+    size_t peakRetainedBytes;
+    // Bytes handed out and not released yet
+    size_t outstandingBytes;
+};
+
+class PooledBuffer;
+
+// Recycles large buffers in power of two size classes. Fresh buffers are prefaulted
+// so the first write does not take a page fault per 4 KiB, and released buffers are
+// kept for reuse up to a cap on retained bytes. Thread safe; buffers may outlive the
+// pool.
+class BufferPool {
+public:
+  explicit BufferPool(const size_t maxRetainedBytes = 256ull * 1024 * 1024,
+                      const bool prefault = true);
+
+  // Buffer of at least `size` bytes, 64 byte aligned
+  PooledBuffer Acquire(const size_t size);
+
+  void SetMaxRetainedBytes(const size_t bytes);
+  // Frees every retained buffer
+  void Trim();
+  BufferPoolStats Stats() const;
+
+private:
+  friend class PooledBuffer;
+  struct Shared;
+
+  std::shared_ptr<Shared> _shared;
+};
+
+// Move-only handle to a pool buffer, returned to the pool on destruction
+class PooledBuffer {
+public:
+  PooledBuffer() = default;
+  ~PooledBuffer();
+  PooledBuffer(PooledBuffer&& other) noexcept;
+  PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+  PooledBuffer(const PooledBuffer&) = delete;
+  PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+  uint8_t* Data() const { return _data; }
+  // Requested size; the buffer may be larger, see Capacity()
+  size_t Size() const { return _size; }
+  size_t Capacity() const { return _capacity; }
+  bool Empty() const { return _data == nullptr; }
+  // Hands the buffer back to the pool early
+  void Release();
+
+private:
+  friend class BufferPool;
+  PooledBuffer(std::shared_ptr<BufferPool::Shared> pool, uint8_t* data, const size_t size,
+               const size_t capacity)
+      : _pool(std::move(pool)), _data(data), _size(size), _capacity(capacity) {}
+
+  std::shared_ptr<BufferPool::Shared> _pool;
+  uint8_t* _data = nullptr;
+  size_t _size = 0;
+  size_t _capacity = 0;
+};
+
+// libopenjp2 allocates its decoder state, tile buffers and output planes with malloc
+// and has no allocator hooks, so they cannot come from a BufferPool. With glibc, blocks
+// above the mmap threshold are mapped and unmapped on every decode and fault their
+// pages in again each time. This raises the mmap and trim thresholds to `bytes` so
+// such blocks stay in the heap and are reused by the next decode. The mmap threshold is
+// capped at the 32 MiB (512 KiB on 32-bit) older glibc accepts, larger blocks are
+// still mapped; the trim threshold takes `bytes` up to 1 GiB.
+// Process wide, opt-in and cannot be undone; returns false where it is not supported.
+bool RetainHeapForDecode(const size_t bytes);
+
+} // namespace j2c
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,171 @@
+#ifndef BYTE_READER_H
+#define BYTE_READER_H
+
+#include "j2k_stream.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace j2c {
+
+inline uint16_t ReadUint16BE(const unsigned char* p) {
+    return uint16_t((uint16_t(p[0]) << 8) | uint16_t(p[1]));
+}
+
+inline uint32_t ReadUint32BE(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) |
+           uint32_t(p[3]);
+}
+
+inline uint64_t ReadUint64BE(const unsigned char* p) {
+    return (uint64_t(ReadUint32BE(p)) << 32) | ReadUint32BE(p + 4);
+}
+
+// Positional reads from a FILE*, used to walk boxes and markers without loading the
+// bytes in between
+class FileReader {
+public:
+    explicit FileReader(FILE* f) : _f(f) {}
+
+    bool Read(const uint64_t offset, void* dst, const size_t n) {
+        return Seek(offset) && fread(dst, 1, n, _f) == n;
+    }
+
+    // Bytes from `offset` to EOF, capped at `limit`
+    bool ReadToEnd(const uint64_t offset, std::vector<uint8_t>& out, const uint64_t limit) {
+        out.clear();
+        if (!Seek(offset)) {
+            return false;
+        }
+        unsigned char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), _f)) > 0) {
+            if (out.size() + n > limit) {
+                return false;
+            }
+            out.insert(out.end(), chunk, chunk + n);
+        }
+        return true;
+    }
+
+    // Size of the whole file, 0 on failure
+    uint64_t Size() {
+#if defined(_WIN32)
+        if (_fseeki64(_f, 0, SEEK_END) != 0) {
+            return 0;
+        }
+        const __int64 size = _ftelli64(_f);
+#else
+        if (fseeko(_f, 0, SEEK_END) != 0) {
+            return 0;
+        }
+        const off_t size = ftello(_f);
+#endif
+        return size < 0 ? 0 : uint64_t(size);
+    }
+
+private:
+    bool Seek(const uint64_t offset) {
+#if defined(_WIN32)
+        return _fseeki64(_f, (__int64)offset, SEEK_SET) == 0;
+#else
+        return fseeko(_f, (off_t)offset, SEEK_SET) == 0;
+#endif
+    }
+
+    FILE* _f;
+};
+
+class MemoryReader {
+public:
+    MemoryReader(const uint8_t* data, const size_t size) : _data(data), _size(size) {}
+
+    bool Read(const uint64_t offset, void* dst, const size_t n) {
+        if (offset > _size || n > _size - offset) {
+            return false;
+        }
+        memcpy(dst, _data + offset, n);
+        return true;
+    }
+
+    bool ReadToEnd(const uint64_t offset, std::vector<uint8_t>& out, const uint64_t limit) {
+        if (offset > _size || _size - offset > limit) {
+            return false;
+        }
+        out.assign(_data + offset, _data + _size);
+        return true;
+    }
+
+    uint64_t Size() const { return _size; }
+
+private:
+    const uint8_t* _data;
+    const size_t _size;
+};
+
+// Reader interface over a PositionalFile, safe to use from several threads at once
+class PositionalReader {
+public:
+    explicit PositionalReader(const PositionalFile& file) : _file(file) {}
+
+    bool Read(const uint64_t offset, void* dst, const size_t n) {
+        return _file.ReadAt(offset, dst, n) == int64_t(n);
+    }
+
+    bool ReadToEnd(const uint64_t offset, std::vector<uint8_t>& out, const uint64_t limit) {
+        if (offset > _file.Size() || _file.Size() - offset > limit) {
+            return false;
+        }
+        out.resize(size_t(_file.Size() - offset));
+        return out.empty() || Read(offset, out.data(), out.size());
+    }
+
+    uint64_t Size() const { return _file.Size(); }
+
+private:
+    const PositionalFile& _file;
+};
+
+struct BoxHeader {
+    uint32_t type;
+    uint64_t payloadStart;
+    // Zero when the box runs to the end of the file
+    uint64_t payloadEnd;
+};
+
+// Reads the JP2 box header at `offset`. Fails on truncated or self-inconsistent lengths.
+template <typename Reader>
+bool ReadBoxHeader(Reader& reader, const uint64_t offset, BoxHeader& box) {
+    unsigned char hdr[16];
+    if (!reader.Read(offset, hdr, 8)) {
+        return false;
+    }
+
+    uint64_t boxLength = ReadUint32BE(hdr);
+    uint64_t headerLength = 8;
+    box.type = ReadUint32BE(hdr + 4);
+
+    if (boxLength == 1) {
+        if (!reader.Read(offset + 8, hdr + 8, 8)) {
+            return false;
+        }
+        boxLength = ReadUint64BE(hdr + 8);
+        headerLength = 16;
+    }
+
+    box.payloadStart = offset + headerLength;
+    if (boxLength == 0) {
+        box.payloadEnd = 0;
+        return true;
+    }
+    if (boxLength < headerLength || offset + boxLength < offset) {
+        return false;
+    }
+    box.payloadEnd = offset + boxLength;
+    return true;
+}
+
+} // namespace j2c
+
+#endif // BYTE_READER_H
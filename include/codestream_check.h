@@ -0,0 +1,60 @@
+#ifndef CODESTREAM_CHECK_H
+#define CODESTREAM_CHECK_H
+
+#include "j2k_stream.h"
+#include "jp2_boxes.h"
+#include <cstdint>
+#include <string>
+
+namespace j2c {
+
+// Outcome of a J2kCodec call, see J2kCodec::LastStatus()
+enum class DecodeStatus {
+    OK,
+    // The file could not be opened, read or mapped
+    OPEN_FAILED,
+    // Neither JP2 nor a J2K codestream, or a feature this library does not handle
+    UNSUPPORTED,
+    // Inconsistent boxes or marker segments, or a header the codec rejected
+    MALFORMED,
+    // Well formed but over one of the DecodeLimits
+    LIMIT_EXCEEDED,
+    // Resolution level, tile, region or buffers do not fit the image
+    INVALID_ARGUMENT,
+    // The header was accepted, the codec failed on the compressed data
+    DECODE_FAILED,
+    OUT_OF_MEMORY,
+    // The file has no XML box
+    NO_XML
+};
+
+const char* StatusName(const DecodeStatus status);
+
+// Bounds a file is checked against before the codec sees it. While parsing the header
+// the codec allocates state for every tile-component and loads header and XML boxes
+// whole, so these are what a hostile header could otherwise inflate.
+struct DecodeLimits {
+    // Image area on the reference grid
+    uint64_t maxPixels = 1ull << 34;
+    uint32_t maxComponents = 4096;
+    // Tiles times components
+    uint64_t maxTileComponents = 1ull << 20;
+    // Size of a header (jp2h) or XML box
+    uint64_t maxMetadataBytes = MAX_XML_BOX_SIZE;
+};
+
+// Structural check of a JP2 file or J2K codestream: the top level boxes, the image
+// header box and the main header marker segments up to the first tile-part header are
+// checked against each other and `limits`. Only box and marker headers are read, a few
+// hundred bytes for a typical file, and nothing is allocated in proportion to what
+// they claim. `detail`, when given, receives the reason of a failure.
+DecodeStatus CheckCodestream(const ByteSpan& bytes, const DecodeLimits& limits,
+                             std::string* detail = nullptr);
+DecodeStatus CheckCodestream(const std::string& path, const DecodeLimits& limits,
+                             std::string* detail = nullptr);
+DecodeStatus CheckCodestream(const PositionalFile& file, const DecodeLimits& limits,
+                             std::string* detail = nullptr);
+
+} // namespace j2c
+
+#endif // CODESTREAM_CHECK_H
@@ -0,0 +1,135 @@
+#ifndef CODESTREAM_INDEX_H
+#define CODESTREAM_INDEX_H
+
+#include "j2k_stream.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace j2c {
+
+enum class IndexMode {
+    OFF,
+    // Built on the first region or tile decode of a file and kept with the session
+    MEMORY,
+    // Like MEMORY, loaded from and saved to a sidecar next to the file
+    SIDECAR
+};
+
+struct ByteRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct TilePartEntry {
+    // Offset of the SOT marker from the start of the file
+    uint64_t offset;
+    // SOT marker to the end of the tile-part
+    uint64_t length;
+    // First byte of packet data, after SOD
+    uint64_t dataOffset;
+    uint32_t tileIndex;
+    uint32_t partIndex;
+    // Range of PacketLengths(), empty when the tile-part has no PLT markers
+    uint32_t firstPacket;
+    uint32_t numPackets;
+};
+
+// Byte offsets of every tile-part of a codestream (and of every packet when PLT markers
+// are present), found by hopping from SOT to SOT using the tile-part lengths. Only
+// marker segments are read, never packet data.
+//
+// libopenjp2 has no way to accept an external index, so the index is used to cut a
+// substream (main header + the tile-parts of the wanted tiles) that the codec then
+// decodes without scanning the rest of the file.
+class CodestreamIndex {
+public:
+  // Index the codestream in `path` or `bytes`, raw J2K or wrapped in JP2
+  bool Build(const std::string& path);
+  bool Build(const ByteSpan& bytes);
+  bool Build(const PositionalFile& file);
+
+  // The sidecar remembers the size and mtime of `sourcePath` and is rejected by Load()
+  // once either changes
+  bool Save(const std::string& sidecarPath, const std::string& sourcePath) const;
+  bool Load(const std::string& sidecarPath, const std::string& sourcePath);
+  static std::string SidecarPath(const std::string& path);
+
+  bool IsValid() const { return _valid; }
+  // False when the substream trick would change the decoded samples or cannot be
+  // expressed: packed packet headers (PPM), palettes and channel definitions
+  bool CanExtract() const;
+  uint32_t NumTiles() const { return _header.numTilesX * _header.numTilesY; }
+
+  // Row major indices of the tiles overlapping [x0, x1) x [y0, y1) on the reference grid
+  std::vector<uint32_t> TilesInRegion(const uint32_t x0, const uint32_t y0,
+                                      const uint32_t x1, const uint32_t y1) const;
+  // Sorted, merged file ranges holding `tiles`, including the main header. A caller
+  // can prefetch these before decoding the region.
+  std::vector<ByteRange> RangesForTiles(const std::vector<uint32_t>& tiles) const;
+
+  // Fills `out` with the main header (TLM and PLM dropped, they describe the whole
+  // stream), the tile-parts of `tiles` in file order and EOC
+  bool ExtractSubstream(const ByteSpan& source, const std::vector<uint32_t>& tiles,
+                        std::vector<uint8_t>& out) const;
+  bool ExtractSubstream(const std::string& path, const std::vector<uint32_t>& tiles,
+                        std::vector<uint8_t>& out) const;
+  // Const and positional, several threads may extract from one index and file at once
+  bool ExtractSubstream(const PositionalFile& file, const std::vector<uint32_t>& tiles,
+                        std::vector<uint8_t>& out) const;
+
+  const std::vector<TilePartEntry>& TileParts() const { return _tileParts; }
+  const std::vector<uint32_t>& PacketLengths() const { return _packetLengths; }
+
+private:
+  // Fixed size part of the index, written as is into sidecars
+  struct Header {
+      uint64_t codestreamStart;
+      uint64_t codestreamEnd;
+      // Offset of the first SOT
+      uint64_t mainHeaderEnd;
+      uint32_t imageX0;
+      uint32_t imageY0;
+      uint32_t imageX1;
+      uint32_t imageY1;
+      uint32_t tileX0;
+      uint32_t tileY0;
+      uint32_t tileWidth;
+      uint32_t tileHeight;
+      uint32_t numTilesX;
+      uint32_t numTilesY;
+      uint32_t hasPPM;
+      uint32_t hasPalette;
+  };
+
+  template <typename Reader>
+  bool BuildFrom(Reader& reader);
+  template <typename Reader>
+  bool ReadMainHeader(Reader& reader);
+  template <typename Reader>
+  bool ReadTileParts(Reader& reader);
+  // Tile counts of the image and tile geometry in _header, false for a geometry Build()
+  // rejects or more than 65535 tiles
+  bool TileGrid(uint32_t& numTilesX, uint32_t& numTilesY) const;
+  template <typename Reader>
+  bool ReadPacketLengths(Reader& reader, TilePartEntry& entry);
+  template <typename Reader>
+  bool Extract(Reader& reader, const std::vector<uint32_t>& tiles,
+               std::vector<uint8_t>& out) const;
+  void Clear();
+  void Finalize();
+
+  Header _header = {};
+  std::vector<TilePartEntry> _tileParts;
+  std::vector<uint32_t> _packetLengths;
+  // Main header marker segments left out of substreams
+  std::vector<ByteRange> _dropped;
+  // _tileParts indices grouped by tile, tile t owns [_tileStart[t], _tileStart[t + 1])
+  std::vector<uint32_t> _partsByTile;
+  std::vector<uint32_t> _tileStart;
+  bool _valid = false;
+};
+
+} // namespace j2c
+
+#endif // CODESTREAM_INDEX_H
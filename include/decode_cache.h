@@ -0,0 +1,99 @@
+#ifndef DECODE_CACHE_H
+#define DECODE_CACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace j2c {
+
+struct ImageData;
+
+// Everything that determines the pixels of a decode
+struct DecodeKey {
+    std::string path;
+    int resolutionLevel;
+    int numQualityLayers;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    // -1 for full image or region decodes
+    int tileId;
+};
+
+// Modification time and size of a file, what cached decodes of it are validated against
+struct FileStamp {
+    int64_t mtime;
+    uint64_t size;
+    bool operator==(const FileStamp& other) const {
+        return mtime == other.mtime && size == other.size;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+// False when the file cannot be stat'ed
+bool StatFile(const std::string& path, FileStamp& stamp);
+
+struct DecodeCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    // Lookups that waited for a decode of the same key already in progress
+    uint64_t coalesced;
+    uint64_t evictions;
+    // Entries dropped because the file changed on disk
+    uint64_t invalidations;
+    size_t bytes;
+    size_t entries;
+};
+
+// Byte budgeted LRU cache of decoded images shared by any number of codecs and threads.
+// Concurrent misses on one key run the decode once and share the result. Entries
+// remember the file's mtime and size and are dropped when either changes.
+class DecodeCache {
+public:
+  using Loader = std::function<std::shared_ptr<ImageData>()>;
+
+  explicit DecodeCache(const size_t byteBudget);
+
+  // Cached image for `key`, or the result of `loader` which is then cached. Null
+  // results are handed to every waiter but not cached. Cached images are shared and
+  // must be treated as read only.
+  std::shared_ptr<ImageData> GetOrLoad(const DecodeKey& key, const Loader& loader);
+
+  void SetBudget(const size_t byteBudget);
+  void Clear();
+  DecodeCacheStats Stats() const;
+
+private:
+  struct Entry {
+      std::string id;
+      std::shared_ptr<ImageData> image;
+      FileStamp stamp;
+      size_t bytes;
+  };
+
+  using EntryList = std::list<Entry>;
+
+  void Insert(const std::string& id, const std::shared_ptr<ImageData>& image,
+              const FileStamp& stamp);
+  void Erase(EntryList::iterator entry);
+  void EvictToBudget();
+
+  mutable std::mutex _mutex;
+  // Most recently used first
+  EntryList _lru;
+  std::unordered_map<std::string, EntryList::iterator> _index;
+  std::unordered_map<std::string, std::shared_future<std::shared_ptr<ImageData>>> _inFlight;
+  size_t _budget;
+  DecodeCacheStats _stats;
+};
+
+} // namespace j2c
+
+#endif // DECODE_CACHE_H
@@ -0,0 +1,61 @@
+#ifndef DECODE_METRICS_H
+#define DECODE_METRICS_H
+
+#include <cstdint>
+#include <functional>
+
+namespace j2c {
+
+enum class DecodeStage {
+    // Stream creation (open or mmap) and format sniffing
+    OPEN,
+    // Main header and JP2 boxes
+    HEADER,
+    // Building or loading the codestream index and cutting the substream
+    INDEX,
+    // opj_decode / opj_get_decoded_tile. libopenjp2 runs tier-2 packet parsing, tier-1
+    // decoding and the inverse DWT per code block inside one call without exposing
+    // the split, so they are reported together.
+    DECODE,
+    // Scaling and interleaving into the caller's format
+    CONVERT,
+    NUM_STAGES
+};
+
+// What one public decode call of J2kCodec did. Filled with plain counters and
+// steady_clock reads only, cheap enough to leave on.
+struct DecodeMetrics {
+    uint64_t stageNs[size_t(DecodeStage::NUM_STAGES)];
+    uint64_t totalNs;
+    // Bytes handed to the codec by its streams
+    uint64_t bytesRead;
+    uint64_t streamReads;
+    uint64_t streamSeeks;
+    uint64_t tilesDecoded;
+    // Image planes the codec allocated for the output, and their size. libopenjp2 has
+    // no allocator hooks, its internal working buffers are not counted.
+    uint64_t planeAllocations;
+    uint64_t planeBytes;
+    // Messages from the codec's info/warning/error callbacks
+    uint64_t infoMessages;
+    uint64_t warnings;
+    uint64_t errors;
+    // Regions asked of DecodeRegions, and the decodes they were coalesced into
+    uint64_t regionsRequested;
+    uint64_t regionDecodes;
+    // Worker threads the codec decoded with, 1 when libopenjp2 was built without thread
+    // support even if more were leased
+    uint32_t decoderThreads;
+    bool sessionReused;
+    bool indexed;
+    bool cacheHit;
+
+    uint64_t StageNs(const DecodeStage stage) const { return stageNs[size_t(stage)]; }
+};
+
+// Called on the decoding thread at the end of every public decode call
+using MetricsSink = std::function<void(const DecodeMetrics& metrics)>;
+
+} // namespace j2c
+
+#endif // DECODE_METRICS_H
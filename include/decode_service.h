@@ -0,0 +1,163 @@
+#ifndef DECODE_SERVICE_H
+#define DECODE_SERVICE_H
+
+#include "j2kcodec.h"
+#include "opened_image.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace j2c {
+
+class DecodeCache;
+
+struct DecodeRequest {
+    // Source: `image` when set, `span` when its data is set (must stay valid until
+    // completion), else path. Requests sharing an OpenedImage reuse its bytes and index
+    // on every worker.
+    std::string path;
+    ByteSpan span = {nullptr, 0};
+    std::shared_ptr<const OpenedImage> image;
+    int resolutionLevel = 0;
+    int numQualityLayers = 1;
+    int x0 = -1;
+    int y0 = -1;
+    int x1 = -1;
+    int y1 = -1;
+    // Decode only this tile when >= 0, the region is ignored then
+    int tileId = -1;
+    // Higher runs first, equal priorities run in submission order
+    int priority = 0;
+};
+
+struct DecodeResult {
+    // Null when the decode failed or was cancelled
+    std::shared_ptr<ImageData> image;
+    bool cancelled;
+    // Why the decode failed, see J2kCodec::LastStatus()
+    DecodeStatus status = DecodeStatus::OK;
+};
+
+// Called on the worker thread once a request is done, before its future is ready
+using DecodeCompletion = std::function<void(const DecodeRequest&, const DecodeResult&)>;
+
+class DecodeTicket {
+public:
+  DecodeTicket() = default;
+  DecodeTicket(std::future<DecodeResult> result, std::shared_ptr<std::atomic<bool>> cancel)
+      : _result(std::move(result)), _cancel(std::move(cancel)) {}
+
+  // Requests that have not started yet complete as cancelled, running ones finish
+  void Cancel() {
+    if (_cancel) {
+      *_cancel = true;
+    }
+  }
+  bool Valid() const { return _result.valid(); }
+  DecodeResult Get() { return _result.get(); }
+  std::future<DecodeResult>& Future() { return _result; }
+
+private:
+  std::future<DecodeResult> _result;
+  std::shared_ptr<std::atomic<bool>> _cancel;
+};
+
+struct DecodeServiceOptions {
+    // 0 means one worker per hardware thread
+    unsigned int numWorkers = 0;
+    // Submit blocks (TrySubmit fails) once this many requests are waiting
+    size_t queueCapacity = 1024;
+    // Threads each decode asks the shared pool for
+    int threadsPerDecode = 1;
+    std::shared_ptr<DecodeCache> cache;
+    bool memoryMapped = false;
+    // Region requests (a region and no tile) for the same source, resolution and layer
+    // count that arrive within this window of the first one a worker picks up are
+    // decoded together with J2kCodec::DecodeRegions, so overlapping regions are
+    // decoded once. Batched requests bypass the cache. Zero turns batching off.
+    std::chrono::microseconds batchWindow{0};
+    size_t maxBatch = 64;
+    // Given the metrics of every decode call of every worker, on that worker's thread.
+    // A batch reports its regions and the groups they were coalesced into.
+    MetricsSink metricsSink;
+};
+
+// Runs decode requests on a set of workers, each owning a J2kCodec so that repeated
+// requests on one file reuse its session. Requests are prioritized, cancellable and
+// complete through futures and/or callbacks. A full queue pushes back on producers.
+// With a batch window, bursts of region requests on one image are coalesced.
+class DecodeService {
+public:
+  explicit DecodeService(const DecodeServiceOptions& options = DecodeServiceOptions());
+  ~DecodeService();
+
+  DecodeService(const DecodeService&) = delete;
+  DecodeService& operator=(const DecodeService&) = delete;
+
+  // Blocks while the queue is full. After Shutdown() the ticket completes as cancelled.
+  DecodeTicket Submit(DecodeRequest request, DecodeCompletion completion = nullptr);
+  // Returns false instead of blocking when the queue is full
+  bool TrySubmit(DecodeRequest request, DecodeTicket& ticket,
+                 DecodeCompletion completion = nullptr);
+  std::vector<DecodeTicket> SubmitBatch(std::vector<DecodeRequest> requests,
+                                        DecodeCompletion completion = nullptr);
+
+  // Stops accepting work, cancels what is still queued and joins the workers
+  void Shutdown();
+  size_t Pending() const;
+
+private:
+  struct Job {
+      DecodeRequest request;
+      DecodeCompletion completion;
+      std::shared_ptr<std::promise<DecodeResult>> promise;
+      std::shared_ptr<std::atomic<bool>> cancel;
+      uint64_t sequence;
+  };
+
+  struct JobOrder {
+      bool operator()(const Job& a, const Job& b) const {
+          if (a.request.priority != b.request.priority) {
+              return a.request.priority < b.request.priority;
+          }
+          return a.sequence > b.sequence;
+      }
+  };
+
+  bool Enqueue(DecodeRequest&& request, DecodeCompletion&& completion, DecodeTicket& ticket,
+               const bool block);
+  void WorkerLoop();
+  // Gathers requests that can be decoded with `batch.front()` until the batch window
+  // closes or the batch is full. Called and returns with the lock held.
+  void CollectBatch(std::unique_lock<std::mutex>& lock, std::vector<Job>& batch);
+  void Run(J2kCodec& codec, Job& job);
+  void RunBatch(J2kCodec& codec, std::vector<Job>& batch);
+  static bool IsBatchable(const DecodeRequest& request);
+  static bool SameBatch(const DecodeRequest& a, const DecodeRequest& b);
+  static void Finish(Job& job, DecodeResult result);
+
+  const DecodeServiceOptions _options;
+  mutable std::mutex _mutex;
+  std::condition_variable _notEmpty;
+  std::condition_variable _notFull;
+  // Signalled when an open batch fills up
+  std::condition_variable _batchFull;
+  // Heap ordered by JobOrder, so batches can take matching jobs out of the middle
+  std::vector<Job> _queue;
+  // Batches whose window is still open, new matching requests join them directly
+  std::vector<std::vector<Job>*> _openBatches;
+  uint64_t _sequence;
+  bool _stopping;
+  std::vector<std::thread> _workers;
+};
+
+} // namespace j2c
+
+#endif // DECODE_SERVICE_H
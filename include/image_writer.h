@@ -0,0 +1,42 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "j2kcodec.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace j2c {
+
+// Interleaved samples of 8 or 16 bits each, as DecodeIntoBuffer writes them for
+// SampleFormat::UINT8 and UINT16
+struct SampleImage {
+    const uint8_t* data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numComps;
+    uint32_t bits;
+};
+
+// Tile size and code stream layout when writing .j2k/.jp2
+struct ImageEncodeOptions {
+    unsigned int tileWidth = 512;
+    unsigned int tileHeight = 512;
+    EncodeParams encodeParams;
+};
+
+// Lays `image` out as the body of a file in `format` (see FormatFromExtension): planar
+// RAW/RAWL/PGX, PGM/PPM with their header, or 32 bit samples for J2K/JP2. False for
+// formats that need image libraries this library does not link (PNG, TIFF, BMP, TGA).
+bool LayoutImage(const SampleImage& image, const int format, std::vector<uint8_t>& body);
+
+// Writes a LayoutImage `body` of an image with the geometry of `image` to `output`,
+// creating its directory. PGX writes one file per component, J2K/JP2 are encoded with
+// `encoder`. `written` receives the bytes stored.
+bool WriteImage(J2kCodec& encoder, const std::vector<uint8_t>& body, const SampleImage& image,
+                const std::string& output, const int format,
+                const ImageEncodeOptions& options, uint64_t& written);
+
+} // namespace j2c
+
+#endif // IMAGE_WRITER_H
@@ -0,0 +1,97 @@
+#ifndef J2K_STREAM_H
+#define J2K_STREAM_H
+
+#include "openjpeg.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace j2c {
+
+// Read-only view of JPEG 2000 bytes owned by someone else
+struct ByteSpan {
+    const uint8_t* data;
+    size_t size;
+};
+
+// Read-only mapping of a whole file. Unmapped on Close() or destruction.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool Open(const std::string& path);
+  void Close();
+  bool IsOpen() const { return _data != nullptr; }
+  ByteSpan Span() const { return {_data, _size}; }
+
+private:
+  const uint8_t* _data = nullptr;
+  size_t _size = 0;
+#if defined(_WIN32)
+  void* _file = nullptr;
+  void* _mapping = nullptr;
+#endif
+};
+
+// Read-only file read with positional reads (pread, ReadFile at an offset). There is
+// no shared cursor, so any number of threads may call ReadAt at once.
+class PositionalFile {
+public:
+  PositionalFile() = default;
+  ~PositionalFile();
+  PositionalFile(PositionalFile&& other) noexcept;
+  PositionalFile& operator=(PositionalFile&& other) noexcept;
+  PositionalFile(const PositionalFile&) = delete;
+  PositionalFile& operator=(const PositionalFile&) = delete;
+
+  bool Open(const std::string& path);
+  void Close();
+  bool IsOpen() const;
+  uint64_t Size() const { return _size; }
+  // Up to `n` bytes at `offset`, fewer only at the end of the file. -1 on error.
+  int64_t ReadAt(const uint64_t offset, void* dst, const size_t n) const;
+
+private:
+  uint64_t _size = 0;
+#if defined(_WIN32)
+  void* _file = nullptr;
+#else
+  int _fd = -1;
+#endif
+};
+
+// I/O done through a stream, updated by its callbacks on the thread driving the codec
+struct StreamCounters {
+    uint64_t bytesRead;
+    uint64_t reads;
+    uint64_t seeks;
+};
+
+// Stream whose read/skip/seek callbacks work directly on `span`. Nothing is copied up
+// front and no syscalls are made; the bytes must outlive the stream. `counters`, when
+// given, must outlive the stream as well.
+opj_stream_t* CreateMemoryStream(const ByteSpan& span, StreamCounters* counters = nullptr);
+// Buffered FILE* stream equivalent to opj_stream_create_default_file_stream that also
+// feeds `counters`
+opj_stream_t* CreateFileStream(const std::string& path, StreamCounters* counters = nullptr);
+
+// Stream over `file` with a read position of its own, so streams of several threads
+// can share one PositionalFile. The file must outlive the stream.
+opj_stream_t* CreatePositionalStream(const PositionalFile& file,
+                                     StreamCounters* counters = nullptr);
+
+// Codec (J2K_CFMT, JP2_CFMT) or image format (PGX_DFMT, PXM_DFMT, RAW_DFMT, ...) from
+// the extension of `filename`, -1 if unknown
+int FormatFromExtension(const char* filename);
+
+// J2K_CFMT or JP2_CFMT from the leading magic bytes, -1 if neither
+int GetMagicFormat(const uint8_t* data, const size_t size);
+
+} // namespace j2c
+
+#endif // J2K_STREAM_H
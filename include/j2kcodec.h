@@ -2,19 +2,115 @@
 #define J2KCODEC_H
 
 #include "openjpeg.h"
+#include "buffer_pool.h"
+#include "codestream_check.h"
+#include "j2k_stream.h"
+#include "codestream_index.h"
+#include "decode_cache.h"
+#include "decode_metrics.h"
+#include "sample_convert.h"
+#include <chrono>
 #include <string>
 #include <memory>
+#include <vector>
+#include <functional>
 
+// Use every core the shared thread pool can lend to the decode
 #define ALL_THREADS 0
 
 namespace j2c {
 
+class DecodeCache;
+class OpenedImage;
+
 struct ImageData {
     int32_t* data;
     uint32_t w;
     uint32_t h;
 };
 
+// Full resolution geometry of an image, precision and signedness of component 0
+struct ImageInfo {
+    uint32_t width;
+    uint32_t height;
+    uint32_t numComps;
+    uint32_t prec;
+    bool sgnd;
+    // Image origin on the reference grid, reduced resolutions round it up
+    uint32_t x0;
+    uint32_t y0;
+    // Resolution levels of the first tile-component, the largest usable resolutionLevel
+    // is numResolutions - 1
+    uint32_t numResolutions;
+};
+
+struct TileLayout {
+    uint32_t tileWidth;
+    uint32_t tileHeight;
+    uint32_t numTilesX;
+    uint32_t numTilesY;
+};
+
+// Most components EncodeAsTiles accepts
+constexpr unsigned int MAX_ENCODE_COMPONENTS = 4;
+
+// Code stream layout for EncodeAsTiles. The defaults target fast random access decode:
+// resolution-major progression plus tile-part and packet length markers.
+struct EncodeParams {
+    // Lossless 5/3 wavelet when true, 9/7 otherwise
+    bool reversible = false;
+    int numResolutions = 6;
+    // Compression ratio per quality layer in increasing quality, e.g. {40, 10, 1}.
+    // Empty encodes a single layer with no rate constraint.
+    std::vector<float> layerRates;
+    OPJ_PROG_ORDER progression = OPJ_RPCL;
+    int codeBlockWidth = 64;
+    int codeBlockHeight = 64;
+    // Power of two precinct size used at every resolution, 0 for the maximum
+    int precinctWidth = 0;
+    int precinctHeight = 0;
+    bool writePLT = true;
+    bool writeTLM = true;
+    bool isSigned = false;
+};
+
+// Caller owned destination for one component plane
+struct ComponentBuffer {
+    void* data;
+    // Bytes between rows, 0 for tightly packed rows
+    size_t stride;
+};
+
+// Region of the reference grid, [x0, x1) x [y0, y1)
+struct DecodeRegion {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// One refinement delivered by DecodeProgressive
+struct ProgressiveStep {
+    int resolutionLevel;
+    int numQualityLayers;
+    std::shared_ptr<ImageData> image;
+    // Set on the step at the requested resolution and layer count
+    bool final;
+};
+
+// Return false to stop refining
+using ProgressCallback = std::function<bool(const ProgressiveStep& step)>;
+
+// Interleaved samples of a decode in a buffer from the codec's BufferPool. Releasing
+// or destroying the buffer recycles it for later decodes.
+struct PooledImage {
+    PooledBuffer buffer;
+    uint32_t w;
+    uint32_t h;
+    uint32_t numComps;
+    SampleFormat format;
+};
+
 struct XmlData {
     uint8_t* data;
     size_t length;
@@ -25,25 +121,194 @@ public:
   J2kCodec(bool verboseMode = false);
   ~J2kCodec();
 
+  // Opens a decode session on `path`: the file is sniffed, the decoder created and the
+  // main header parsed. Decodes of the same file with the same number of quality
+  // layers reuse the session, a different file or layer count reopens it. So does a
+  // second region or full decode of an image of more than one tile, which libopenjp2
+  // only decodes once per header read; tile decodes and single tile images reuse it.
+  // Region and tile decodes that go through the index (SetIndexMode) do not touch the
+  // session's decoder.
+  // `numThreads` of the decode calls is leased per decode from ThreadPool::Shared(),
+  // see ThreadPolicy for how concurrent decodes split the cores. libopenjp2 only takes
+  // a thread count before the header is read, so Open() sets up the session for what
+  // `numThreads` would lease now and a decode that leases a different count reopens it;
+  // a decode never runs more threads than it leased.
+  bool Open(const std::string& path, const int numQualityLayers = 1,
+            const int numThreads = 1);
+  // Session on caller owned bytes (network buffer, object cache, shared mapping). The
+  // bytes are read in place and must stay valid until Reset() or another source is
+  // opened. Spans are told apart by address and size, Reset() before reusing memory.
+  bool Open(const ByteSpan& span, const int numQualityLayers = 1, const int numThreads = 1);
+  // Session on a shared OpenedImage. Its bytes and index are used as they are, so
+  // codecs on any number of threads can decode regions of one file at once without
+  // reopening or reindexing it; each only parses the header for its own session. The
+  // codec holds a reference to `image` until Reset() or another source is opened.
+  bool Open(std::shared_ptr<const OpenedImage> image, const int numQualityLayers = 1,
+            const int numThreads = 1);
+  // Path based sessions mmap the file instead of reading it through FILE*
+  void SetMemoryMapped(const bool enabled);
+  // Serve Decode/DecodeTile of files from `cache`, which may be shared between codecs
+  // and threads. Null turns caching off. Cached images are shared, treat them as read
+  // only.
+  void SetDecodeCache(std::shared_ptr<DecodeCache> cache);
+  // Releases the decoder, stream and image of the current session
+  void Reset();
+  bool IsOpen() const;
+  // Region and tile decodes of tiled files decode a substream of just the tile-parts
+  // they need, located through a CodestreamIndex built once per file. MEMORY by
+  // default; SIDECAR keeps the index in a file next to the image across processes.
+  void SetIndexMode(const IndexMode mode);
+  // Codestream byte ranges a decode of [x0, x1) x [y0, y1) reads (all tiles when no
+  // area is given), for prefetching. Builds the index if needed.
+  bool GetRegionByteRanges(const std::string& path, const int x0, const int y0,
+                           const int x1, const int y1, std::vector<ByteRange>& ranges);
+
+  // Stage timings and counters of the last decode call (Decode*, DecodeTile*,
+  // DecodeProgressive). Verbose mode prints a summary of them after every call.
+  const DecodeMetrics& LastMetrics() const;
+  // Also hand the metrics of every decode call to `sink`, null to stop
+  void SetMetricsSink(MetricsSink sink);
+
+  // Outcome of the last Open, decode, GetImageInfo, GetTileLayout, GetRegionByteRanges
+  // or fetchXML* call, kept across Reset(). Bad input never asserts or throws: the call
+  // returns false, null or an empty result and the reason is kept here.
+  DecodeStatus LastStatus() const { return _status; }
+  // Bounds every file is checked against (CheckCodestream) the first time a session
+  // is opened on it, before the codec parses its header
+  void SetDecodeLimits(const DecodeLimits& limits);
+
+  // Null data, and NO_XML, when the file has no XML box
   XmlData fetchXMLData(const std::string path);
-  // Decode and return image object
+  // Same payload as fetchXMLData, read by walking the JP2 boxes without setting up a
+  // decoder. The returned data stays valid until the next call on this codec. Besides
+  // NO_XML, LastStatus() reports OPEN_FAILED, UNSUPPORTED or MALFORMED (truncated or
+  // inconsistent boxes) when there is no data.
+  XmlData fetchXMLBox(const std::string& path);
+  XmlData fetchXMLBox(const ByteSpan& span);
+  // Decode and return image object. The decoded plane is handed over without a copy;
+  // it belongs to the returned object and is freed when the last reference goes away.
   std::shared_ptr<ImageData> Decode(const std::string& path, const int resolutionLevel,
                                     const int numQualityLayers = 1, const int x0 = -1,
                                 const int y0 = -1, const int x1 = -1, const int y1 = -1,
                                     const int numThreads = ALL_THREADS);
-  // Decode into a client allocated buffer
+  std::shared_ptr<ImageData> Decode(const ByteSpan& span, const int resolutionLevel,
+                                    const int numQualityLayers = 1, const int x0 = -1,
+                                    const int y0 = -1, const int x1 = -1, const int y1 = -1,
+                                    const int numThreads = ALL_THREADS);
+  std::shared_ptr<ImageData> Decode(std::shared_ptr<const OpenedImage> image,
+                                    const int resolutionLevel, const int numQualityLayers = 1,
+                                    const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                                    const int y1 = -1, const int numThreads = ALL_THREADS);
+  // Decode the coarsest resolution first and refine one level at a time down to
+  // `resolutionLevel`, calling `callback` after every level. Each pass is a full decode
+  // at its level, nothing is carried over from the coarser one. Coarse levels use the
+  // first quality layer. Their header is parsed once on single tile images and for
+  // region passes served by the index; full image passes over several tiles reopen the
+  // session each, libopenjp2 decodes those once per header read. When more than one
+  // layer is requested a final pass adds the rest, which reopens the session
+  // (libopenjp2 only takes the layer count when a decoder is set up); the index is
+  // kept.
+  bool DecodeProgressive(const std::string& path, const int resolutionLevel,
+                         const int numQualityLayers, const ProgressCallback& callback,
+                         const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                         const int y1 = -1, const int numThreads = ALL_THREADS);
+  // Decode component 0 of many regions of one image at one resolution, as Decode would
+  // one at a time. Regions that overlap or lie close together are coalesced: each
+  // group is decoded once over its bounding box, through the index or the session, and
+  // every region is cut out of its group's decode. Entry i of the result belongs to
+  // regions[i] and is null for a region outside the image. The decode cache is not
+  // used.
+  std::vector<std::shared_ptr<ImageData>> DecodeRegions(const std::string& path,
+                                                        const std::vector<DecodeRegion>& regions,
+                                                        const int resolutionLevel,
+                                                        const int numQualityLayers = 1,
+                                                        const int numThreads = ALL_THREADS);
+  std::vector<std::shared_ptr<ImageData>> DecodeRegions(const ByteSpan& span,
+                                                        const std::vector<DecodeRegion>& regions,
+                                                        const int resolutionLevel,
+                                                        const int numQualityLayers = 1,
+                                                        const int numThreads = ALL_THREADS);
+  std::vector<std::shared_ptr<ImageData>> DecodeRegions(std::shared_ptr<const OpenedImage> image,
+                                                        const std::vector<DecodeRegion>& regions,
+                                                        const int resolutionLevel,
+                                                        const int numQualityLayers = 1,
+                                                        const int numThreads = ALL_THREADS);
+  // Decode a single tile (row major index) without decoding the rest of the image.
+  // Only the tile-parts of that tile are read; the result covers the tile bounds at
+  // the reduced resolution.
+  std::shared_ptr<ImageData> DecodeTile(const int tileId, const std::string& path,
+                                        const int resolutionLevel,
+                                        const int numQualityLayers = 1,
+                                        const int numThreads = ALL_THREADS);
+  std::shared_ptr<ImageData> DecodeTile(const int tileId, const ByteSpan& span,
+                                        const int resolutionLevel,
+                                        const int numQualityLayers = 1,
+                                        const int numThreads = ALL_THREADS);
+  std::shared_ptr<ImageData> DecodeTile(const int tileId,
+                                        std::shared_ptr<const OpenedImage> image,
+                                        const int resolutionLevel,
+                                        const int numQualityLayers = 1,
+                                        const int numThreads = ALL_THREADS);
+  // Decode a single tile into a client allocated buffer
   void DecodeTileIntoBuffer(const int tileId, const std::string& path,
-                            unsigned char& buffer, const int resolutionLevel,
-                            const int numQualityLayers = 1, const int x0 = -1,
-                            const int y0 = -1, const int x1 = -1, const int y1 = -1,
+                            unsigned char* buffer, const int resolutionLevel,
+                            const int numQualityLayers = 1,
                             const int numThreads = ALL_THREADS);
+  // Tile grid of `path` at full resolution, opens a session if needed
+  bool GetTileLayout(const std::string& path, TileLayout& layout);
 
+  // Decode component 0 into a client allocated buffer of w * h bytes
   void DecodeIntoBuffer(const std::string& path, unsigned char* buffer,
                         const int resolutionLevel, const int numQualityLayers = 1,
                         const int x0 = -1, const int y0 = -1, const int x1 = -1,
                         const int y1 = -1, const int numThreads = ALL_THREADS);
 
-  // Encodes current loaded file
+  // Decode into a client allocated buffer of w * h * numComps samples of `format`.
+  // Samples are scaled from the component precision to the output range and
+  // multi-component images are interleaved.
+  void DecodeIntoBuffer(const std::string& path, void* buffer, const SampleFormat format,
+                        const int resolutionLevel, const int numQualityLayers = 1,
+                        const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                        const int y1 = -1, const int numThreads = ALL_THREADS);
+  void DecodeIntoBuffer(const ByteSpan& span, void* buffer, const SampleFormat format,
+                        const int resolutionLevel, const int numQualityLayers = 1,
+                        const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                        const int y1 = -1, const int numThreads = ALL_THREADS);
+  void DecodeIntoBuffer(std::shared_ptr<const OpenedImage> image, void* buffer,
+                        const SampleFormat format, const int resolutionLevel,
+                        const int numQualityLayers = 1, const int x0 = -1,
+                        const int y0 = -1, const int x1 = -1, const int y1 = -1,
+                        const int numThreads = ALL_THREADS);
+
+  // Decode writing component c into buffers[c] in a single conversion pass from the
+  // decoder output. Buffers with a null data pointer are skipped.
+  void DecodeIntoComponents(const std::string& path, const ComponentBuffer* buffers,
+                            const uint32_t numBuffers, const SampleFormat format,
+                            const int resolutionLevel, const int numQualityLayers = 1,
+                            const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                            const int y1 = -1, const int numThreads = ALL_THREADS);
+
+  // DecodeIntoBuffer into a buffer drawn from the codec's pool, for callers that
+  // would otherwise allocate a fresh output per decode. The buffer is empty on failure.
+  PooledImage DecodePooled(const std::string& path, const SampleFormat format,
+                           const int resolutionLevel, const int numQualityLayers = 1,
+                           const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                           const int y1 = -1, const int numThreads = ALL_THREADS);
+  PooledImage DecodePooled(const ByteSpan& span, const SampleFormat format,
+                           const int resolutionLevel, const int numQualityLayers = 1,
+                           const int x0 = -1, const int y0 = -1, const int x1 = -1,
+                           const int y1 = -1, const int numThreads = ALL_THREADS);
+  // Pool DecodePooled draws from. Each codec owns one retaining up to 64 MiB; a pool
+  // shared by several codecs recycles buffers between them.
+  void SetBufferPool(std::shared_ptr<BufferPool> pool);
+  BufferPoolStats PoolStats() const;
+
+  // Geometry of `path`, opens a session if needed
+  bool GetImageInfo(const std::string& path, ImageInfo& info);
+  bool GetImageInfo(const ByteSpan& span, ImageInfo& info);
+
+  // Encodes `data`, imageWidth x imageHeight pixels of numComps interleaved samples
+  // with compPrec (1-16) bits each. Tiles on the right and bottom edges may be partial.
   void EncodeAsTiles(const char* outfile,
                      const int32_t* data,
                      const unsigned int imageWidth,
@@ -52,20 +317,116 @@ public:
                      const unsigned int tileHeight,
                      const unsigned int numComps,
                      const unsigned int compPrec);
+  void EncodeAsTiles(const char* outfile,
+                     const int32_t* data,
+                     const unsigned int imageWidth,
+                     const unsigned int imageHeight,
+                     const unsigned int tileWidth,
+                     const unsigned int tileHeight,
+                     const unsigned int numComps,
+                     const unsigned int compPrec,
+                     const EncodeParams& params);
 private:
+    // Collects metrics for the outermost public decode call it is created in
+    class MetricsScope {
+    public:
+      explicit MetricsScope(J2kCodec& codec) : _codec(codec) { _codec.BeginMetrics(); }
+      ~MetricsScope() { _codec.EndMetrics(); }
+
+    private:
+      J2kCodec& _codec;
+    };
+
+    void BeginMetrics();
+    void EndMetrics();
+    void CountDecoded(const int x0, const int y0, const int x1, const int y1,
+                      const int tileId);
+    void SetMessageHandlers(opj_codec_t* codec);
     void Destroy();
+    bool Fail(const DecodeStatus status);
     void CreateInfileStream(const std::string& filename);
-    void SetupDecoder(const int resolutionLevel, const int numQualityLayers, const int x0,
-                      const int x1, const int y0, const int y1, const int numThreads);
+    bool CheckSource(const int format);
+    std::string UseMemorySource(const ByteSpan& span);
+    bool IsMemorySource(const std::string& path) const;
+    std::string UseOpenedImage(std::shared_ptr<const OpenedImage> image);
+    bool IsOpenedSource(const std::string& path) const;
+    std::shared_ptr<ImageData> DecodeCached(const std::string& path, const int resolutionLevel,
+                                            const int numQualityLayers, const int x0,
+                                            const int y0, const int x1, const int y1,
+                                            const int numThreads, const int tileId);
+    bool OpenSession(const std::string& path, const int numQualityLayers,
+                     const unsigned int numThreads);
+    bool SetupDecoder(const int numQualityLayers, const unsigned int numThreads);
+    bool DecodeImage(const std::string& path, const int resolutionLevel,
+                     const int numQualityLayers, const int x0, const int y0,
+                     const int x1, const int y1, const int numThreads,
+                     const int tileId = -1);
+    bool DecodeSession(const int resolutionLevel, const int x0, const int y0,
+                       const int x1, const int y1, const int tileId);
+    const CodestreamIndex* SessionIndex();
+    bool DecodeIndexed(const int resolutionLevel, const int x0, const int y0, const int x1,
+                       const int y1, const int tileId, const unsigned int numThreads);
+    bool OpenSubstream(const CodestreamIndex& index, const std::vector<uint32_t>& tiles,
+                       const unsigned int numThreads);
+    bool DecodeSubstream(const int resolutionLevel, const int x0, const int y0, const int x1,
+                         const int y1, const int tileId);
+    void DestroySubstream();
+    std::shared_ptr<ImageData> DetachComponent(const uint32_t compno);
+    std::shared_ptr<ImageData> CropComponent(const uint32_t compno, const DecodeRegion& region,
+                                             const int resolutionLevel);
+    bool ConvertImage(void* buffer, const SampleFormat format, const uint32_t numComps);
 
     opj_codestream_info_v2_t* _codestreamInfo;
     opj_codec_t* _decoder;
     opj_dparameters_t _decoderParams;
     opj_image_t* _image;
+    // Decoder over _substream, kept while only tile decodes of its tile follow, and the
+    // image it decodes into
+    opj_codec_t* _substreamDecoder;
+    opj_stream_t* _substreamStream;
+    opj_image_t* _indexedImage;
+    std::vector<uint32_t> _substreamTiles;
+    unsigned int _substreamThreads;
+    bool _substreamReusable;
+    // The image the last decode wrote to
+    opj_image_t* _decoded;
     opj_header_info_t _headerInfo;
+    ImageInfo _imageInfo;
+
+    std::vector<uint8_t> _xmlBuffer;
 
     std::string _infileName;
+    int _infileFormat;
     opj_stream_t* _infileStream;
+    // Caller owned bytes of the last span source, and the bytes the session reads from
+    ByteSpan _memorySource;
+    ByteSpan _sessionBytes;
+    MappedFile _mappedFile;
+    // Shared file of the last OpenedImage source
+    std::shared_ptr<const OpenedImage> _opened;
+    bool _useMmap;
+    std::shared_ptr<DecodeCache> _decodeCache;
+    std::shared_ptr<BufferPool> _bufferPool;
+    IndexMode _indexMode;
+    // Index of the session's file, kept (even when building it failed) until Reset()
+    std::unique_ptr<CodestreamIndex> _index;
+    std::vector<uint8_t> _substream;
+    int _sessionLayers;
+    // The session's file as it was when it was opened
+    FileStamp _sessionStamp;
+    // Threads the session was set up for, and those libopenjp2 accepted
+    unsigned int _sessionThreads;
+    unsigned int _decoderThreads;
+    // Whether the session's decoder has decoded anything, and a region or the whole image
+    bool _sessionDecoded;
+    bool _sessionAreaDecoded;
+    DecodeMetrics _metrics;
+    DecodeStatus _status;
+    DecodeLimits _limits;
+    MetricsSink _metricsSink;
+    int _metricsDepth;
+    std::chrono::steady_clock::time_point _metricsStart;
+    StreamCounters _streamCounters;
     bool _verboseMode;
 };
 } // namespace j2c
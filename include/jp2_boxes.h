@@ -0,0 +1,32 @@
+#ifndef JP2_BOXES_H
+#define JP2_BOXES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace j2c {
+
+// Largest XML box payload we are willing to load. Anything bigger is treated as a
+// corrupt length field rather than metadata.
+constexpr uint64_t MAX_XML_BOX_SIZE = 64ull * 1024 * 1024;
+
+// Defined in codestream_check.h, which needs MAX_XML_BOX_SIZE from here
+enum class DecodeStatus;
+
+// Walks the JP2 box headers of `path` and reads the payload of the first `xml ` box,
+// descending into `asoc` superboxes (where `lbl ` + `xml ` pairs live). Only box
+// headers and the XML payload are read; the codestream is skipped with seeks and no
+// decoder is created. On OK `xml` holds the payload followed by a terminating NUL that
+// is not counted in `length`. Otherwise NO_XML for a JP2 file or raw codestream
+// without one, OPEN_FAILED, UNSUPPORTED for anything else than JPEG 2000, and
+// MALFORMED for truncated or inconsistent boxes or an oversized XML box.
+DecodeStatus ReadJp2XmlBox(const std::string& path, std::vector<uint8_t>& xml,
+                           size_t& length);
+// Same walk over a JP2 file already in memory
+DecodeStatus ReadJp2XmlBox(const uint8_t* data, const size_t size, std::vector<uint8_t>& xml,
+                           size_t& length);
+
+} // namespace j2c
+
+#endif // JP2_BOXES_H
@@ -0,0 +1,66 @@
+#ifndef OPENED_IMAGE_H
+#define OPENED_IMAGE_H
+
+#include "codestream_check.h"
+#include "codestream_index.h"
+#include "j2k_stream.h"
+#include "j2kcodec.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace j2c {
+
+// A file opened once and shared read-only by any number of codecs and threads: the
+// bytes (a mapping, or a handle read with pread), the parsed main header and the
+// codestream index. Nothing changes after Open(), so no locking is needed; every
+// stream and substream made from it keeps its own read position.
+//
+// libopenjp2 keeps the parsed header inside its codec object and cannot share it, so
+// each thread still parses the header once, in its own J2kCodec session (see
+// J2kCodec::Open(std::shared_ptr<const OpenedImage>)). Region and tile decodes after
+// that only read the tile-parts the shared index points at.
+class OpenedImage {
+public:
+  // Null when the file cannot be read, is not JPEG 2000, fails CheckCodestream against
+  // `limits` or has a broken header. Without `memoryMapped`, or when mapping fails, the
+  // file is read with pread. An index mode of OFF skips indexing, SIDECAR loads and
+  // saves it next to the file.
+  static std::shared_ptr<const OpenedImage> Open(const std::string& path,
+                                                 const bool memoryMapped = true,
+                                                 const IndexMode indexMode = IndexMode::MEMORY,
+                                                 const DecodeLimits& limits = DecodeLimits());
+
+  const std::string& Path() const { return _path; }
+  // J2K_CFMT or JP2_CFMT
+  int Format() const { return _format; }
+  const ImageInfo& Info() const { return _info; }
+  const TileLayout& Layout() const { return _layout; }
+  uint64_t Size() const;
+  // The mapped file, empty when it is read with pread
+  ByteSpan Bytes() const { return _mapping.Span(); }
+  // Null when indexing was turned off or the codestream could not be indexed
+  const CodestreamIndex* Index() const;
+
+  // New stream over the whole file, positioned at its start
+  opj_stream_t* CreateStream(StreamCounters* counters = nullptr) const;
+  // CodestreamIndex::ExtractSubstream against the shared bytes
+  bool ExtractSubstream(const std::vector<uint32_t>& tiles, std::vector<uint8_t>& out) const;
+
+private:
+  OpenedImage() = default;
+  bool ReadHeader();
+
+  std::string _path;
+  int _format = -1;
+  ImageInfo _info = {};
+  TileLayout _layout = {};
+  MappedFile _mapping;
+  PositionalFile _file;
+  CodestreamIndex _index;
+};
+
+} // namespace j2c
+
+#endif // OPENED_IMAGE_H
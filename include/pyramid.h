@@ -0,0 +1,79 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include "j2kcodec.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace j2c {
+
+struct PyramidLevel {
+    // Each level halves the size, decoded directly at that resolution (cp_reduce)
+    int resolutionLevel;
+    int numQualityLayers = 1;
+};
+
+struct PyramidOptions {
+    std::vector<PyramidLevel> levels;
+    // Also produce the largest resolution whose longer side is at most this many
+    // pixels, 0 for none
+    uint32_t thumbnailSize = 0;
+    int thumbnailQualityLayers = 1;
+    // Files decoded at once, 0 for one per hardware thread
+    unsigned int numWorkers = 0;
+    // Threads each decode leases from the shared pool
+    int threadsPerDecode = 1;
+};
+
+// One decoded level: interleaved samples, 8 bits per sample for components of up to 8
+// bits and 16 otherwise, ready for LayoutImage/WriteImage
+struct PyramidImage {
+    PyramidLevel level;
+    bool thumbnail;
+    PooledImage image;
+    uint32_t bits;
+};
+
+struct PyramidStats {
+    size_t files;
+    size_t failed;
+    size_t levels;
+};
+
+// Called on a worker thread for every level of every file, as soon as the level is
+// decoded. The image buffer goes back to the worker's pool once the call returns, so a
+// worker holds one level at a time. Return false to count the file as failed.
+using PyramidSink = std::function<bool(const std::string& path, const PyramidImage& level)>;
+
+// Decodes several resolutions of a file without decoding full resolution and
+// resampling. Only the code-blocks of the requested resolutions are decoded, so a
+// thumbnail costs a small fraction of a full decode. The levels of a file go through
+// one J2kCodec; its header is parsed once per quality layer count for single tile
+// images and once per level for tiled ones, which libopenjp2 decodes in full once per
+// header read.
+class PyramidGenerator {
+public:
+  explicit PyramidGenerator(const PyramidOptions& options);
+
+  // Levels of `path` grouped by quality layer count, coarsest first within a group,
+  // each handed to `emit` and released before the next is decoded. Levels beyond the
+  // resolutions of the file are skipped with a warning. False when a decode fails or
+  // `emit` returned false for any level.
+  bool Generate(J2kCodec& codec, const std::string& path,
+                const std::function<bool(const PyramidImage& level)>& emit) const;
+  // Generates every file of `paths` on numWorkers threads, each owning a codec
+  PyramidStats Run(const std::vector<std::string>& paths, const PyramidSink& sink) const;
+
+  // Finest resolution level of `info` whose longer side fits `size` pixels, capped at
+  // the coarsest level the file has
+  static int LevelForSize(const ImageInfo& info, const uint32_t size);
+
+private:
+  const PyramidOptions _options;
+};
+
+} // namespace j2c
+
+#endif // PYRAMID_H
@@ -0,0 +1,43 @@
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace j2c {
+
+// Output sample types for decoded images. Integer outputs are scaled to the full range
+// of the type, FLOAT32 is normalized to [0, 1].
+enum class SampleFormat {
+    UINT8,
+    UINT16,
+    FLOAT32
+};
+
+size_t SampleSize(const SampleFormat format);
+
+// One decoded component plane as produced by the decoder
+struct ComponentPlane {
+    const int32_t* data;
+    uint32_t prec;
+    bool sgnd;
+};
+
+// Converts `count` samples from each of `numComps` planes into `dst`. Signed data is
+// DC shifted, values are clamped to the component precision and rescaled to the output
+// format. Several components are interleaved (RGB, RGBA, ...). Uses AVX2 or SSE4.1
+// when the CPU supports it.
+void ConvertSamples(const ComponentPlane* planes, const uint32_t numComps,
+                    const size_t count, void* dst, const SampleFormat format);
+
+// Converts one `width` x `height` plane into `dst`, rows `dstStride` bytes apart. Same
+// scaling as ConvertSamples, without interleaving.
+void ConvertPlane(const ComponentPlane& plane, const uint32_t width, const uint32_t height,
+                  void* dst, const size_t dstStride, const SampleFormat format);
+
+// Name of the kernel set picked at runtime ("avx2", "sse4.1" or "scalar")
+const char* ConvertKernelName();
+
+} // namespace j2c
+
+#endif // SAMPLE_CONVERT_H
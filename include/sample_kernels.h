@@ -0,0 +1,113 @@
+#ifndef SAMPLE_KERNELS_H
+#define SAMPLE_KERNELS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace j2c {
+
+// Per-row sample kernels with the component count, and for scaling the precision,
+// fixed at compile time. Constant strides and trip counts let the compiler unroll the
+// component loop and vectorize the pixel loop. Layouts without a specialization use
+// the generic version. The Select functions pick one per image, not per row.
+
+// Splits `n` interleaved pixels into one row per component, the planar layout the
+// encoder wants. Each output row is written front to back in a single pass over `src`.
+template <typename T, uint32_t N>
+inline void GatherRow(const int32_t* src, const uint32_t, const size_t n, T* const* dst) {
+    T* out[N];
+    for (uint32_t c = 0; c < N; ++c) {
+        out[c] = dst[c];
+    }
+    for (size_t x = 0; x < n; ++x, src += N) {
+        // Loading the pixel before storing lets byte stores not alias the source
+        T pixel[N];
+        for (uint32_t c = 0; c < N; ++c) {
+            pixel[c] = (T)src[c];
+        }
+        for (uint32_t c = 0; c < N; ++c) {
+            out[c][x] = pixel[c];
+        }
+    }
+}
+
+template <typename T>
+inline void GatherRowGeneric(const int32_t* src, const uint32_t numComps, const size_t n,
+                             T* const* dst) {
+    for (uint32_t c = 0; c < numComps; ++c) {
+        T* out = dst[c];
+        for (size_t x = 0; x < n; ++x) {
+            out[x] = (T)src[x * numComps + c];
+        }
+    }
+}
+
+// Interleaves `n` samples from each of the component rows in `src`
+template <typename T, uint32_t N>
+inline void InterleaveRow(const T* const* src, const uint32_t, const size_t n, T* dst) {
+    const T* in[N];
+    for (uint32_t c = 0; c < N; ++c) {
+        in[c] = src[c];
+    }
+    for (size_t x = 0; x < n; ++x, dst += N) {
+        for (uint32_t c = 0; c < N; ++c) {
+            dst[c] = in[c][x];
+        }
+    }
+}
+
+template <typename T>
+inline void InterleaveRowGeneric(const T* const* src, const uint32_t numComps, const size_t n,
+                                 T* dst) {
+    for (size_t x = 0; x < n; ++x) {
+        for (uint32_t c = 0; c < numComps; ++c) {
+            dst[x * numComps + c] = src[c][x];
+        }
+    }
+}
+
+template <typename T>
+using GatherKernel = void (*)(const int32_t*, uint32_t, size_t, T* const*);
+template <typename T>
+using InterleaveKernel = void (*)(const T* const*, uint32_t, size_t, T*);
+
+// Grey, grey + alpha, RGB and RGBA. A stride of 3 vectorizes poorly as a single pass,
+// one pass per component over the row (still in L1) measured faster for RGB.
+template <typename T>
+GatherKernel<T> SelectGather(const uint32_t numComps) {
+    static const GatherKernel<T> table[] = {GatherRowGeneric<T>, GatherRow<T, 1>,
+                                            GatherRow<T, 2>, GatherRowGeneric<T>,
+                                            GatherRow<T, 4>};
+    return numComps < sizeof(table) / sizeof(table[0]) ? table[numComps] : table[0];
+}
+
+template <typename T>
+InterleaveKernel<T> SelectInterleave(const uint32_t numComps) {
+    static const InterleaveKernel<T> table[] = {InterleaveRowGeneric<T>, InterleaveRow<T, 1>,
+                                                InterleaveRow<T, 2>, InterleaveRow<T, 3>,
+                                                InterleaveRow<T, 4>};
+    return numComps < sizeof(table) / sizeof(table[0]) ? table[numComps] : table[0];
+}
+
+// Scales `n` decoded samples of `Prec` bits to `OutBits`: signed data is DC shifted,
+// values are clamped, then shifted down or widened by replicating their top bits. Gives
+// the same results as ConvertSamples.
+template <uint32_t Prec, bool Sgnd, uint32_t OutBits, typename T>
+inline void ScaleRow(const int32_t* src, const size_t n, T* dst) {
+    static_assert(Prec >= 1 && Prec <= 30 && 2 * Prec >= OutBits, "no shift only scaling");
+    constexpr int32_t offset = Sgnd ? int32_t(1) << (Prec - 1) : 0;
+    constexpr int32_t maxValue = (int32_t(1) << Prec) - 1;
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t u = (uint32_t)std::min(std::max(src[i] + offset, 0), maxValue);
+        if constexpr (Prec >= OutBits) {
+            dst[i] = T(u >> (Prec - OutBits));
+        } else {
+            dst[i] = T((u << (OutBits - Prec)) | (u >> (2 * Prec - OutBits)));
+        }
+    }
+}
+
+} // namespace j2c
+
+#endif // SAMPLE_KERNELS_H
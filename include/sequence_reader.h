@@ -0,0 +1,98 @@
+#ifndef SEQUENCE_READER_H
+#define SEQUENCE_READER_H
+
+#include "bounded_queue.h"
+#include "buffer_pool.h"
+#include "j2kcodec.h"
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace j2c {
+
+struct SequenceOptions {
+    int resolutionLevel = 0;
+    int numQualityLayers = 1;
+    // Region on the reference grid, -1 for the whole frame
+    int x0 = -1;
+    int y0 = -1;
+    int x1 = -1;
+    int y1 = -1;
+    SampleFormat format = SampleFormat::UINT8;
+    // Frames read and decoded ahead of the consumer. One more input and frame buffer
+    // than this is kept (the frame the consumer holds), which bounds memory whatever the
+    // length of the sequence.
+    size_t lookahead = 4;
+    // Frames decoded at once
+    unsigned int numDecoders = 2;
+    // Threads each decode leases from the shared pool
+    int threadsPerDecode = 1;
+};
+
+struct SequenceFrame {
+    size_t index;
+    std::string path;
+    // Null when the frame could not be read or decoded, `status` says why
+    const uint8_t* data;
+    DecodeStatus status;
+    uint32_t w;
+    uint32_t h;
+    uint32_t numComps;
+};
+
+// Plays back an ordered list of frames. A reader thread loads the next `lookahead`
+// files into recycled input buffers while decoder threads (each owning a J2kCodec, so
+// each frame's header is parsed once, off the consumer's thread) decode them into
+// interleaved samples. Next() hands frames out strictly in order, so throughput is set
+// by decode speed rather than by I/O or header parsing at frame boundaries.
+class SequenceReader {
+public:
+  SequenceReader(std::vector<std::string> paths, const SequenceOptions& options);
+  ~SequenceReader();
+
+  // .jp2/.j2k/.j2c/.jpc files of `directory` in name order, which is time order for
+  // timestamped file names
+  static std::vector<std::string> ListDirectory(const std::string& directory);
+
+  // Waits for the next frame. Its data stays valid until the following Next() call.
+  // False after the last frame.
+  bool Next(SequenceFrame& frame);
+  size_t NumFrames() const { return _paths.size(); }
+
+private:
+  enum class SlotState { FREE, LOADED, DONE };
+
+  struct Slot {
+      SlotState state = SlotState::FREE;
+      size_t index = 0;
+      std::vector<uint8_t> input;
+      PooledImage image;
+      DecodeStatus status = DecodeStatus::OK;
+  };
+
+  void ReadFrames();
+  void DecodeFrames();
+  void Stop();
+
+  const std::vector<std::string> _paths;
+  const SequenceOptions _options;
+  std::vector<Slot> _slots;
+  // Frames waiting for a decoder, by index
+  BoundedQueue<size_t> _decodeQueue;
+  // Frame buffers shared by the decoders' codecs, recycled as frames are consumed
+  std::shared_ptr<BufferPool> _framePool;
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  size_t _next = 0;
+  bool _stopping = false;
+  std::thread _reader;
+  std::vector<std::thread> _decoders;
+};
+
+} // namespace j2c
+
+#endif // SEQUENCE_READER_H
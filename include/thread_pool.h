@@ -0,0 +1,92 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace j2c {
+
+// How the shared core budget is spent when several decodes run at once
+enum class ThreadPolicy {
+    // A decode gets as many threads as it asks for and the budget has left (latency)
+    INTRA_IMAGE,
+    // Every decode is single threaded, cores go to concurrent requests (throughput)
+    INTER_REQUEST
+};
+
+// Fixed set of workers plus a core budget. Shared() is the process wide instance used
+// by every J2kCodec: tasks submitted by the library run on its workers, and decoder
+// threads inside libopenjp2 are leased from its budget so that concurrent decodes
+// never run more threads than there are cores.
+class ThreadPool {
+public:
+  static ThreadPool& Shared();
+
+  // 0 means one worker per hardware thread
+  explicit ThreadPool(unsigned int numThreads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  template <typename F>
+  auto Submit(F&& task) -> std::future<decltype(task())> {
+    using Result = decltype(task());
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+    std::future<Result> result = packaged->get_future();
+    Enqueue([packaged] { (*packaged)(); });
+    return result;
+  }
+
+  unsigned int Size() const { return (unsigned int)_workers.size(); }
+
+  void SetPolicy(const ThreadPolicy policy);
+  ThreadPolicy Policy() const;
+
+  // Takes up to `requested` threads (0 = all cores) from the budget according to the
+  // policy. Always grants at least one, the caller's own thread.
+  unsigned int AcquireThreads(const unsigned int requested);
+  void ReleaseThreads(const unsigned int count);
+
+private:
+  void Enqueue(std::function<void()> task);
+  void WorkerLoop();
+
+  std::vector<std::thread> _workers;
+  std::deque<std::function<void()>> _tasks;
+  std::mutex _taskMutex;
+  std::condition_variable _taskReady;
+  bool _stopping;
+
+  mutable std::mutex _budgetMutex;
+  unsigned int _budget;
+  unsigned int _leased;
+  ThreadPolicy _policy;
+};
+
+// Holds threads from a pool's budget for the duration of a scope
+class ThreadLease {
+public:
+  ThreadLease(ThreadPool& pool, const unsigned int requested)
+      : _pool(pool), _count(pool.AcquireThreads(requested)) {}
+  ~ThreadLease() { _pool.ReleaseThreads(_count); }
+
+  ThreadLease(const ThreadLease&) = delete;
+  ThreadLease& operator=(const ThreadLease&) = delete;
+
+  unsigned int Count() const { return _count; }
+
+private:
+  ThreadPool& _pool;
+  const unsigned int _count;
+};
+
+} // namespace j2c
+
+#endif // THREAD_POOL_H
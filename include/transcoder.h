@@ -0,0 +1,58 @@
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include "j2kcodec.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace j2c {
+
+struct TranscodeJob {
+    std::string input;
+    // The extension picks the output format, see FormatFromExtension. Supported are
+    // .raw/.rawl (planar, big/little endian), .pgm/.ppm/.pnm, .pgx (one file per
+    // component beyond the first) and .j2k/.jp2 (re-encoded with EncodeAsTiles).
+    std::string output;
+};
+
+struct TranscodeOptions {
+    int resolutionLevel = 0;
+    int numQualityLayers = 1;
+    // Concurrent decodes, 0 for one per hardware thread
+    unsigned int numDecoders = 0;
+    // Threads each decode leases from the shared pool
+    int threadsPerDecode = 1;
+    // Images in flight per stage. Each stage recycles this many buffers, which bounds
+    // peak memory to roughly 3 x depth decoded images.
+    size_t depth = 4;
+    // Tile size and layout when re-encoding to .j2k/.jp2
+    unsigned int tileWidth = 512;
+    unsigned int tileHeight = 512;
+    EncodeParams encodeParams;
+};
+
+struct TranscodeStats {
+    size_t files;
+    size_t failed;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+};
+
+// Converts files with four overlapping stages connected by bounded queues: a reader
+// loading input bytes, decoders (each with its own J2kCodec) producing interleaved
+// 8 or 16 bit samples, a converter laying them out for the output format, and a
+// writer storing or re-encoding them. Components above 8 bits are scaled to 16.
+class Transcoder {
+public:
+  explicit Transcoder(const TranscodeOptions& options = TranscodeOptions());
+
+  TranscodeStats Run(const std::vector<TranscodeJob>& jobs);
+
+private:
+  const TranscodeOptions _options;
+};
+
+} // namespace j2c
+
+#endif // TRANSCODER_H
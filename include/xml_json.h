@@ -0,0 +1,105 @@
+#ifndef XML_JSON_H
+#define XML_JSON_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace j2c {
+
+// Converts the XML of a JP2 `xml ` box to JSON without building a DOM, producing the
+// same output as xml2json() (values as strings, "@" attributes, "#text" for mixed
+// content, repeated elements as arrays). The input is read up to `length` bytes or
+// the first NUL and does not need to be terminated. Parsed nodes and the output live
+// in buffers reused by every call, so one converter per thread converts a crawl of
+// files without allocating per file.
+class XmlJsonConverter {
+public:
+  // Emit only elements named in `keys`, in full, plus the elements enclosing them. The
+  // result is what xml2json gives for the XML with everything else removed. Empty
+  // keeps everything.
+  void SetKeyFilter(const std::vector<std::string>& keys);
+
+  // False on malformed XML (where xml2json would throw)
+  bool Convert(const uint8_t* xml, const size_t length);
+  // JSON of the last successful Convert(), valid until the next call
+  const std::string& Json() const { return _json; }
+
+private:
+  enum class NodeType : uint8_t { ELEMENT, DATA, CDATA };
+
+  struct Node {
+      NodeType type;
+      // Input bytes for element names, _values bytes for data
+      uint32_t nameOffset;
+      uint32_t nameLength;
+      uint32_t valueOffset;
+      uint32_t valueLength;
+      uint32_t firstAttribute;
+      uint32_t numAttributes;
+      uint32_t parent;
+      uint32_t firstChild;
+      uint32_t nextSibling;
+      uint32_t numChildren;
+      // Next node in the same JSON array while emitting
+      uint32_t nextValue;
+      // Named in the key filter
+      bool match;
+      // Matches, or encloses an element that does
+      bool keep;
+  };
+
+  struct Attribute {
+      uint32_t nameOffset;
+      uint32_t nameLength;
+      uint32_t valueOffset;
+      uint32_t valueLength;
+  };
+
+  // A member of the JSON object being emitted, one or more nodes
+  struct Member {
+      std::string_view name;
+      uint32_t first;
+      uint32_t last;
+      uint32_t count;
+  };
+
+  char At(const size_t i) const { return _pos + i < _end ? _pos[i] : '\0'; }
+  void SkipWhitespace();
+  bool SkipPast(const char* marker);
+  bool ParseNode(const uint32_t parent, uint32_t& lastChild);
+  bool ParseElement(const uint32_t parent, uint32_t& lastChild);
+  bool ParseContents(const uint32_t node);
+  bool ParseText(const char terminator, uint32_t& offset, uint32_t& length);
+  uint32_t AddNode(const NodeType type, const uint32_t parent, uint32_t& lastChild);
+  void MarkKept();
+
+  void EmitNode(const uint32_t node, const bool full, const size_t depth);
+  void EmitObject(const uint32_t node, const bool full, const size_t depth);
+  void EmitString(std::string_view s);
+  std::string_view Name(const Node& node) const;
+  std::string_view Value(const Node& node) const;
+
+  const char* _begin = nullptr;
+  const char* _end = nullptr;
+  const char* _pos = nullptr;
+
+  std::vector<Node> _nodes;
+  std::vector<Attribute> _attributes;
+  size_t _depth = 0;
+  // Entity decoded data and attribute values
+  std::string _values;
+  // Member lists of the objects being emitted, one per depth
+  std::vector<std::vector<Member>> _members;
+  std::string _json;
+
+  std::vector<std::string> _keys;
+  std::unordered_set<std::string_view> _keySet;
+};
+
+} // namespace j2c
+
+#endif // XML_JSON_H
@@ -0,0 +1,189 @@
+#include "buffer_pool.h"
+#include <algorithm>
+#include <new>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace {
+constexpr size_t BUFFER_ALIGNMENT = 64;
+constexpr size_t PAGE_SIZE_BYTES = 4096;
+// Smallest size class, smaller requests are rounded up to it
+constexpr unsigned int MIN_CLASS_BITS = 12;
+constexpr unsigned int NUM_CLASSES = 48;
+
+unsigned int SizeClass(const size_t size) {
+    unsigned int bits = MIN_CLASS_BITS;
+    while (bits < NUM_CLASSES - 1 + MIN_CLASS_BITS && (size_t(1) << bits) < size) {
+        ++bits;
+    }
+    return bits - MIN_CLASS_BITS;
+}
+
+uint8_t* Allocate(const size_t capacity, const bool prefault) {
+    uint8_t* data = static_cast<uint8_t*>(
+          ::operator new(capacity, std::align_val_t(BUFFER_ALIGNMENT), std::nothrow));
+    if (data && prefault) {
+        // One write per page maps it now instead of on first use
+        for (size_t offset = 0; offset < capacity; offset += PAGE_SIZE_BYTES) {
+            data[offset] = 0;
+        }
+    }
+    return data;
+}
+
+void Free(uint8_t* data) {
+    ::operator delete(data, std::align_val_t(BUFFER_ALIGNMENT));
+}
+} // namespace
+
+namespace j2c {
+
+struct BufferPool::Shared {
+    std::mutex mutex;
+    std::vector<uint8_t*> free[NUM_CLASSES];
+    size_t maxRetainedBytes;
+    bool prefault;
+    BufferPoolStats stats;
+
+    ~Shared() {
+        for (auto& buffers : free) {
+            for (uint8_t* data : buffers) {
+                Free(data);
+            }
+        }
+    }
+
+    void Release(uint8_t* data, const size_t capacity) {
+        std::unique_lock<std::mutex> lock(mutex);
+        stats.outstandingBytes -= capacity;
+        if (stats.retainedBytes + capacity > maxRetainedBytes) {
+            ++stats.discards;
+            lock.unlock();
+            Free(data);
+            return;
+        }
+        free[SizeClass(capacity)].push_back(data);
+        stats.retainedBytes += capacity;
+        stats.peakRetainedBytes = std::max(stats.peakRetainedBytes, stats.retainedBytes);
+    }
+};
+
+BufferPool::BufferPool(const size_t maxRetainedBytes, const bool prefault)
+    : _shared(std::make_shared<Shared>())
+{
+    _shared->maxRetainedBytes = maxRetainedBytes;
+    _shared->prefault = prefault;
+    _shared->stats = BufferPoolStats();
+}
+
+PooledBuffer BufferPool::Acquire(const size_t size) {
+    const unsigned int sizeClass = SizeClass(size);
+    const size_t capacity = size_t(1) << (sizeClass + MIN_CLASS_BITS);
+    if (capacity < size) {
+        return PooledBuffer();
+    }
+
+    bool prefault;
+    {
+        std::lock_guard<std::mutex> lock(_shared->mutex);
+        ++_shared->stats.acquires;
+        std::vector<uint8_t*>& buffers = _shared->free[sizeClass];
+        if (!buffers.empty()) {
+            uint8_t* data = buffers.back();
+            buffers.pop_back();
+            ++_shared->stats.reuses;
+            _shared->stats.retainedBytes -= capacity;
+            _shared->stats.outstandingBytes += capacity;
+            return PooledBuffer(_shared, data, size, capacity);
+        }
+        prefault = _shared->prefault;
+    }
+
+    // Allocate and prefault outside the lock, this is the slow path
+    uint8_t* data = Allocate(capacity, prefault);
+    if (!data) {
+        return PooledBuffer();
+    }
+    std::lock_guard<std::mutex> lock(_shared->mutex);
+    ++_shared->stats.allocations;
+    _shared->stats.outstandingBytes += capacity;
+    return PooledBuffer(_shared, data, size, capacity);
+}
+
+void BufferPool::SetMaxRetainedBytes(const size_t bytes) {
+    std::lock_guard<std::mutex> lock(_shared->mutex);
+    _shared->maxRetainedBytes = bytes;
+}
+
+void BufferPool::Trim() {
+    std::vector<uint8_t*> released;
+    {
+        std::lock_guard<std::mutex> lock(_shared->mutex);
+        for (auto& buffers : _shared->free) {
+            released.insert(released.end(), buffers.begin(), buffers.end());
+            buffers.clear();
+        }
+        _shared->stats.retainedBytes = 0;
+    }
+    for (uint8_t* data : released) {
+        Free(data);
+    }
+}
+
+BufferPoolStats BufferPool::Stats() const {
+    std::lock_guard<std::mutex> lock(_shared->mutex);
+    return _shared->stats;
+}
+
+PooledBuffer::~PooledBuffer() {
+    Release();
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept {
+    *this = std::move(other);
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        Release();
+        _pool = std::move(other._pool);
+        _data = other._data;
+        _size = other._size;
+        _capacity = other._capacity;
+        other._data = nullptr;
+        other._size = 0;
+        other._capacity = 0;
+    }
+    return *this;
+}
+
+void PooledBuffer::Release() {
+    if (_data) {
+        _pool->Release(_data, _capacity);
+    }
+    _pool.reset();
+    _data = nullptr;
+    _size = 0;
+    _capacity = 0;
+}
+
+bool RetainHeapForDecode(const size_t bytes) {
+#if defined(__GLIBC__)
+    // glibc before 2.35 refuses mmap thresholds above HEAP_MAX_SIZE / 2
+    // (DEFAULT_MMAP_THRESHOLD_MAX), capping keeps the behaviour the same on all versions
+    const size_t maxMmapThreshold = 4 * 1024 * 1024 * sizeof(long);
+    const int mmapThreshold = (int)std::min(bytes, maxMmapThreshold);
+    const int trimThreshold = (int)std::min<size_t>(bytes, 1u << 30);
+    // Set apart, so a refused mmap threshold does not also skip the trim threshold
+    const bool mmapSet = mallopt(M_MMAP_THRESHOLD, mmapThreshold) == 1;
+    const bool trimSet = mallopt(M_TRIM_THRESHOLD, trimThreshold) == 1;
+    return mmapSet && trimSet;
+#else
+    (void)bytes;
+    return false;
+#endif
+}
+
+} // namespace j2c
@@ -0,0 +1,356 @@
+#include "codestream_check.h"
+#include "byte_reader.h"
+#include "format_defs.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define JP2_SIGNATURE_BOX "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
+
+#define JP2_BOX_FTYP 0x66747970 // 'ftyp'
+#define JP2_BOX_JP2H 0x6a703268 // 'jp2h'
+#define JP2_BOX_IHDR 0x69686472 // 'ihdr'
+#define JP2_BOX_JP2C 0x6a703263 // 'jp2c'
+#define JP2_BOX_XML 0x786d6c20  // 'xml '
+
+#define J2K_MS_SOC 0xff4f
+#define J2K_MS_SIZ 0xff51
+#define J2K_MS_COD 0xff52
+#define J2K_MS_QCD 0xff5c
+#define J2K_MS_SOT 0xff90
+
+namespace {
+using j2c::BoxHeader;
+using j2c::DecodeLimits;
+using j2c::DecodeStatus;
+
+// Top level boxes walked before giving up; real files have a handful
+constexpr uint32_t MAX_TOP_LEVEL_BOXES = 1024;
+// Isot is 16 bits
+constexpr uint64_t MAX_TILES = 65535;
+// Highest component precision the codec decodes
+constexpr uint32_t MAX_PRECISION = 31;
+constexpr uint32_t MAX_DECOMPOSITIONS = 32;
+
+template <typename Reader>
+class StructureCheck {
+public:
+    StructureCheck(Reader& reader, const DecodeLimits& limits, std::string* detail)
+        : _reader(reader), _limits(limits), _detail(detail) {}
+
+    DecodeStatus Run() {
+        unsigned char magic[12];
+        if (!_reader.Read(0, magic, sizeof(magic))) {
+            return Fail(DecodeStatus::MALFORMED, "shorter than a file header");
+        }
+        const int format = j2c::GetMagicFormat(magic, sizeof(magic));
+        if (format < 0) {
+            return Fail(DecodeStatus::UNSUPPORTED, "neither JP2 nor a J2K codestream");
+        }
+        uint64_t start = 0;
+        uint64_t end = _reader.Size();
+        if (format == JP2_CFMT) {
+            const DecodeStatus status = CheckBoxes(start, end);
+            if (status != DecodeStatus::OK) {
+                return status;
+            }
+        }
+        return CheckMainHeader(start, end);
+    }
+
+private:
+    DecodeStatus Fail(const DecodeStatus status, const char* reason) {
+        if (_detail) {
+            *_detail = reason;
+        }
+        return status;
+    }
+
+    // Finds the codestream box, checking the boxes the codec reads before it
+    DecodeStatus CheckBoxes(uint64_t& start, uint64_t& end) {
+        const uint64_t fileSize = _reader.Size();
+        BoxHeader box;
+        if (!ReadBoxHeader(_reader, 12, box) || box.type != JP2_BOX_FTYP ||
+            box.payloadEnd == 0 || box.payloadEnd > fileSize ||
+            box.payloadEnd - box.payloadStart < 8) {
+            return Fail(DecodeStatus::MALFORMED, "no file type box after the signature");
+        }
+
+        bool haveHeader = false;
+        uint64_t pos = box.payloadEnd;
+        for (uint32_t n = 0; n < MAX_TOP_LEVEL_BOXES; ++n) {
+            if (pos >= fileSize || !ReadBoxHeader(_reader, pos, box)) {
+                return Fail(DecodeStatus::MALFORMED, "no codestream box");
+            }
+            if (box.type == JP2_BOX_JP2C) {
+                if (!haveHeader) {
+                    return Fail(DecodeStatus::MALFORMED, "codestream box before the header box");
+                }
+                // A truncated codestream box is left to the codec, which may still decode
+                // the tile-parts that are there
+                start = box.payloadStart;
+                end = box.payloadEnd && box.payloadEnd < fileSize ? box.payloadEnd : fileSize;
+                return DecodeStatus::OK;
+            }
+            if (box.payloadEnd == 0 || box.payloadEnd > fileSize) {
+                return Fail(DecodeStatus::MALFORMED, "box runs past the end of the file");
+            }
+            const uint64_t payloadLength = box.payloadEnd - box.payloadStart;
+            if ((box.type == JP2_BOX_JP2H || box.type == JP2_BOX_XML) &&
+                payloadLength > _limits.maxMetadataBytes) {
+                return Fail(DecodeStatus::LIMIT_EXCEEDED, "header or XML box too large");
+            }
+            if (box.type == JP2_BOX_JP2H) {
+                if (haveHeader) {
+                    return Fail(DecodeStatus::MALFORMED, "more than one header box");
+                }
+                const DecodeStatus status = CheckImageHeader(box);
+                if (status != DecodeStatus::OK) {
+                    return status;
+                }
+                haveHeader = true;
+            }
+            pos = box.payloadEnd;
+        }
+        return Fail(DecodeStatus::LIMIT_EXCEEDED, "too many boxes before the codestream");
+    }
+
+    // The image header box comes first in the header box
+    DecodeStatus CheckImageHeader(const BoxHeader& jp2h) {
+        BoxHeader ihdr;
+        unsigned char buf[14];
+        if (!ReadBoxHeader(_reader, jp2h.payloadStart, ihdr) || ihdr.type != JP2_BOX_IHDR ||
+            ihdr.payloadEnd == 0 || ihdr.payloadEnd > jp2h.payloadEnd ||
+            ihdr.payloadEnd - ihdr.payloadStart != sizeof(buf) ||
+            !_reader.Read(ihdr.payloadStart, buf, sizeof(buf))) {
+            return Fail(DecodeStatus::MALFORMED, "no image header box");
+        }
+        const uint32_t height = j2c::ReadUint32BE(buf);
+        const uint32_t width = j2c::ReadUint32BE(buf + 4);
+        _boxComponents = j2c::ReadUint16BE(buf + 8);
+        if (width == 0 || height == 0 || _boxComponents == 0) {
+            return Fail(DecodeStatus::MALFORMED, "empty image in the image header box");
+        }
+        // Compression type 7 is the only one defined
+        if (buf[11] != 7) {
+            return Fail(DecodeStatus::MALFORMED, "unknown compression type");
+        }
+        return DecodeStatus::OK;
+    }
+
+    // Marker segments from SOC to the first SOT
+    DecodeStatus CheckMainHeader(const uint64_t start, const uint64_t end) {
+        unsigned char buf[12];
+        if (start + 4 > end || !_reader.Read(start, buf, 4) ||
+            j2c::ReadUint16BE(buf) != J2K_MS_SOC || j2c::ReadUint16BE(buf + 2) != J2K_MS_SIZ) {
+            return Fail(DecodeStatus::MALFORMED, "codestream does not start with SOC and SIZ");
+        }
+
+        bool haveSiz = false;
+        bool haveCod = false;
+        bool haveQcd = false;
+        uint64_t pos = start + 2;
+        for (;;) {
+            if (pos + 4 > end || !_reader.Read(pos, buf, 4)) {
+                return Fail(DecodeStatus::MALFORMED, "main header is truncated");
+            }
+            const uint16_t marker = j2c::ReadUint16BE(buf);
+            if ((marker >> 8) != 0xff) {
+                return Fail(DecodeStatus::MALFORMED, "marker expected in the main header");
+            }
+            if (marker == J2K_MS_SOT) {
+                break;
+            }
+            const uint16_t length = j2c::ReadUint16BE(buf + 2);
+            if (length < 2 || pos + 2 + length > end) {
+                return Fail(DecodeStatus::MALFORMED, "marker segment runs past the codestream");
+            }
+
+            DecodeStatus status = DecodeStatus::OK;
+            if (marker == J2K_MS_SIZ) {
+                if (haveSiz) {
+                    return Fail(DecodeStatus::MALFORMED, "more than one SIZ");
+                }
+                haveSiz = true;
+                status = ReadSegment(pos, length) ? CheckSiz()
+                                                  : Fail(DecodeStatus::MALFORMED, "truncated SIZ");
+            } else if (marker == J2K_MS_COD) {
+                haveCod = true;
+                status = ReadSegment(pos, length) ? CheckCod()
+                                                  : Fail(DecodeStatus::MALFORMED, "truncated COD");
+            } else if (marker == J2K_MS_QCD) {
+                haveQcd = true;
+            }
+            if (status != DecodeStatus::OK) {
+                return status;
+            }
+            pos += 2 + uint64_t(length);
+        }
+        if (!haveCod || !haveQcd) {
+            return Fail(DecodeStatus::MALFORMED, "main header without COD or QCD");
+        }
+
+        // First tile-part header
+        if (pos + sizeof(buf) > end || !_reader.Read(pos, buf, sizeof(buf))) {
+            return Fail(DecodeStatus::MALFORMED, "tile-part header is truncated");
+        }
+        const uint32_t tilePartLength = j2c::ReadUint32BE(buf + 6);
+        if (j2c::ReadUint16BE(buf + 2) != 10 || j2c::ReadUint16BE(buf + 4) >= _numTiles ||
+            (tilePartLength != 0 && tilePartLength < 14)) {
+            return Fail(DecodeStatus::MALFORMED, "inconsistent tile-part header");
+        }
+        return DecodeStatus::OK;
+    }
+
+    // Marker segment at `pos` without its marker and length
+    bool ReadSegment(const uint64_t pos, const uint16_t length) {
+        _segment.resize(length - 2);
+        return _segment.empty() || _reader.Read(pos + 4, _segment.data(), _segment.size());
+    }
+
+    DecodeStatus CheckSiz() {
+        const unsigned char* p = _segment.data();
+        if (_segment.size() < 36) {
+            return Fail(DecodeStatus::MALFORMED, "truncated SIZ");
+        }
+        const uint64_t x1 = j2c::ReadUint32BE(p + 2);
+        const uint64_t y1 = j2c::ReadUint32BE(p + 6);
+        const uint64_t x0 = j2c::ReadUint32BE(p + 10);
+        const uint64_t y0 = j2c::ReadUint32BE(p + 14);
+        const uint64_t tileWidth = j2c::ReadUint32BE(p + 18);
+        const uint64_t tileHeight = j2c::ReadUint32BE(p + 22);
+        const uint64_t tileX0 = j2c::ReadUint32BE(p + 26);
+        const uint64_t tileY0 = j2c::ReadUint32BE(p + 30);
+        const uint32_t numComps = j2c::ReadUint16BE(p + 34);
+        if (numComps == 0 || _segment.size() != 36 + 3 * size_t(numComps)) {
+            return Fail(DecodeStatus::MALFORMED, "SIZ length does not match its components");
+        }
+        if (_boxComponents != 0 && numComps != _boxComponents) {
+            return Fail(DecodeStatus::MALFORMED, "SIZ and the image header box disagree");
+        }
+        if (x1 <= x0 || y1 <= y0) {
+            return Fail(DecodeStatus::MALFORMED, "empty image area");
+        }
+        if (tileWidth == 0 || tileHeight == 0 || tileX0 > x0 || tileY0 > y0 ||
+            tileX0 + tileWidth <= x0 || tileY0 + tileHeight <= y0) {
+            return Fail(DecodeStatus::MALFORMED, "tile grid does not cover the image");
+        }
+        _numTiles = ((x1 - tileX0 + tileWidth - 1) / tileWidth) *
+                    ((y1 - tileY0 + tileHeight - 1) / tileHeight);
+        if (_numTiles > MAX_TILES) {
+            return Fail(DecodeStatus::MALFORMED, "more tiles than a codestream can address");
+        }
+        if (numComps > _limits.maxComponents) {
+            return Fail(DecodeStatus::LIMIT_EXCEEDED, "too many components");
+        }
+        if ((x1 - x0) * (y1 - y0) > _limits.maxPixels) {
+            return Fail(DecodeStatus::LIMIT_EXCEEDED, "image area too large");
+        }
+        if (_numTiles * numComps > _limits.maxTileComponents) {
+            return Fail(DecodeStatus::LIMIT_EXCEEDED, "too many tile-components");
+        }
+
+        for (uint32_t c = 0; c < numComps; ++c) {
+            const unsigned char* comp = p + 36 + 3 * size_t(c);
+            if (comp[1] == 0 || comp[2] == 0) {
+                return Fail(DecodeStatus::MALFORMED, "zero component subsampling");
+            }
+            if ((comp[0] & 0x7fu) + 1 > MAX_PRECISION) {
+                return Fail(DecodeStatus::UNSUPPORTED, "component precision above 31 bits");
+            }
+        }
+        return DecodeStatus::OK;
+    }
+
+    DecodeStatus CheckCod() {
+        const unsigned char* p = _segment.data();
+        if (_segment.size() < 10) {
+            return Fail(DecodeStatus::MALFORMED, "truncated COD");
+        }
+        const uint32_t numDecompositions = p[5];
+        const uint32_t codeBlockWidth = p[6];
+        const uint32_t codeBlockHeight = p[7];
+        // User defined precincts add one size byte per resolution
+        if ((p[0] & 0x01) && _segment.size() < 10 + size_t(numDecompositions) + 1) {
+            return Fail(DecodeStatus::MALFORMED, "truncated COD");
+        }
+        if (p[1] > OPJ_CPRL || j2c::ReadUint16BE(p + 2) == 0 || p[9] > 1) {
+            return Fail(DecodeStatus::MALFORMED, "invalid COD progression, layers or wavelet");
+        }
+        if (numDecompositions > MAX_DECOMPOSITIONS || codeBlockWidth > 8 ||
+            codeBlockHeight > 8 || codeBlockWidth + codeBlockHeight > 8) {
+            return Fail(DecodeStatus::MALFORMED, "invalid COD decompositions or code-blocks");
+        }
+        return DecodeStatus::OK;
+    }
+
+    Reader& _reader;
+    const DecodeLimits& _limits;
+    std::string* _detail;
+    std::vector<uint8_t> _segment;
+    // Components of the JP2 image header box, 0 for raw codestreams
+    uint32_t _boxComponents = 0;
+    uint64_t _numTiles = 0;
+};
+
+template <typename Reader>
+DecodeStatus Check(Reader& reader, const DecodeLimits& limits, std::string* detail) {
+    StructureCheck<Reader> check(reader, limits, detail);
+    return check.Run();
+}
+} // namespace
+
+namespace j2c {
+
+const char* StatusName(const DecodeStatus status) {
+    switch (status) {
+        case DecodeStatus::OK:
+            return "ok";
+        case DecodeStatus::OPEN_FAILED:
+            return "open failed";
+        case DecodeStatus::UNSUPPORTED:
+            return "unsupported";
+        case DecodeStatus::MALFORMED:
+            return "malformed";
+        case DecodeStatus::LIMIT_EXCEEDED:
+            return "limit exceeded";
+        case DecodeStatus::INVALID_ARGUMENT:
+            return "invalid argument";
+        case DecodeStatus::DECODE_FAILED:
+            return "decode failed";
+        case DecodeStatus::OUT_OF_MEMORY:
+            return "out of memory";
+        case DecodeStatus::NO_XML:
+            return "no XML";
+    }
+    return "unknown";
+}
+
+DecodeStatus CheckCodestream(const ByteSpan& bytes, const DecodeLimits& limits,
+                             std::string* detail) {
+    MemoryReader reader(bytes.data, bytes.data ? bytes.size : 0);
+    return Check(reader, limits, detail);
+}
+
+DecodeStatus CheckCodestream(const std::string& path, const DecodeLimits& limits,
+                             std::string* detail) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        if (detail) {
+            *detail = "cannot open the file";
+        }
+        return DecodeStatus::OPEN_FAILED;
+    }
+    FileReader reader(f);
+    const DecodeStatus status = Check(reader, limits, detail);
+    fclose(f);
+    return status;
+}
+
+DecodeStatus CheckCodestream(const PositionalFile& file, const DecodeLimits& limits,
+                             std::string* detail) {
+    PositionalReader reader(file);
+    return Check(reader, limits, detail);
+}
+
+} // namespace j2c
@@ -0,0 +1,573 @@
+#include "codestream_index.h"
+#include "byte_reader.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#define JP2_SIGNATURE_BOX "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
+
+#define JP2_BOX_JP2H 0x6a703268 // 'jp2h'
+#define JP2_BOX_JP2C 0x6a703263 // 'jp2c'
+#define JP2_BOX_PCLR 0x70636c72 // 'pclr'
+#define JP2_BOX_CDEF 0x63646566 // 'cdef'
+
+#define J2K_MS_SOC 0xff4f
+#define J2K_MS_SIZ 0xff51
+#define J2K_MS_TLM 0xff55
+#define J2K_MS_PLM 0xff57
+#define J2K_MS_PLT 0xff58
+#define J2K_MS_PPM 0xff60
+#define J2K_MS_SOT 0xff90
+#define J2K_MS_SOD 0xff93
+#define J2K_MS_EOC 0xffd9
+
+namespace {
+constexpr char SIDECAR_MAGIC[4] = {'J', '2', 'C', 'I'};
+// Bump when the layout of the sidecar changes; sidecars are in native byte order and
+// are not meant to travel between machines
+constexpr uint32_t SIDECAR_VERSION = 1;
+// More tile-parts than a codestream can legally hold (65535 tiles x 255 parts)
+constexpr uint64_t MAX_TILE_PARTS = 65535ull * 255;
+
+struct SourceStamp {
+    uint64_t size;
+    int64_t mtime;
+};
+
+bool StatSource(const std::string& path, SourceStamp& stamp) {
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return false;
+    }
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    stamp.size = (uint64_t)size;
+    stamp.mtime = (int64_t)mtime.time_since_epoch().count();
+    return true;
+}
+
+template <typename Reader>
+bool Append(Reader& reader, const uint64_t offset, const uint64_t length,
+            std::vector<uint8_t>& out) {
+    const size_t at = out.size();
+    out.resize(at + length);
+    return reader.Read(offset, out.data() + at, length);
+}
+
+template <typename T>
+bool WriteArray(FILE* f, const std::vector<T>& v) {
+    const uint64_t n = v.size();
+    return fwrite(&n, sizeof(n), 1, f) == 1 &&
+           (n == 0 || fwrite(v.data(), sizeof(T), n, f) == n);
+}
+
+template <typename T>
+bool ReadArray(FILE* f, std::vector<T>& v, const uint64_t maxCount) {
+    uint64_t n = 0;
+    if (fread(&n, sizeof(n), 1, f) != 1 || n > maxCount) {
+        return false;
+    }
+    v.resize(n);
+    return n == 0 || fread(v.data(), sizeof(T), n, f) == n;
+}
+} // namespace
+
+namespace j2c {
+
+bool CodestreamIndex::Build(const std::string& path) {
+    Clear();
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    FileReader reader(f);
+    const bool ok = BuildFrom(reader);
+    fclose(f);
+    return ok;
+}
+
+bool CodestreamIndex::Build(const ByteSpan& bytes) {
+    Clear();
+    MemoryReader reader(bytes.data, bytes.size);
+    return BuildFrom(reader);
+}
+
+bool CodestreamIndex::Build(const PositionalFile& file) {
+    Clear();
+    PositionalReader reader(file);
+    return BuildFrom(reader);
+}
+
+template <typename Reader>
+bool CodestreamIndex::BuildFrom(Reader& reader) {
+    const uint64_t fileSize = reader.Size();
+    unsigned char signature[12];
+    if (!reader.Read(0, signature, sizeof(signature))) {
+        return false;
+    }
+
+    _header.codestreamStart = 0;
+    _header.codestreamEnd = fileSize;
+    if (memcmp(signature, JP2_SIGNATURE_BOX, 12) == 0) {
+        // Find the codestream box, noting header boxes that make the codec remap
+        // components after decoding
+        bool found = false;
+        uint64_t pos = 12;
+        BoxHeader box;
+        while (!found && pos < fileSize && ReadBoxHeader(reader, pos, box)) {
+            const uint64_t end = box.payloadEnd ? box.payloadEnd : fileSize;
+            if (box.type == JP2_BOX_JP2C) {
+                _header.codestreamStart = box.payloadStart;
+                _header.codestreamEnd = end;
+                found = true;
+            } else if (box.type == JP2_BOX_JP2H) {
+                BoxHeader sub;
+                for (uint64_t p = box.payloadStart; p < end && ReadBoxHeader(reader, p, sub);
+                     p = sub.payloadEnd) {
+                    if (sub.type == JP2_BOX_PCLR || sub.type == JP2_BOX_CDEF) {
+                        _header.hasPalette = 1;
+                    }
+                    if (sub.payloadEnd == 0 || sub.payloadEnd > end) {
+                        break;
+                    }
+                }
+            }
+            if (box.payloadEnd == 0) {
+                break;
+            }
+            pos = box.payloadEnd;
+        }
+        if (!found) {
+            return false;
+        }
+    }
+
+    if (!ReadMainHeader(reader) || !ReadTileParts(reader)) {
+        Clear();
+        return false;
+    }
+    Finalize();
+    return true;
+}
+
+template <typename Reader>
+bool CodestreamIndex::ReadMainHeader(Reader& reader) {
+    const uint64_t end = _header.codestreamEnd;
+    unsigned char buf[36];
+    if (!reader.Read(_header.codestreamStart, buf, 2) || ReadUint16BE(buf) != J2K_MS_SOC) {
+        return false;
+    }
+
+    bool haveSiz = false;
+    uint64_t pos = _header.codestreamStart + 2;
+    while (pos + 4 <= end) {
+        if (!reader.Read(pos, buf, 4)) {
+            return false;
+        }
+        const uint16_t marker = ReadUint16BE(buf);
+        if (marker == J2K_MS_SOT) {
+            _header.mainHeaderEnd = pos;
+            break;
+        }
+        const uint16_t length = ReadUint16BE(buf + 2);
+        if ((marker >> 8) != 0xff || length < 2) {
+            return false;
+        }
+
+        if (marker == J2K_MS_SIZ) {
+            if (length < 38 || !reader.Read(pos + 4, buf, 36)) {
+                return false;
+            }
+            _header.imageX1 = ReadUint32BE(buf + 2);
+            _header.imageY1 = ReadUint32BE(buf + 6);
+            _header.imageX0 = ReadUint32BE(buf + 10);
+            _header.imageY0 = ReadUint32BE(buf + 14);
+            _header.tileWidth = ReadUint32BE(buf + 18);
+            _header.tileHeight = ReadUint32BE(buf + 22);
+            _header.tileX0 = ReadUint32BE(buf + 26);
+            _header.tileY0 = ReadUint32BE(buf + 30);
+            haveSiz = true;
+        } else if (marker == J2K_MS_TLM || marker == J2K_MS_PLM) {
+            _dropped.push_back({pos, uint64_t(length) + 2});
+        } else if (marker == J2K_MS_PPM) {
+            _header.hasPPM = 1;
+        }
+        pos += uint64_t(length) + 2;
+    }
+
+    return haveSiz && _header.mainHeaderEnd != 0 &&
+           TileGrid(_header.numTilesX, _header.numTilesY);
+}
+
+bool CodestreamIndex::TileGrid(uint32_t& numTilesX, uint32_t& numTilesY) const {
+    if (_header.tileWidth == 0 || _header.tileHeight == 0 ||
+        _header.imageX1 <= _header.imageX0 || _header.imageY1 <= _header.imageY0 ||
+        _header.tileX0 > _header.imageX0 || _header.tileY0 > _header.imageY0) {
+        return false;
+    }
+    const uint64_t tilesX =
+          (uint64_t(_header.imageX1) - _header.tileX0 + _header.tileWidth - 1) /
+          _header.tileWidth;
+    const uint64_t tilesY =
+          (uint64_t(_header.imageY1) - _header.tileY0 + _header.tileHeight - 1) /
+          _header.tileHeight;
+    if (tilesX * tilesY > 65535) {
+        return false;
+    }
+    numTilesX = (uint32_t)tilesX;
+    numTilesY = (uint32_t)tilesY;
+    return true;
+}
+
+template <typename Reader>
+bool CodestreamIndex::ReadTileParts(Reader& reader) {
+    const uint64_t end = _header.codestreamEnd;
+    unsigned char buf[12];
+    uint64_t pos = _header.mainHeaderEnd;
+    while (pos + 2 <= end) {
+        if (!reader.Read(pos, buf, 2)) {
+            return false;
+        }
+        const uint16_t marker = ReadUint16BE(buf);
+        if (marker == J2K_MS_EOC) {
+            break;
+        }
+        if (marker != J2K_MS_SOT || _tileParts.size() >= MAX_TILE_PARTS ||
+            !reader.Read(pos, buf, 12) || ReadUint16BE(buf + 2) != 10) {
+            return false;
+        }
+
+        TilePartEntry entry = {};
+        entry.offset = pos;
+        entry.tileIndex = ReadUint16BE(buf + 4);
+        entry.partIndex = buf[10];
+        entry.length = ReadUint32BE(buf + 6);
+        if (entry.length == 0) {
+            // The last tile-part may leave its length open, it then runs up to EOC
+            unsigned char eoc[2];
+            entry.length = end - pos;
+            if (entry.length >= 2 && reader.Read(end - 2, eoc, 2) &&
+                ReadUint16BE(eoc) == J2K_MS_EOC) {
+                entry.length -= 2;
+            }
+        }
+        if (entry.tileIndex >= NumTiles() || entry.length < 14 || entry.length > end - pos ||
+            !ReadPacketLengths(reader, entry)) {
+            return false;
+        }
+        _tileParts.push_back(entry);
+        pos += entry.length;
+    }
+    return !_tileParts.empty();
+}
+
+template <typename Reader>
+bool CodestreamIndex::ReadPacketLengths(Reader& reader, TilePartEntry& entry) {
+    // Walk the tile-part header up to SOD, decoding the packet lengths of PLT segments
+    entry.firstPacket = (uint32_t)_packetLengths.size();
+    const uint64_t end = entry.offset + entry.length;
+    std::vector<uint8_t> segment;
+    unsigned char buf[4];
+    uint64_t pos = entry.offset + 12;
+    while (pos + 2 <= end) {
+        if (!reader.Read(pos, buf, 2)) {
+            return false;
+        }
+        const uint16_t marker = ReadUint16BE(buf);
+        if (marker == J2K_MS_SOD) {
+            entry.dataOffset = pos + 2;
+            entry.numPackets = (uint32_t)_packetLengths.size() - entry.firstPacket;
+            return true;
+        }
+        if (pos + 4 > end || !reader.Read(pos + 2, buf + 2, 2)) {
+            return false;
+        }
+        const uint16_t length = ReadUint16BE(buf + 2);
+        if ((marker >> 8) != 0xff || length < 2 || pos + 2 + length > end) {
+            return false;
+        }
+
+        if (marker == J2K_MS_PLT && length > 3) {
+            // Zplt, then lengths in 7 bit groups with the high bit marking continuation
+            segment.resize(length - 3);
+            if (!reader.Read(pos + 5, segment.data(), segment.size())) {
+                return false;
+            }
+            uint32_t value = 0;
+            for (const uint8_t b : segment) {
+                value = (value << 7) | (b & 0x7f);
+                if (!(b & 0x80)) {
+                    _packetLengths.push_back(value);
+                    value = 0;
+                }
+            }
+        }
+        pos += uint64_t(length) + 2;
+    }
+    return false;
+}
+
+void CodestreamIndex::Finalize() {
+    const uint32_t numTiles = NumTiles();
+    _tileStart.assign(numTiles + 1, 0);
+    for (const TilePartEntry& entry : _tileParts) {
+        ++_tileStart[entry.tileIndex + 1];
+    }
+    for (uint32_t t = 0; t < numTiles; ++t) {
+        _tileStart[t + 1] += _tileStart[t];
+    }
+    _partsByTile.resize(_tileParts.size());
+    std::vector<uint32_t> next(_tileStart.begin(), _tileStart.end() - 1);
+    for (uint32_t i = 0; i < (uint32_t)_tileParts.size(); ++i) {
+        _partsByTile[next[_tileParts[i].tileIndex]++] = i;
+    }
+    _valid = true;
+}
+
+void CodestreamIndex::Clear() {
+    _header = {};
+    _tileParts.clear();
+    _packetLengths.clear();
+    _dropped.clear();
+    _partsByTile.clear();
+    _tileStart.clear();
+    _valid = false;
+}
+
+bool CodestreamIndex::CanExtract() const {
+    return _valid && !_header.hasPPM && !_header.hasPalette && NumTiles() > 1;
+}
+
+std::vector<uint32_t> CodestreamIndex::TilesInRegion(const uint32_t x0, const uint32_t y0,
+                                                     const uint32_t x1,
+                                                     const uint32_t y1) const {
+    std::vector<uint32_t> tiles;
+    const uint32_t rx0 = std::max(x0, _header.imageX0);
+    const uint32_t ry0 = std::max(y0, _header.imageY0);
+    const uint32_t rx1 = std::min(x1, _header.imageX1);
+    const uint32_t ry1 = std::min(y1, _header.imageY1);
+    if (!_valid || rx0 >= rx1 || ry0 >= ry1) {
+        return tiles;
+    }
+
+    const uint32_t tx0 = (rx0 - _header.tileX0) / _header.tileWidth;
+    const uint32_t ty0 = (ry0 - _header.tileY0) / _header.tileHeight;
+    const uint32_t tx1 = std::min<uint32_t>(
+          _header.numTilesX,
+          uint32_t((uint64_t(rx1) - _header.tileX0 + _header.tileWidth - 1) / _header.tileWidth));
+    const uint32_t ty1 = std::min<uint32_t>(
+          _header.numTilesY,
+          uint32_t((uint64_t(ry1) - _header.tileY0 + _header.tileHeight - 1) /
+                   _header.tileHeight));
+    for (uint32_t ty = ty0; ty < ty1; ++ty) {
+        for (uint32_t tx = tx0; tx < tx1; ++tx) {
+            tiles.push_back(ty * _header.numTilesX + tx);
+        }
+    }
+    return tiles;
+}
+
+std::vector<ByteRange> CodestreamIndex::RangesForTiles(const std::vector<uint32_t>& tiles) const {
+    std::vector<ByteRange> ranges;
+    if (!_valid) {
+        return ranges;
+    }
+    ranges.push_back({_header.codestreamStart, _header.mainHeaderEnd - _header.codestreamStart});
+    for (const uint32_t tile : tiles) {
+        if (tile >= NumTiles()) {
+            continue;
+        }
+        for (uint32_t i = _tileStart[tile]; i < _tileStart[tile + 1]; ++i) {
+            const TilePartEntry& entry = _tileParts[_partsByTile[i]];
+            ranges.push_back({entry.offset, entry.length});
+        }
+    }
+
+    std::sort(ranges.begin(), ranges.end(),
+              [](const ByteRange& a, const ByteRange& b) { return a.offset < b.offset; });
+    std::vector<ByteRange> merged;
+    for (const ByteRange& range : ranges) {
+        if (!merged.empty() && range.offset <= merged.back().offset + merged.back().length) {
+            const uint64_t end = std::max(merged.back().offset + merged.back().length,
+                                          range.offset + range.length);
+            merged.back().length = end - merged.back().offset;
+        } else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
+
+bool CodestreamIndex::ExtractSubstream(const ByteSpan& source,
+                                       const std::vector<uint32_t>& tiles,
+                                       std::vector<uint8_t>& out) const {
+    MemoryReader reader(source.data, source.size);
+    return Extract(reader, tiles, out);
+}
+
+bool CodestreamIndex::ExtractSubstream(const std::string& path,
+                                       const std::vector<uint32_t>& tiles,
+                                       std::vector<uint8_t>& out) const {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    FileReader reader(f);
+    const bool ok = Extract(reader, tiles, out);
+    fclose(f);
+    return ok;
+}
+
+bool CodestreamIndex::ExtractSubstream(const PositionalFile& file,
+                                       const std::vector<uint32_t>& tiles,
+                                       std::vector<uint8_t>& out) const {
+    PositionalReader reader(file);
+    return Extract(reader, tiles, out);
+}
+
+template <typename Reader>
+bool CodestreamIndex::Extract(Reader& reader, const std::vector<uint32_t>& tiles,
+                              std::vector<uint8_t>& out) const {
+    out.clear();
+    if (!CanExtract()) {
+        return false;
+    }
+
+    // Main header without the segments that index the full stream
+    uint64_t pos = _header.codestreamStart;
+    for (const ByteRange& skip : _dropped) {
+        if (!Append(reader, pos, skip.offset - pos, out)) {
+            return false;
+        }
+        pos = skip.offset + skip.length;
+    }
+    if (!Append(reader, pos, _header.mainHeaderEnd - pos, out)) {
+        return false;
+    }
+
+    // Tile-parts keep their original order, so the open ended last tile-part of the
+    // file (Psot = 0) stays last
+    std::vector<uint32_t> parts;
+    for (const uint32_t tile : tiles) {
+        if (tile >= NumTiles()) {
+            return false;
+        }
+        parts.insert(parts.end(), _partsByTile.begin() + _tileStart[tile],
+                     _partsByTile.begin() + _tileStart[tile + 1]);
+    }
+    std::sort(parts.begin(), parts.end());
+    parts.erase(std::unique(parts.begin(), parts.end()), parts.end());
+    for (const uint32_t i : parts) {
+        if (!Append(reader, _tileParts[i].offset, _tileParts[i].length, out)) {
+            return false;
+        }
+    }
+
+    out.push_back(uint8_t(J2K_MS_EOC >> 8));
+    out.push_back(uint8_t(J2K_MS_EOC & 0xff));
+    return true;
+}
+
+std::string CodestreamIndex::SidecarPath(const std::string& path) {
+    return path + ".j2ci";
+}
+
+bool CodestreamIndex::Save(const std::string& sidecarPath,
+                           const std::string& sourcePath) const {
+    SourceStamp stamp;
+    if (!_valid || !StatSource(sourcePath, stamp)) {
+        return false;
+    }
+    // Write next to the final name and rename, readers never see a partial sidecar
+    const std::string tmpPath = sidecarPath + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC), 1, f) == 1 &&
+              fwrite(&SIDECAR_VERSION, sizeof(SIDECAR_VERSION), 1, f) == 1 &&
+              fwrite(&stamp, sizeof(stamp), 1, f) == 1 &&
+              fwrite(&_header, sizeof(_header), 1, f) == 1 && WriteArray(f, _tileParts) &&
+              WriteArray(f, _packetLengths) && WriteArray(f, _dropped);
+    ok = fclose(f) == 0 && ok;
+
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(tmpPath, sidecarPath, ec);
+        ok = !ec;
+    }
+    if (!ok) {
+        std::filesystem::remove(tmpPath, ec);
+    }
+    return ok;
+}
+
+bool CodestreamIndex::Load(const std::string& sidecarPath, const std::string& sourcePath) {
+    Clear();
+    SourceStamp current;
+    if (!StatSource(sourcePath, current)) {
+        return false;
+    }
+    FILE* f = fopen(sidecarPath.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    char magic[sizeof(SIDECAR_MAGIC)];
+    uint32_t version = 0;
+    SourceStamp stamp;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+              memcmp(magic, SIDECAR_MAGIC, sizeof(magic)) == 0 &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == SIDECAR_VERSION &&
+              fread(&stamp, sizeof(stamp), 1, f) == 1 && stamp.size == current.size &&
+              stamp.mtime == current.mtime && fread(&_header, sizeof(_header), 1, f) == 1 &&
+              ReadArray(f, _tileParts, MAX_TILE_PARTS) &&
+              ReadArray(f, _packetLengths, current.size) &&
+              ReadArray(f, _dropped, current.size);
+    fclose(f);
+
+    // A sidecar is only a cache, anything inconsistent is rejected and rebuilt. It has to
+    // hold what Build() would have produced: Extract and RangesForTiles subtract and add
+    // these offsets unchecked. Comparisons are arranged so that no sum can wrap.
+    uint32_t numTilesX = 0;
+    uint32_t numTilesY = 0;
+    ok = ok && _header.codestreamEnd <= current.size &&
+         _header.codestreamStart < _header.codestreamEnd &&
+         _header.mainHeaderEnd >= _header.codestreamStart + 2 &&
+         _header.mainHeaderEnd < _header.codestreamEnd && TileGrid(numTilesX, numTilesY) &&
+         numTilesX == _header.numTilesX && numTilesY == _header.numTilesY &&
+         !_tileParts.empty();
+    // Tile-parts in file order after the main header, not overlapping
+    uint64_t pos = _header.mainHeaderEnd;
+    for (size_t i = 0; ok && i < _tileParts.size(); ++i) {
+        const TilePartEntry& entry = _tileParts[i];
+        ok = entry.tileIndex < NumTiles() && entry.offset >= pos &&
+             entry.offset <= _header.codestreamEnd && entry.length >= 14 &&
+             entry.length <= _header.codestreamEnd - entry.offset &&
+             entry.dataOffset >= entry.offset + 14 &&
+             entry.dataOffset - entry.offset <= entry.length &&
+             entry.firstPacket <= _packetLengths.size() &&
+             entry.numPackets <= _packetLengths.size() - entry.firstPacket;
+        pos = entry.offset + entry.length;
+    }
+    // Dropped marker segments sorted inside the main header, after SOC
+    pos = _header.codestreamStart + 2;
+    for (size_t i = 0; ok && i < _dropped.size(); ++i) {
+        const ByteRange& range = _dropped[i];
+        ok = range.offset >= pos && range.offset <= _header.mainHeaderEnd &&
+             range.length >= 4 && range.length <= _header.mainHeaderEnd - range.offset;
+        pos = range.offset + range.length;
+    }
+    if (!ok) {
+        Clear();
+        return false;
+    }
+    Finalize();
+    return true;
+}
+
+} // namespace j2c
@@ -0,0 +1,143 @@
+#include "decode_cache.h"
+#include "j2kcodec.h"
+#include <filesystem>
+
+namespace {
+std::string KeyString(const j2c::DecodeKey& key) {
+    std::string id = key.path;
+    id.push_back('\0');
+    for (const int v : {key.resolutionLevel, key.numQualityLayers, key.x0, key.y0, key.x1,
+                        key.y1, key.tileId}) {
+        id += std::to_string(v);
+        id.push_back(',');
+    }
+    return id;
+}
+} // namespace
+
+namespace j2c {
+
+DecodeCache::DecodeCache(const size_t byteBudget)
+    : _budget(byteBudget)
+    , _stats()
+{
+}
+
+std::shared_ptr<ImageData> DecodeCache::GetOrLoad(const DecodeKey& key, const Loader& loader) {
+    const std::string id = KeyString(key);
+    FileStamp stamp = {0, 0};
+    const bool haveStamp = StatFile(key.path, stamp);
+
+    std::promise<std::shared_ptr<ImageData>> promise;
+    std::shared_future<std::shared_ptr<ImageData>> pending;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(id);
+        if (it != _index.end()) {
+            if (haveStamp && it->second->stamp == stamp) {
+                ++_stats.hits;
+                _lru.splice(_lru.begin(), _lru, it->second);
+                return it->second->image;
+            }
+            ++_stats.invalidations;
+            Erase(it->second);
+        }
+
+        auto inFlight = _inFlight.find(id);
+        if (inFlight != _inFlight.end()) {
+            ++_stats.coalesced;
+            pending = inFlight->second;
+        } else {
+            ++_stats.misses;
+            _inFlight.emplace(id, promise.get_future().share());
+        }
+    }
+    if (pending.valid()) {
+        return pending.get();
+    }
+
+    std::shared_ptr<ImageData> image;
+    try {
+        image = loader();
+    } catch (...) {
+        image = nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _inFlight.erase(id);
+        // Without a stamp the entry could never be validated, so don't keep it
+        if (image && haveStamp) {
+            Insert(id, image, stamp);
+        }
+    }
+    promise.set_value(image);
+    return image;
+}
+
+void DecodeCache::SetBudget(const size_t byteBudget) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _budget = byteBudget;
+    EvictToBudget();
+}
+
+void DecodeCache::Clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _lru.clear();
+    _index.clear();
+    _stats.bytes = 0;
+    _stats.entries = 0;
+}
+
+DecodeCacheStats DecodeCache::Stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+bool StatFile(const std::string& path, FileStamp& stamp) {
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return false;
+    }
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    stamp.mtime = (int64_t)mtime.time_since_epoch().count();
+    stamp.size = (uint64_t)size;
+    return true;
+}
+
+void DecodeCache::Insert(const std::string& id, const std::shared_ptr<ImageData>& image,
+                         const FileStamp& stamp) {
+    const size_t bytes = sizeof(ImageData) + size_t(image->w) * image->h * sizeof(int32_t);
+    if (bytes > _budget) {
+        return;
+    }
+    auto existing = _index.find(id);
+    if (existing != _index.end()) {
+        Erase(existing->second);
+    }
+    _lru.push_front({id, image, stamp, bytes});
+    _index[id] = _lru.begin();
+    _stats.bytes += bytes;
+    ++_stats.entries;
+    EvictToBudget();
+}
+
+void DecodeCache::Erase(EntryList::iterator entry) {
+    _stats.bytes -= entry->bytes;
+    --_stats.entries;
+    _index.erase(entry->id);
+    _lru.erase(entry);
+}
+
+void DecodeCache::EvictToBudget() {
+    while (_stats.bytes > _budget && !_lru.empty()) {
+        ++_stats.evictions;
+        Erase(std::prev(_lru.end()));
+    }
+}
+
+} // namespace j2c
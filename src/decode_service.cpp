@@ -0,0 +1,271 @@
+#include "decode_service.h"
+#include "decode_cache.h"
+#include <algorithm>
+
+namespace j2c {
+
+DecodeService::DecodeService(const DecodeServiceOptions& options)
+    : _options(options)
+    , _sequence(0)
+    , _stopping(false)
+{
+    unsigned int numWorkers = options.numWorkers;
+    if (numWorkers == 0) {
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    _workers.reserve(numWorkers);
+    for (unsigned int i = 0; i < numWorkers; ++i) {
+        _workers.emplace_back(&DecodeService::WorkerLoop, this);
+    }
+}
+
+DecodeService::~DecodeService() {
+    Shutdown();
+}
+
+DecodeTicket DecodeService::Submit(DecodeRequest request, DecodeCompletion completion) {
+    DecodeTicket ticket;
+    Enqueue(std::move(request), std::move(completion), ticket, true);
+    return ticket;
+}
+
+bool DecodeService::TrySubmit(DecodeRequest request, DecodeTicket& ticket,
+                              DecodeCompletion completion) {
+    return Enqueue(std::move(request), std::move(completion), ticket, false);
+}
+
+std::vector<DecodeTicket> DecodeService::SubmitBatch(std::vector<DecodeRequest> requests,
+                                                     DecodeCompletion completion) {
+    std::vector<DecodeTicket> tickets;
+    tickets.reserve(requests.size());
+    for (auto& request : requests) {
+        tickets.push_back(Submit(std::move(request), completion));
+    }
+    return tickets;
+}
+
+void DecodeService::Shutdown() {
+    std::vector<Job> abandoned;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopping) {
+            return;
+        }
+        _stopping = true;
+        abandoned.swap(_queue);
+    }
+    _notEmpty.notify_all();
+    _notFull.notify_all();
+    _batchFull.notify_all();
+
+    for (auto& job : abandoned) {
+        Finish(job, {nullptr, true});
+    }
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+    _workers.clear();
+}
+
+size_t DecodeService::Pending() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _queue.size();
+}
+
+bool DecodeService::Enqueue(DecodeRequest&& request, DecodeCompletion&& completion,
+                            DecodeTicket& ticket, const bool block) {
+    Job job = {std::move(request), std::move(completion),
+               std::make_shared<std::promise<DecodeResult>>(),
+               std::make_shared<std::atomic<bool>>(false), 0};
+    ticket = DecodeTicket(job.promise->get_future(), job.cancel);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    const size_t capacity = std::max<size_t>(1, _options.queueCapacity);
+    if (block) {
+        _notFull.wait(lock, [&] { return _stopping || _queue.size() < capacity; });
+    } else if (!_stopping && _queue.size() >= capacity) {
+        ticket = DecodeTicket();
+        return false;
+    }
+    if (_stopping) {
+        lock.unlock();
+        Finish(job, {nullptr, true});
+        return true;
+    }
+
+    job.sequence = _sequence++;
+    // A worker waiting out the batch window for this source takes the request directly
+    if (IsBatchable(job.request)) {
+        for (std::vector<Job>* batch : _openBatches) {
+            if (batch->size() < _options.maxBatch &&
+                SameBatch(batch->front().request, job.request)) {
+                batch->push_back(std::move(job));
+                if (batch->size() >= _options.maxBatch) {
+                    _batchFull.notify_all();
+                }
+                return true;
+            }
+        }
+    }
+    _queue.push_back(std::move(job));
+    std::push_heap(_queue.begin(), _queue.end(), JobOrder());
+    lock.unlock();
+    _notEmpty.notify_one();
+    return true;
+}
+
+void DecodeService::WorkerLoop() {
+    // One codec per worker for its whole life, so its session (and mmap) is reused by
+    // consecutive requests on the same file
+    J2kCodec codec(/*verbose=*/false);
+    codec.SetMemoryMapped(_options.memoryMapped);
+    codec.SetDecodeCache(_options.cache);
+    codec.SetMetricsSink(_options.metricsSink);
+
+    std::vector<Job> batch;
+    for (;;) {
+        batch.clear();
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _notEmpty.wait(lock, [this] { return _stopping || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+            std::pop_heap(_queue.begin(), _queue.end(), JobOrder());
+            batch.push_back(std::move(_queue.back()));
+            _queue.pop_back();
+            if (_options.batchWindow.count() > 0 && _options.maxBatch > 1 &&
+                IsBatchable(batch.front().request)) {
+                CollectBatch(lock, batch);
+            }
+        }
+        _notFull.notify_all();
+        if (batch.size() == 1) {
+            Run(codec, batch.front());
+        } else {
+            RunBatch(codec, batch);
+        }
+    }
+}
+
+void DecodeService::CollectBatch(std::unique_lock<std::mutex>& lock, std::vector<Job>& batch) {
+    // Matching requests already queued join first
+    for (size_t i = 0; i < _queue.size() && batch.size() < _options.maxBatch;) {
+        if (IsBatchable(_queue[i].request) &&
+            SameBatch(batch.front().request, _queue[i].request)) {
+            batch.push_back(std::move(_queue[i]));
+            _queue.erase(_queue.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+    std::make_heap(_queue.begin(), _queue.end(), JobOrder());
+
+    // Then those submitted while the window is open, handed over by Enqueue
+    const auto deadline = std::chrono::steady_clock::now() + _options.batchWindow;
+    _openBatches.push_back(&batch);
+    _batchFull.wait_until(lock, deadline,
+                          [&] { return _stopping || batch.size() >= _options.maxBatch; });
+    _openBatches.erase(std::find(_openBatches.begin(), _openBatches.end(), &batch));
+}
+
+bool DecodeService::IsBatchable(const DecodeRequest& request) {
+    return request.tileId < 0 && request.x0 >= 0 && request.y0 >= 0 && request.x1 >= 0 &&
+           request.y1 >= 0;
+}
+
+bool DecodeService::SameBatch(const DecodeRequest& a, const DecodeRequest& b) {
+    if (a.resolutionLevel != b.resolutionLevel || a.numQualityLayers != b.numQualityLayers ||
+        a.image != b.image) {
+        return false;
+    }
+    if (a.image) {
+        return true;
+    }
+    if (a.span.data || b.span.data) {
+        return a.span.data == b.span.data && a.span.size == b.span.size;
+    }
+    return a.path == b.path;
+}
+
+void DecodeService::Run(J2kCodec& codec, Job& job) {
+    if (*job.cancel) {
+        Finish(job, {nullptr, true});
+        return;
+    }
+
+    const DecodeRequest& r = job.request;
+    std::shared_ptr<ImageData> image;
+    if (r.image) {
+        image = r.tileId >= 0
+                      ? codec.DecodeTile(r.tileId, r.image, r.resolutionLevel,
+                                         r.numQualityLayers, _options.threadsPerDecode)
+                      : codec.Decode(r.image, r.resolutionLevel, r.numQualityLayers, r.x0,
+                                     r.y0, r.x1, r.y1, _options.threadsPerDecode);
+    } else if (r.span.data) {
+        image = r.tileId >= 0
+                      ? codec.DecodeTile(r.tileId, r.span, r.resolutionLevel,
+                                         r.numQualityLayers, _options.threadsPerDecode)
+                      : codec.Decode(r.span, r.resolutionLevel, r.numQualityLayers, r.x0,
+                                     r.y0, r.x1, r.y1, _options.threadsPerDecode);
+        // The span is only guaranteed to live until completion, drop the session on it
+        codec.Reset();
+    } else {
+        image = r.tileId >= 0
+                      ? codec.DecodeTile(r.tileId, r.path, r.resolutionLevel,
+                                         r.numQualityLayers, _options.threadsPerDecode)
+                      : codec.Decode(r.path, r.resolutionLevel, r.numQualityLayers, r.x0,
+                                     r.y0, r.x1, r.y1, _options.threadsPerDecode);
+    }
+    // Reset() keeps the status of the decode
+    Finish(job, {std::move(image), false, codec.LastStatus()});
+}
+
+void DecodeService::RunBatch(J2kCodec& codec, std::vector<Job>& batch) {
+    std::vector<Job*> live;
+    std::vector<DecodeRegion> regions;
+    for (Job& job : batch) {
+        if (*job.cancel) {
+            Finish(job, {nullptr, true});
+            continue;
+        }
+        live.push_back(&job);
+        regions.push_back({job.request.x0, job.request.y0, job.request.x1, job.request.y1});
+    }
+    if (live.size() <= 1) {
+        if (!live.empty()) {
+            Run(codec, *live.front());
+        }
+        return;
+    }
+
+    const DecodeRequest& r = live.front()->request;
+    std::vector<std::shared_ptr<ImageData>> images;
+    if (r.image) {
+        images = codec.DecodeRegions(r.image, regions, r.resolutionLevel, r.numQualityLayers,
+                                     _options.threadsPerDecode);
+    } else if (r.span.data) {
+        images = codec.DecodeRegions(r.span, regions, r.resolutionLevel, r.numQualityLayers,
+                                     _options.threadsPerDecode);
+        codec.Reset();
+    } else {
+        images = codec.DecodeRegions(r.path, regions, r.resolutionLevel, r.numQualityLayers,
+                                     _options.threadsPerDecode);
+    }
+    // The codec reports one status for the whole batch, failed regions get it
+    const DecodeStatus status = codec.LastStatus() != DecodeStatus::OK
+                                      ? codec.LastStatus()
+                                      : DecodeStatus::DECODE_FAILED;
+    for (size_t i = 0; i < live.size(); ++i) {
+        Finish(*live[i], {images[i], false, images[i] ? DecodeStatus::OK : status});
+    }
+}
+
+void DecodeService::Finish(Job& job, DecodeResult result) {
+    if (job.completion) {
+        job.completion(job.request, result);
+    }
+    job.promise->set_value(std::move(result));
+}
+
+} // namespace j2c
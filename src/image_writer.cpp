@@ -0,0 +1,145 @@
+#include "image_writer.h"
+#include "format_defs.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace {
+uint32_t SampleAt(const j2c::SampleImage& image, const size_t index) {
+    if (image.bits == 8) {
+        return image.data[index];
+    }
+    return reinterpret_cast<const uint16_t*>(image.data)[index];
+}
+
+void PutSample(uint8_t*& out, const uint32_t value, const uint32_t bits,
+               const bool bigEndian) {
+    if (bits == 8) {
+        *out++ = uint8_t(value);
+    } else if (bigEndian) {
+        *out++ = uint8_t(value >> 8);
+        *out++ = uint8_t(value);
+    } else {
+        *out++ = uint8_t(value);
+        *out++ = uint8_t(value >> 8);
+    }
+}
+
+bool WriteBytes(const std::string& path, const uint8_t* data, const size_t size) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    const bool ok = fwrite(data, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+}
+} // namespace
+
+namespace j2c {
+
+bool LayoutImage(const SampleImage& image, const int format, std::vector<uint8_t>& body) {
+    const size_t numPixels = size_t(image.width) * image.height;
+    const size_t sampleBytes = image.bits / 8;
+    switch (format) {
+        case RAW_DFMT:
+        case RAWL_DFMT:
+        case PGX_DFMT: {
+            // Planar, component after component. PGX files are split per component by
+            // WriteImage.
+            body.resize(numPixels * image.numComps * sampleBytes);
+            uint8_t* dst = body.data();
+            const bool bigEndian = format != RAWL_DFMT;
+            for (uint32_t c = 0; c < image.numComps; ++c) {
+                for (size_t i = 0; i < numPixels; ++i) {
+                    PutSample(dst, SampleAt(image, i * image.numComps + c), image.bits,
+                              bigEndian);
+                }
+            }
+            return true;
+        }
+        case PXM_DFMT: {
+            // PGM for one or two components, PPM (first three) otherwise
+            const uint32_t outComps = image.numComps >= 3 ? 3 : 1;
+            char header[64];
+            const int headerLength = snprintf(header, sizeof(header), "P%c\n%u %u\n%u\n",
+                                              outComps == 3 ? '6' : '5', image.width,
+                                              image.height, image.bits == 8 ? 255u : 65535u);
+            body.resize(headerLength + numPixels * outComps * sampleBytes);
+            memcpy(body.data(), header, headerLength);
+            uint8_t* dst = body.data() + headerLength;
+            for (size_t i = 0; i < numPixels; ++i) {
+                for (uint32_t c = 0; c < outComps; ++c) {
+                    PutSample(dst, SampleAt(image, i * image.numComps + c), image.bits, true);
+                }
+            }
+            return true;
+        }
+        case J2K_CFMT:
+        case JP2_CFMT: {
+            // EncodeAsTiles takes interleaved 32 bit samples
+            if (image.numComps > MAX_ENCODE_COMPONENTS) {
+                return false;
+            }
+            const size_t numSamples = numPixels * image.numComps;
+            body.resize(numSamples * sizeof(int32_t));
+            int32_t* dst = reinterpret_cast<int32_t*>(body.data());
+            for (size_t i = 0; i < numSamples; ++i) {
+                dst[i] = (int32_t)SampleAt(image, i);
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool WriteImage(J2kCodec& encoder, const std::vector<uint8_t>& body, const SampleImage& image,
+                const std::string& output, const int format,
+                const ImageEncodeOptions& options, uint64_t& written) {
+    std::error_code ec;
+    const std::filesystem::path outPath(output);
+    if (outPath.has_parent_path()) {
+        std::filesystem::create_directories(outPath.parent_path(), ec);
+    }
+
+    if (format == J2K_CFMT || format == JP2_CFMT) {
+        std::filesystem::remove(outPath, ec);
+        const int32_t* samples = reinterpret_cast<const int32_t*>(body.data());
+        encoder.EncodeAsTiles(output.c_str(), samples, image.width, image.height,
+                              options.tileWidth, options.tileHeight, image.numComps,
+                              image.bits, options.encodeParams);
+        const auto size = std::filesystem::file_size(outPath, ec);
+        written = ec ? 0 : uint64_t(size);
+        return !ec && size > 0;
+    }
+
+    if (format == PGX_DFMT) {
+        // One file per component: out.pgx, out_1.pgx, out_2.pgx, ...
+        const size_t planeBytes = size_t(image.width) * image.height * (image.bits / 8);
+        written = 0;
+        for (uint32_t c = 0; c < image.numComps; ++c) {
+            std::string path = output;
+            if (c > 0) {
+                path = (outPath.parent_path() /
+                        (outPath.stem().string() + "_" + std::to_string(c) + ".pgx"))
+                             .string();
+            }
+            char header[64];
+            const int headerLength = snprintf(header, sizeof(header), "PG ML + %u %u %u\n",
+                                              image.bits, image.width, image.height);
+            std::vector<uint8_t> file(header, header + headerLength);
+            file.insert(file.end(), body.begin() + c * planeBytes,
+                        body.begin() + (c + 1) * planeBytes);
+            if (!WriteBytes(path, file.data(), file.size())) {
+                return false;
+            }
+            written += file.size();
+        }
+        return true;
+    }
+
+    written = body.size();
+    return WriteBytes(output, body.data(), body.size());
+}
+
+} // namespace j2c
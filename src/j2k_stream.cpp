@@ -0,0 +1,473 @@
+#include "j2k_stream.h"
+#include "format_defs.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define JP2_RFC3745_MAGIC "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
+#define JP2_MAGIC "\x0d\x0a\x87\x0a"
+#define J2K_CODESTREAM_MAGIC "\xff\x4f\xff\x51"
+
+namespace {
+// Internal buffer of the opj stream. Small requests (marker segments) are served from
+// it, large ones like packet data bypass it and are copied once into the codec.
+constexpr OPJ_SIZE_T MEMORY_STREAM_CHUNK_SIZE = 64 * 1024;
+
+// Same chunk size as opj_stream_create_default_file_stream
+constexpr OPJ_SIZE_T FILE_STREAM_CHUNK_SIZE = 1024 * 1024;
+
+// Counters are optional, a null pointer is replaced by this sink to keep callbacks
+// branch free
+thread_local j2c::StreamCounters unusedCounters;
+
+struct MemoryStreamState {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    j2c::StreamCounters* counters;
+};
+
+struct FileStreamState {
+    FILE* file;
+    j2c::StreamCounters* counters;
+};
+
+OPJ_SIZE_T MemoryRead(void* buffer, OPJ_SIZE_T numBytes, void* userData) {
+    MemoryStreamState* state = static_cast<MemoryStreamState*>(userData);
+    if (state->pos >= state->size) {
+        return (OPJ_SIZE_T)-1;
+    }
+    const size_t n = std::min<size_t>(numBytes, state->size - state->pos);
+    memcpy(buffer, state->data + state->pos, n);
+    state->pos += n;
+    state->counters->bytesRead += n;
+    ++state->counters->reads;
+    return n;
+}
+
+OPJ_OFF_T MemorySkip(OPJ_OFF_T numBytes, void* userData) {
+    MemoryStreamState* state = static_cast<MemoryStreamState*>(userData);
+    ++state->counters->seeks;
+    if (numBytes < 0) {
+        const size_t back = std::min<size_t>(size_t(-numBytes), state->pos);
+        state->pos -= back;
+        return -(OPJ_OFF_T)back;
+    }
+    if (state->pos >= state->size && numBytes > 0) {
+        return (OPJ_OFF_T)-1;
+    }
+    const size_t n = std::min<size_t>(size_t(numBytes), state->size - state->pos);
+    state->pos += n;
+    return (OPJ_OFF_T)n;
+}
+
+OPJ_BOOL MemorySeek(OPJ_OFF_T pos, void* userData) {
+    MemoryStreamState* state = static_cast<MemoryStreamState*>(userData);
+    if (pos < 0 || size_t(pos) > state->size) {
+        return OPJ_FALSE;
+    }
+    state->pos = size_t(pos);
+    ++state->counters->seeks;
+    return OPJ_TRUE;
+}
+
+void MemoryFree(void* userData) {
+    delete static_cast<MemoryStreamState*>(userData);
+}
+
+bool FileSeekTo(FILE* f, const OPJ_OFF_T offset, const int whence) {
+#if defined(_WIN32)
+    return _fseeki64(f, (__int64)offset, whence) == 0;
+#else
+    return fseeko(f, (off_t)offset, whence) == 0;
+#endif
+}
+
+OPJ_SIZE_T FileRead(void* buffer, OPJ_SIZE_T numBytes, void* userData) {
+    FileStreamState* state = static_cast<FileStreamState*>(userData);
+    const size_t n = fread(buffer, 1, numBytes, state->file);
+    state->counters->bytesRead += n;
+    ++state->counters->reads;
+    return n ? (OPJ_SIZE_T)n : (OPJ_SIZE_T)-1;
+}
+
+OPJ_OFF_T FileSkip(OPJ_OFF_T numBytes, void* userData) {
+    FileStreamState* state = static_cast<FileStreamState*>(userData);
+    ++state->counters->seeks;
+    return FileSeekTo(state->file, numBytes, SEEK_CUR) ? numBytes : (OPJ_OFF_T)-1;
+}
+
+OPJ_BOOL FileSeek(OPJ_OFF_T pos, void* userData) {
+    FileStreamState* state = static_cast<FileStreamState*>(userData);
+    ++state->counters->seeks;
+    return FileSeekTo(state->file, pos, SEEK_SET) ? OPJ_TRUE : OPJ_FALSE;
+}
+
+void FileFree(void* userData) {
+    FileStreamState* state = static_cast<FileStreamState*>(userData);
+    fclose(state->file);
+    delete state;
+}
+
+struct PositionalStreamState {
+    const j2c::PositionalFile* file;
+    uint64_t pos;
+    j2c::StreamCounters* counters;
+};
+
+OPJ_SIZE_T PositionalRead(void* buffer, OPJ_SIZE_T numBytes, void* userData) {
+    PositionalStreamState* state = static_cast<PositionalStreamState*>(userData);
+    const int64_t n = state->file->ReadAt(state->pos, buffer, numBytes);
+    if (n <= 0) {
+        return (OPJ_SIZE_T)-1;
+    }
+    state->pos += uint64_t(n);
+    state->counters->bytesRead += uint64_t(n);
+    ++state->counters->reads;
+    return (OPJ_SIZE_T)n;
+}
+
+OPJ_OFF_T PositionalSkip(OPJ_OFF_T numBytes, void* userData) {
+    PositionalStreamState* state = static_cast<PositionalStreamState*>(userData);
+    const uint64_t size = state->file->Size();
+    ++state->counters->seeks;
+    if (numBytes < 0) {
+        const uint64_t back = std::min<uint64_t>(uint64_t(-numBytes), state->pos);
+        state->pos -= back;
+        return -(OPJ_OFF_T)back;
+    }
+    if (state->pos >= size && numBytes > 0) {
+        return (OPJ_OFF_T)-1;
+    }
+    const uint64_t n = std::min<uint64_t>(uint64_t(numBytes), size - state->pos);
+    state->pos += n;
+    return (OPJ_OFF_T)n;
+}
+
+OPJ_BOOL PositionalSeek(OPJ_OFF_T pos, void* userData) {
+    PositionalStreamState* state = static_cast<PositionalStreamState*>(userData);
+    if (pos < 0 || uint64_t(pos) > state->file->Size()) {
+        return OPJ_FALSE;
+    }
+    state->pos = uint64_t(pos);
+    ++state->counters->seeks;
+    return OPJ_TRUE;
+}
+
+void PositionalFree(void* userData) {
+    delete static_cast<PositionalStreamState*>(userData);
+}
+} // namespace
+
+namespace j2c {
+
+MappedFile::~MappedFile() {
+    Close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        Close();
+        std::swap(_data, other._data);
+        std::swap(_size, other._size);
+#if defined(_WIN32)
+        std::swap(_file, other._file);
+        std::swap(_mapping, other._mapping);
+#endif
+    }
+    return *this;
+}
+
+bool MappedFile::Open(const std::string& path) {
+    Close();
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    _file = file;
+    _mapping = mapping;
+    _data = static_cast<const uint8_t*>(data);
+    _size = size_t(size.QuadPart);
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    _data = static_cast<const uint8_t*>(data);
+    _size = size_t(st.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::Close() {
+    if (!_data) {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(_data);
+    CloseHandle(_mapping);
+    CloseHandle(_file);
+    _mapping = nullptr;
+    _file = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(_data), _size);
+#endif
+    _data = nullptr;
+    _size = 0;
+}
+
+PositionalFile::~PositionalFile() {
+    Close();
+}
+
+PositionalFile::PositionalFile(PositionalFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+PositionalFile& PositionalFile::operator=(PositionalFile&& other) noexcept {
+    if (this != &other) {
+        Close();
+        std::swap(_size, other._size);
+#if defined(_WIN32)
+        std::swap(_file, other._file);
+#else
+        std::swap(_fd, other._fd);
+#endif
+    }
+    return *this;
+}
+
+bool PositionalFile::Open(const std::string& path) {
+    Close();
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+    _file = file;
+    _size = uint64_t(size.QuadPart);
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    _fd = fd;
+    _size = uint64_t(st.st_size);
+#endif
+    return true;
+}
+
+void PositionalFile::Close() {
+#if defined(_WIN32)
+    if (_file) {
+        CloseHandle(_file);
+        _file = nullptr;
+    }
+#else
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+#endif
+    _size = 0;
+}
+
+bool PositionalFile::IsOpen() const {
+#if defined(_WIN32)
+    return _file != nullptr;
+#else
+    return _fd >= 0;
+#endif
+}
+
+int64_t PositionalFile::ReadAt(const uint64_t offset, void* dst, const size_t n) const {
+    if (!IsOpen()) {
+        return -1;
+    }
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    size_t total = 0;
+    // Short reads are retried until `n` bytes or the end of the file
+    while (total < n && offset + total < _size) {
+#if defined(_WIN32)
+        OVERLAPPED overlapped = {};
+        const uint64_t at = offset + total;
+        overlapped.Offset = DWORD(at);
+        overlapped.OffsetHigh = DWORD(at >> 32);
+        const DWORD chunk = DWORD(std::min<size_t>(n - total, 1u << 30));
+        DWORD read = 0;
+        if (!ReadFile(_file, out + total, chunk, &read, &overlapped) || read == 0) {
+            return total ? int64_t(total) : -1;
+        }
+#else
+        const ssize_t read = pread(_fd, out + total, n - total, off_t(offset + total));
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read <= 0) {
+            return total ? int64_t(total) : -1;
+        }
+#endif
+        total += size_t(read);
+    }
+    return int64_t(total);
+}
+
+opj_stream_t* CreatePositionalStream(const PositionalFile& file, StreamCounters* counters) {
+    if (!file.IsOpen() || file.Size() == 0) {
+        return nullptr;
+    }
+    // Same chunk size as file streams, reads go to the kernel page cache
+    opj_stream_t* stream = opj_stream_create(FILE_STREAM_CHUNK_SIZE, OPJ_TRUE);
+    if (!stream) {
+        return nullptr;
+    }
+    opj_stream_set_user_data(
+          stream, new PositionalStreamState{&file, 0, counters ? counters : &unusedCounters},
+          PositionalFree);
+    opj_stream_set_user_data_length(stream, file.Size());
+    opj_stream_set_read_function(stream, PositionalRead);
+    opj_stream_set_skip_function(stream, PositionalSkip);
+    opj_stream_set_seek_function(stream, PositionalSeek);
+    return stream;
+}
+
+opj_stream_t* CreateMemoryStream(const ByteSpan& span, StreamCounters* counters) {
+    if (!span.data || span.size == 0) {
+        return nullptr;
+    }
+    opj_stream_t* stream = opj_stream_create(MEMORY_STREAM_CHUNK_SIZE, OPJ_TRUE);
+    if (!stream) {
+        return nullptr;
+    }
+    opj_stream_set_user_data(
+          stream,
+          new MemoryStreamState{span.data, span.size, 0, counters ? counters : &unusedCounters},
+          MemoryFree);
+    opj_stream_set_user_data_length(stream, span.size);
+    opj_stream_set_read_function(stream, MemoryRead);
+    opj_stream_set_skip_function(stream, MemorySkip);
+    opj_stream_set_seek_function(stream, MemorySeek);
+    return stream;
+}
+
+opj_stream_t* CreateFileStream(const std::string& path, StreamCounters* counters) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return nullptr;
+    }
+    if (!FileSeekTo(f, 0, SEEK_END)) {
+        fclose(f);
+        return nullptr;
+    }
+#if defined(_WIN32)
+    const int64_t size = _ftelli64(f);
+#else
+    const int64_t size = ftello(f);
+#endif
+    opj_stream_t* stream = opj_stream_create(FILE_STREAM_CHUNK_SIZE, OPJ_TRUE);
+    if (size < 0 || !FileSeekTo(f, 0, SEEK_SET) || !stream) {
+        if (stream) {
+            opj_stream_destroy(stream);
+        }
+        fclose(f);
+        return nullptr;
+    }
+    opj_stream_set_user_data(stream,
+                             new FileStreamState{f, counters ? counters : &unusedCounters},
+                             FileFree);
+    opj_stream_set_user_data_length(stream, (OPJ_UINT64)size);
+    opj_stream_set_read_function(stream, FileRead);
+    opj_stream_set_skip_function(stream, FileSkip);
+    opj_stream_set_seek_function(stream, FileSeek);
+    return stream;
+}
+
+int FormatFromExtension(const char* filename) {
+    // Prefix match so that e.g. "tiff" is found; "rawl" has to come before "raw"
+    static const char* extension[]
+          = {"pgx", "pnm", "pgm", "ppm", "bmp", "tif", "rawl", "raw",
+             "tga", "png", "j2k", "jp2", "j2c", "jpc"};
+    static const int format[]
+          = {PGX_DFMT, PXM_DFMT, PXM_DFMT, PXM_DFMT, BMP_DFMT, TIF_DFMT, RAWL_DFMT, RAW_DFMT,
+             TGA_DFMT, PNG_DFMT, J2K_CFMT, JP2_CFMT, J2K_CFMT, J2K_CFMT};
+    const char* ext = strrchr(filename, '.');
+    if (ext == NULL) {
+        return -1;
+    }
+    ext++;
+    for (size_t i = 0; i < sizeof(format) / sizeof(*format); i++) {
+        if (strncmp(ext, extension[i], strlen(extension[i])) == 0) {
+            return format[i];
+        }
+    }
+    return -1;
+}
+
+int GetMagicFormat(const uint8_t* data, const size_t size) {
+    if (size >= 12 && memcmp(data, JP2_RFC3745_MAGIC, 12) == 0) {
+        return JP2_CFMT;
+    }
+    if (size >= 4 && memcmp(data, JP2_MAGIC, 4) == 0) {
+        return JP2_CFMT;
+    }
+    if (size >= 4 && memcmp(data, J2K_CODESTREAM_MAGIC, 4) == 0) {
+        return J2K_CFMT;
+    }
+    return -1;
+}
+
+} // namespace j2c
@@ -1,47 +1,69 @@
 #include "j2kcodec.h"
 #include "format_defs.h"
+#include "jp2_boxes.h"
+#include "j2k_stream.h"
+#include "sample_convert.h"
+#include "sample_kernels.h"
+#include "thread_pool.h"
+#include "decode_cache.h"
+#include "codestream_index.h"
+#include "opened_image.h"
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <deque>
+#include <future>
+#include <algorithm>
 #include <cstring>
 #include <chrono>
 #include <fstream>
-#include <assert.h>
 
-typedef std::chrono::high_resolution_clock Clock;
-
-#define JP2_RFC3745_MAGIC "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
-#define JP2_MAGIC "\x0d\x0a\x87\x0a"
-#define J2K_CODESTREAM_MAGIC "\xff\x4f\xff\x51"
+typedef std::chrono::steady_clock Clock;
 
 namespace {
-int GetInfileFormat(const char* fname) {
-    const auto get_file_format = [](const char* filename) {
-        unsigned int i;
-        static const char* extension[]
-              = {"pgx", "pnm", "pgm", "ppm", "bmp", "tif", "raw",
-                 "tga", "png", "j2k", "jp2", "j2c", "jpc"};
-        static const int format[]
-              = {PGX_DFMT, PXM_DFMT, PXM_DFMT, PXM_DFMT, BMP_DFMT, TIF_DFMT, RAW_DFMT,
-                 TGA_DFMT, PNG_DFMT, J2K_CFMT, JP2_CFMT, J2K_CFMT, J2K_CFMT};
-        const char* ext = strrchr(filename, '.');
-        if (ext == NULL)
-            return -1;
-        ext++;
-        if (ext) {
-            for (i = 0; i < sizeof(format) / sizeof(*format); i++) {
-                if (strncmp(ext, extension[i], 3) == 0) {
-                    return format[i];
-                }
-            }
-        }
+// Retained bytes of the pool each codec owns for DecodePooled
+constexpr size_t DEFAULT_POOL_RETAINED_BYTES = 64ull * 1024 * 1024;
+
+// Format from the leading bytes of a file, cross checked against the extension of
+// `fname` when there is one. The bytes win, a mismatch is only reported when `verbose`.
+int GetFormat(const char* fname, const unsigned char* buf, const size_t len,
+              const bool verbose) {
+    const char *s, *magic_s;
+    int ext_format, magic_format;
 
+    magic_format = j2c::GetMagicFormat(buf, len);
+    if (magic_format == JP2_CFMT) {
+        magic_s = ".jp2";
+    }
+    else if (magic_format == J2K_CFMT) {
+        magic_s = ".j2k or .jpc or .j2c";
+    }
+    else {
         return -1;
-    };
+    }
+
+    if (!fname) {
+        return magic_format;
+    }
+
+    ext_format = j2c::FormatFromExtension(fname);
+
+    // if (ext_format == JPT_CFMT) {
+    //     assert(false, "Not implemented!");
+    // }
+
+    if (magic_format == ext_format || !verbose) {
+        return magic_format;
+    }
+
+    s = fname + strlen(fname) - 4;
+    std::cerr << "Extension of file is incorrect! Found " << s << " should be "
+              << magic_s << "\n";
+    return magic_format;
+}
 
+int GetInfileFormat(const char* fname, const bool verbose) {
     FILE* reader;
-    const char *s, *magic_s;
-    int ext_format, magic_format;
     unsigned char buf[12];
     OPJ_SIZE_T l_nb_read;
 
@@ -57,34 +79,206 @@ int GetInfileFormat(const char* fname) {
     if (l_nb_read != 12) {
         return -1;
     }
+    return GetFormat(fname, buf, l_nb_read, verbose);
+}
 
-    ext_format = get_file_format(fname);
+// Adds the time until the end of its scope to one stage of `metrics`
+class StageTimer {
+public:
+    StageTimer(j2c::DecodeMetrics& metrics, const j2c::DecodeStage stage)
+        : _slot(metrics.stageNs[size_t(stage)]), _start(Clock::now()) {}
+    ~StageTimer() {
+        _slot += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       Clock::now() - _start)
+                       .count();
+    }
 
-    // if (ext_format == JPT_CFMT) {
-    //     assert(false, "Not implemented!");
-    // }
+private:
+    uint64_t& _slot;
+    const Clock::time_point _start;
+};
 
-    if (memcmp(buf, JP2_RFC3745_MAGIC, 12) == 0 || memcmp(buf, JP2_MAGIC, 4) == 0) {
-        magic_format = JP2_CFMT;
-        magic_s = ".jp2";
+// Tiles of the grid in `info` overlapping [x0, x1) x [y0, y1), all of them for no area
+uint64_t CountTiles(const opj_codestream_info_v2_t* info, const int x0, const int y0,
+                    const int x1, const int y1) {
+    if (!info || info->tdx == 0 || info->tdy == 0) {
+        return 0;
     }
-    else if (memcmp(buf, J2K_CODESTREAM_MAGIC, 4) == 0) {
-        magic_format = J2K_CFMT;
-        magic_s = ".j2k or .jpc or .j2c";
+    if (x0 < 0 || y0 < 0 || x1 < 0 || y1 < 0) {
+        return uint64_t(info->tw) * info->th;
     }
-    else {
-        return -1;
+    const auto first = [](const int v, const uint32_t origin, const uint32_t size) {
+        return (uint32_t)std::max<int64_t>(0, (int64_t(v) - origin) / size);
+    };
+    const auto last = [](const int v, const uint32_t origin, const uint32_t size,
+                         const uint32_t count) {
+        return (uint32_t)std::min<int64_t>(count, (int64_t(v) - origin + size - 1) / size);
+    };
+    const uint32_t tx0 = first(x0, info->tx0, info->tdx);
+    const uint32_t ty0 = first(y0, info->ty0, info->tdy);
+    const uint32_t tx1 = last(x1, info->tx0, info->tdx, info->tw);
+    const uint32_t ty1 = last(y1, info->ty0, info->tdy, info->th);
+    return tx1 > tx0 && ty1 > ty0 ? uint64_t(tx1 - tx0) * (ty1 - ty0) : 0;
+}
+
+// A plane allocated by the codec (or with opj_image_data_alloc), released by it
+std::shared_ptr<j2c::ImageData> OwnedImage(int32_t* data, const uint32_t w, const uint32_t h) {
+    return std::shared_ptr<j2c::ImageData>(new j2c::ImageData{data, w, h},
+                                           [](j2c::ImageData* im) {
+                                               opj_image_data_free(im->data);
+                                               delete im;
+                                           });
+}
+
+// ceil(ceil(v / d) / 2^level), how the codec maps reference grid coordinates onto a
+// reduced component grid
+uint32_t ReducedCoordinate(const int64_t v, const uint32_t d, const int level) {
+    const int64_t c = (v + d - 1) / d;
+    return (uint32_t)((c + (int64_t(1) << level) - 1) >> level);
+}
+
+// Regions of a DecodeRegions call decoded together over their bounding box
+struct RegionGroup {
+    int64_t x0;
+    int64_t y0;
+    int64_t x1;
+    int64_t y1;
+    std::vector<size_t> members;
+};
+
+// Rough decode cost of a group: its area at the decoded resolution rounded out to
+// whole code-blocks, since the codec decodes every code-block a region touches
+uint64_t GroupCost(const int64_t x0, const int64_t y0, const int64_t x1, const int64_t y1,
+                   const int level, const uint32_t block) {
+    const auto first = [&](const int64_t v) { return ReducedCoordinate(v, 1, level) / block; };
+    const auto last = [&](const int64_t v) {
+        return (ReducedCoordinate(v, 1, level) + block - 1) / block;
+    };
+    return uint64_t(last(x1) - first(x0)) * (last(y1) - first(y0)) * block * block;
+}
+
+// Greedily merges groups while decoding the merged bounding box costs no more than
+// decoding the two groups apart, counting one code-block of overhead per decode.
+// Duplicates and heavy overlaps always merge, distant regions never do.
+std::vector<RegionGroup> CoalesceRegions(std::vector<RegionGroup> groups, const int level,
+                                         const uint32_t block) {
+    const uint64_t overhead = uint64_t(block) * block;
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < groups.size(); ++i) {
+            for (size_t j = i + 1; j < groups.size();) {
+                RegionGroup& a = groups[i];
+                const RegionGroup& b = groups[j];
+                const int64_t x0 = std::min(a.x0, b.x0);
+                const int64_t y0 = std::min(a.y0, b.y0);
+                const int64_t x1 = std::max(a.x1, b.x1);
+                const int64_t y1 = std::max(a.y1, b.y1);
+                if (GroupCost(x0, y0, x1, y1, level, block) >
+                    GroupCost(a.x0, a.y0, a.x1, a.y1, level, block) +
+                          GroupCost(b.x0, b.y0, b.x1, b.y1, level, block) + overhead) {
+                    ++j;
+                    continue;
+                }
+                a.x0 = x0;
+                a.y0 = y0;
+                a.x1 = x1;
+                a.y1 = y1;
+                a.members.insert(a.members.end(), b.members.begin(), b.members.end());
+                groups.erase(groups.begin() + j);
+                merged = true;
+            }
+        }
     }
+    return groups;
+}
 
-    if (magic_format == ext_format) {
-        return ext_format;
+// Session key of caller owned bytes. Spans are identified by address and size.
+std::string SpanName(const j2c::ByteSpan& span) {
+    char name[64];
+    snprintf(name, sizeof(name), "<memory %p+%zu>", (const void*)span.data, span.size);
+    return name;
+}
+
+std::string OpenedName(const j2c::OpenedImage& image) {
+    char name[32];
+    snprintf(name, sizeof(name), "<opened %p>", (const void*)&image);
+    return name + image.Path();
+}
+
+// Owns codec objects so every exit path of EncodeAsTiles releases them
+struct CodecResources {
+    opj_codec_t* codec = nullptr;
+    opj_image_t* image = nullptr;
+    opj_stream_t* stream = nullptr;
+
+    ~CodecResources() {
+        if (stream) {
+            opj_stream_destroy(stream);
+        }
+        if (image) {
+            opj_image_destroy(image);
+        }
+        if (codec) {
+            opj_destroy_codec(codec);
+        }
     }
+};
+
+struct TileRect {
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int w;
+    unsigned int h;
+};
+
+TileRect TileBounds(const unsigned int tileIndex, const unsigned int numTilesX,
+                    const unsigned int imageWidth, const unsigned int imageHeight,
+                    const unsigned int tileWidth, const unsigned int tileHeight) {
+    const unsigned int x0 = (tileIndex % numTilesX) * tileWidth;
+    const unsigned int y0 = (tileIndex / numTilesX) * tileHeight;
+    return {x0, y0, std::min(tileWidth, imageWidth - x0), std::min(tileHeight, imageHeight - y0)};
+}
 
-    s = fname + strlen(fname) - 4;
-    std::cerr << "Extension of file is incorrect! Found " << s << " should be "
-              << magic_s;
-    return magic_format;
+// Gathers one tile of interleaved samples into the planar layout opj_write_tile wants,
+// one source row at a time so reads and writes both stay sequential
+template <typename T>
+void PackTileAs(const int32_t* data, const unsigned int imageWidth,
+                const unsigned int numComps, const TileRect& rect,
+                const j2c::GatherKernel<T> gather, T* dst) {
+    const size_t planeSize = size_t(rect.w) * rect.h;
+    std::vector<T*> rows(numComps);
+    for (unsigned int c = 0; c < numComps; ++c) {
+        rows[c] = dst + c * planeSize;
+    }
+    for (unsigned int y = 0; y < rect.h; ++y) {
+        const int32_t* row = data + (size_t(rect.y0 + y) * imageWidth + rect.x0) * numComps;
+        gather(row, numComps, rect.w, rows.data());
+        for (unsigned int c = 0; c < numComps; ++c) {
+            rows[c] += rect.w;
+        }
+    }
 }
+
+// Row gather kernels for one image, picked before its tiles are packed
+struct TilePacker {
+    j2c::GatherKernel<OPJ_BYTE> toBytes;
+    j2c::GatherKernel<uint16_t> toWords;
+
+    explicit TilePacker(const unsigned int numComps)
+        : toBytes(j2c::SelectGather<OPJ_BYTE>(numComps))
+        , toWords(j2c::SelectGather<uint16_t>(numComps)) {}
+
+    void Pack(const int32_t* data, const unsigned int imageWidth, const unsigned int numComps,
+              const TileRect& rect, const size_t sampleSize, OPJ_BYTE* dst) const {
+        if (sampleSize == 1) {
+            PackTileAs(data, imageWidth, numComps, rect, toBytes, dst);
+        } else {
+            PackTileAs(data, imageWidth, numComps, rect, toWords,
+                       reinterpret_cast<uint16_t*>(dst));
+        }
+    }
+};
 }
 
 namespace j2c {
@@ -93,7 +287,31 @@ J2kCodec::J2kCodec(const bool verboseMode)
     : _codestreamInfo(nullptr)
     , _decoder(nullptr)
     , _image(nullptr)
+    , _substreamDecoder(nullptr)
+    , _substreamStream(nullptr)
+    , _indexedImage(nullptr)
+    , _substreamThreads(1)
+    , _substreamReusable(false)
+    , _decoded(nullptr)
+    , _infileFormat(-1)
     , _infileStream(nullptr)
+    , _memorySource{nullptr, 0}
+    , _sessionBytes{nullptr, 0}
+    , _useMmap(false)
+    , _bufferPool(std::make_shared<BufferPool>(DEFAULT_POOL_RETAINED_BYTES))
+    , _indexMode(IndexMode::MEMORY)
+    , _sessionLayers(0)
+    , _sessionStamp{0, 0}
+    , _sessionThreads(1)
+    , _decoderThreads(1)
+    , _sessionDecoded(false)
+    , _sessionAreaDecoded(false)
+    , _metrics()
+    , _status(DecodeStatus::OK)
+    , _limits()
+    , _metricsDepth(0)
+    , _metricsStart()
+    , _streamCounters()
     , _verboseMode(verboseMode)
 {
 }
@@ -107,166 +325,979 @@ void J2kCodec::DecodeIntoBuffer(const std::string& path, unsigned char* buffer,
                                       const int numQualityLayers, const int x0,
                                       const int y0, const int x1, const int y1, const int numThreads)
 {
-    auto t1 = Clock::now();
-    CreateInfileStream(path);
-    SetupDecoder(resolutionLevel, numQualityLayers, x0, x1, y0, y1, numThreads);
-
-    if (!opj_decode(_decoder, _infileStream, _image)) {
-        std::cerr << "Could not decode image\n";
-        Destroy();
+    MetricsScope metrics(*this);
+    if (!DecodeImage(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads)) {
         return;
     }
 
-    if (!opj_end_decompress(_decoder, _infileStream)) {
-        std::cerr << "Could not end decompression\n";
-        Destroy();
+    // Component 0 only, scaled to 8 bits
+    ConvertImage(buffer, SampleFormat::UINT8, 1);
+}
+
+void J2kCodec::DecodeIntoBuffer(const std::string& path, void* buffer,
+                                const SampleFormat format, const int resolutionLevel,
+                                const int numQualityLayers, const int x0, const int y0,
+                                const int x1, const int y1, const int numThreads)
+{
+    MetricsScope metrics(*this);
+    if (!DecodeImage(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads)) {
         return;
     }
+    ConvertImage(buffer, format, _decoded->numcomps);
+}
 
-    // TODO(mnoven): This MIGHT be faster and just keep buffer in unsigned char since we
-    // know that all values in img are bytes. Why can't we specify decode precision in
-    // openjpeg?? - For now just keep the PBO buffer in the same size
-    std::copy(_image->comps[0].data,
-              _image->comps[0].data + _image->comps[0].w * _image->comps[0].h, buffer);
-    // std::memcpy(buffer, _image->comps[0].data, _image->comps[0].w * _image->comps[0].h
-    // * sizeof(int32_t));
-    auto t2 = Clock::now();
+PooledImage J2kCodec::DecodePooled(const std::string& path, const SampleFormat format,
+                                   const int resolutionLevel, const int numQualityLayers,
+                                   const int x0, const int y0, const int x1, const int y1,
+                                   const int numThreads)
+{
+    MetricsScope metrics(*this);
+    PooledImage result{PooledBuffer(), 0, 0, 0, format};
+    if (!DecodeImage(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads)) {
+        return result;
+    }
 
-    if (_verboseMode) {
-        std::cout
-              << "Decode time "
-              << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
-              << " ms" << std::endl;
+    const opj_image_comp_t& first = _decoded->comps[0];
+    const size_t size = size_t(first.w) * first.h * _decoded->numcomps * SampleSize(format);
+    result.buffer = _bufferPool->Acquire(size);
+    if (result.buffer.Empty()) {
+        if (_verboseMode) {
+            std::cerr << "Failed to allocate " << size << " bytes from the buffer pool\n";
+        }
+        Fail(DecodeStatus::OUT_OF_MEMORY);
+        return result;
+    }
+    if (!ConvertImage(result.buffer.Data(), format, _decoded->numcomps)) {
+        result.buffer.Release();
+        return result;
+    }
+    result.w = first.w;
+    result.h = first.h;
+    result.numComps = _decoded->numcomps;
+    return result;
+}
+
+PooledImage J2kCodec::DecodePooled(const ByteSpan& span, const SampleFormat format,
+                                   const int resolutionLevel, const int numQualityLayers,
+                                   const int x0, const int y0, const int x1, const int y1,
+                                   const int numThreads)
+{
+    return DecodePooled(UseMemorySource(span), format, resolutionLevel, numQualityLayers, x0,
+                        y0, x1, y1, numThreads);
+}
+
+void J2kCodec::SetBufferPool(std::shared_ptr<BufferPool> pool) {
+    _bufferPool = pool ? std::move(pool)
+                       : std::make_shared<BufferPool>(DEFAULT_POOL_RETAINED_BYTES);
+}
+
+BufferPoolStats J2kCodec::PoolStats() const {
+    return _bufferPool->Stats();
+}
+
+bool J2kCodec::GetImageInfo(const std::string& path, ImageInfo& info) {
+    _status = DecodeStatus::OK;
+    if (!(IsOpen() && path == _infileName) && !Open(path)) {
+        return false;
     }
+    info = _imageInfo;
+    return true;
+}
+
+bool J2kCodec::GetImageInfo(const ByteSpan& span, ImageInfo& info) {
+    return GetImageInfo(UseMemorySource(span), info);
 }
 
 XmlData J2kCodec::fetchXMLData(const std::string path) {
-  CreateInfileStream(path);
-  SetupDecoder(0, 1, -1, -1, -1, -1, 0);
+  _status = DecodeStatus::OK;
+  // Any open session on this file already holds the parsed boxes
+  if (!(IsOpen() && path == _infileName) && !Open(path)) {
+    return {nullptr, 0};
+  }
 
   uint8_t* xmlData = _headerInfo.xml_data;
   size_t xmlLen = _headerInfo.xml_data_len;
-
-  assert(xmlData && xmlLen && "XML data invalid");
+  if (!xmlData || xmlLen == 0) {
+    Fail(DecodeStatus::NO_XML);
+    return {nullptr, 0};
+  }
   return {xmlData, xmlLen};
 }
 
+XmlData J2kCodec::fetchXMLBox(const ByteSpan& span) {
+  _status = DecodeStatus::OK;
+  size_t xmlLen = 0;
+  const DecodeStatus status = ReadJp2XmlBox(span.data, span.size, _xmlBuffer, xmlLen);
+  if (status != DecodeStatus::OK) {
+    Fail(status);
+    return {nullptr, 0};
+  }
+  return {_xmlBuffer.data(), xmlLen};
+}
+
+XmlData J2kCodec::fetchXMLBox(const std::string& path) {
+  _status = DecodeStatus::OK;
+  size_t xmlLen = 0;
+  const DecodeStatus status = ReadJp2XmlBox(path, _xmlBuffer, xmlLen);
+  if (status != DecodeStatus::OK) {
+    Fail(status);
+    if (_verboseMode) {
+      std::cerr << "No XML box read from " << path << ": " << StatusName(status) << "\n";
+    }
+    return {nullptr, 0};
+  }
+  return {_xmlBuffer.data(), xmlLen};
+}
+
 std::shared_ptr<ImageData>
       J2kCodec::Decode(const std::string& path, const int resolutionLevel,
                              const int numQualityLayers, const int x0, const int y0,
                              const int x1, const int y1, const int numThreads)
 {
+    MetricsScope metrics(*this);
+    return DecodeCached(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads,
+                        -1);
+}
 
-    auto t1 = Clock::now();
-    CreateInfileStream(path);
-    SetupDecoder(resolutionLevel, numQualityLayers, x0, x1, y0, y1, numThreads);
+std::shared_ptr<ImageData> J2kCodec::Decode(const ByteSpan& span, const int resolutionLevel,
+                                           const int numQualityLayers, const int x0,
+                                           const int y0, const int x1, const int y1,
+                                           const int numThreads)
+{
+    return Decode(UseMemorySource(span), resolutionLevel, numQualityLayers, x0, y0, x1, y1,
+                  numThreads);
+}
 
-    if (!opj_decode(_decoder, _infileStream, _image)) {
-        std::cerr << "Could not decode image\n";
-        Destroy();
+std::shared_ptr<ImageData> J2kCodec::Decode(std::shared_ptr<const OpenedImage> image,
+                                           const int resolutionLevel,
+                                           const int numQualityLayers, const int x0,
+                                           const int y0, const int x1, const int y1,
+                                           const int numThreads)
+{
+    if (!image) {
+        Fail(DecodeStatus::INVALID_ARGUMENT);
         return nullptr;
     }
+    return Decode(UseOpenedImage(std::move(image)), resolutionLevel, numQualityLayers, x0,
+                  y0, x1, y1, numThreads);
+}
+
+void J2kCodec::DecodeIntoBuffer(std::shared_ptr<const OpenedImage> image, void* buffer,
+                                const SampleFormat format, const int resolutionLevel,
+                                const int numQualityLayers, const int x0, const int y0,
+                                const int x1, const int y1, const int numThreads)
+{
+    if (!image) {
+        Fail(DecodeStatus::INVALID_ARGUMENT);
+        return;
+    }
+    DecodeIntoBuffer(UseOpenedImage(std::move(image)), buffer, format, resolutionLevel,
+                     numQualityLayers, x0, y0, x1, y1, numThreads);
+}
 
-    if (!opj_end_decompress(_decoder, _infileStream)) {
-        std::cerr << "Could not end decompression\n";
-        Destroy();
+std::shared_ptr<ImageData> J2kCodec::DecodeTile(const int tileId,
+                                                std::shared_ptr<const OpenedImage> image,
+                                                const int resolutionLevel,
+                                                const int numQualityLayers,
+                                                const int numThreads)
+{
+    if (!image) {
+        Fail(DecodeStatus::INVALID_ARGUMENT);
         return nullptr;
     }
+    return DecodeTile(tileId, UseOpenedImage(std::move(image)), resolutionLevel,
+                      numQualityLayers, numThreads);
+}
+
+void J2kCodec::DecodeIntoBuffer(const ByteSpan& span, void* buffer,
+                                const SampleFormat format, const int resolutionLevel,
+                                const int numQualityLayers, const int x0, const int y0,
+                                const int x1, const int y1, const int numThreads)
+{
+    DecodeIntoBuffer(UseMemorySource(span), buffer, format, resolutionLevel,
+                     numQualityLayers, x0, y0, x1, y1, numThreads);
+}
+
+std::shared_ptr<ImageData> J2kCodec::DecodeTile(const int tileId, const ByteSpan& span,
+                                                const int resolutionLevel,
+                                                const int numQualityLayers,
+                                                const int numThreads)
+{
+    return DecodeTile(tileId, UseMemorySource(span), resolutionLevel, numQualityLayers,
+                      numThreads);
+}
+
+void J2kCodec::DecodeIntoComponents(const std::string& path, const ComponentBuffer* buffers,
+                                    const uint32_t numBuffers, const SampleFormat format,
+                                    const int resolutionLevel, const int numQualityLayers,
+                                    const int x0, const int y0, const int x1, const int y1,
+                                    const int numThreads)
+{
+    MetricsScope metrics(*this);
+    if (!DecodeImage(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads)) {
+        return;
+    }
+    if (numBuffers > _decoded->numcomps) {
+        if (_verboseMode) {
+            std::cerr << "Image has " << _decoded->numcomps << " components, " << numBuffers
+                      << " buffers given\n";
+        }
+        Fail(DecodeStatus::INVALID_ARGUMENT);
+        return;
+    }
+
+    // One pass from the decoder planes straight into the caller's memory
+    StageTimer timer(_metrics, DecodeStage::CONVERT);
+    for (uint32_t c = 0; c < numBuffers; ++c) {
+        const opj_image_comp_t& comp = _decoded->comps[c];
+        if (!buffers[c].data || !comp.data) {
+            continue;
+        }
+        const size_t stride =
+              buffers[c].stride ? buffers[c].stride : size_t(comp.w) * SampleSize(format);
+        ConvertPlane({comp.data, comp.prec, comp.sgnd != 0}, comp.w, comp.h, buffers[c].data,
+                     stride, format);
+    }
+}
+
+void J2kCodec::DecodeTileIntoBuffer(const int tileId, const std::string& path,
+                                    unsigned char* buffer, const int resolutionLevel,
+                                    const int numQualityLayers, const int numThreads)
+{
+    MetricsScope metrics(*this);
+    if (!DecodeImage(path, resolutionLevel, numQualityLayers, -1, -1, -1, -1, numThreads,
+                     tileId)) {
+        return;
+    }
+    ConvertImage(buffer, SampleFormat::UINT8, 1);
+}
+
+std::shared_ptr<ImageData> J2kCodec::DecodeTile(const int tileId, const std::string& path,
+                                                const int resolutionLevel,
+                                                const int numQualityLayers,
+                                                const int numThreads)
+{
+    MetricsScope metrics(*this);
+    return DecodeCached(path, resolutionLevel, numQualityLayers, -1, -1, -1, -1, numThreads,
+                        tileId);
+}
 
-    auto t2 = Clock::now();
+bool J2kCodec::DecodeProgressive(const std::string& path, const int resolutionLevel,
+                                 const int numQualityLayers,
+                                 const ProgressCallback& callback, const int x0,
+                                 const int y0, const int x1, const int y1,
+                                 const int numThreads)
+{
+    // One set of metrics for all passes
+    MetricsScope metrics(*this);
+    // The coarse passes only need the first layer, which keeps them cheap
+    const int previewLayers = 1;
+    if (!(IsOpen() && path == _infileName) && !Open(path, previewLayers, numThreads)) {
+        return false;
+    }
+
+    const opj_tccp_info_t* tccp = _codestreamInfo->m_default_tile_info.tccp_info;
+    const int numResolutions = tccp ? (int)tccp->numresolutions : resolutionLevel + 1;
+    const int coarsest = std::max(resolutionLevel, numResolutions - 1);
+    const bool refineLayers = numQualityLayers != previewLayers;
+
+    // The coarse passes share the session's layer count and tile-part index. On images
+    // of more than one tile each full image pass still reopens the session, libopenjp2
+    // decodes those once per header read; region passes go through the index. A pass at
+    // level r only entropy decodes the subbands up to that level but is otherwise a
+    // full decode.
+    for (int level = coarsest; level >= resolutionLevel; --level) {
+        const bool last = level == resolutionLevel && !refineLayers;
+        if (!DecodeImage(path, level, previewLayers, x0, y0, x1, y1, numThreads)) {
+            return false;
+        }
+        if (!callback({level, previewLayers, DetachComponent(0), last})) {
+            return true;
+        }
+    }
+
+    // A different layer count needs a decoder set up for it, this reopens the session
+    if (refineLayers) {
+        if (!DecodeImage(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads)) {
+            return false;
+        }
+        callback({resolutionLevel, numQualityLayers, DetachComponent(0), true});
+    }
+    return true;
+}
+
+void J2kCodec::SetDecodeCache(std::shared_ptr<DecodeCache> cache) {
+    _decodeCache = std::move(cache);
+}
+
+std::shared_ptr<ImageData> J2kCodec::DecodeCached(const std::string& path,
+                                                  const int resolutionLevel,
+                                                  const int numQualityLayers, const int x0,
+                                                  const int y0, const int x1, const int y1,
+                                                  const int numThreads, const int tileId)
+{
+    const auto decode = [&]() -> std::shared_ptr<ImageData> {
+        _metrics.cacheHit = false;
+        // A miss can mean the file changed on disk, while the session still reads it
+        // as it was when opened
+        FileStamp stamp;
+        if (IsOpen() && path == _infileName && !IsMemorySource(path) &&
+            !IsOpenedSource(path) && (!StatFile(path, stamp) || stamp != _sessionStamp)) {
+            Reset();
+        }
+        if (!DecodeImage(path, resolutionLevel, numQualityLayers, x0, y0, x1, y1, numThreads,
+                         tileId)) {
+            return nullptr;
+        }
+        // Assume greyscale for now
+        return DetachComponent(0);
+    };
+    // Caller owned bytes have no identity that survives the call, never cache them
+    if (!_decodeCache || IsMemorySource(path)) {
+        return decode();
+    }
 
+    const bool hasArea = x0 >= 0 && y0 >= 0 && x1 >= 0 && y1 >= 0;
+    const DecodeKey key = {IsOpenedSource(path) ? _opened->Path() : path, resolutionLevel, numQualityLayers,
+                           hasArea ? x0 : -1, hasArea ? y0 : -1,
+                           hasArea ? x1 : -1, hasArea ? y1 : -1, tileId};
+    _metrics.cacheHit = true;
+    return _decodeCache->GetOrLoad(key, decode);
+}
+
+std::vector<std::shared_ptr<ImageData>>
+      J2kCodec::DecodeRegions(const std::string& path, const std::vector<DecodeRegion>& regions,
+                              const int resolutionLevel, const int numQualityLayers,
+                              const int numThreads)
+{
+    MetricsScope metrics(*this);
+    std::vector<std::shared_ptr<ImageData>> images(regions.size());
+    const bool reuse = IsOpen() && path == _infileName && numQualityLayers == _sessionLayers;
+    if (regions.empty() || (!reuse && !Open(path, numQualityLayers, numThreads))) {
+        return images;
+    }
+
+    // Regions are clipped to the image, those left empty get no image
+    DecodeStatus failure = DecodeStatus::OK;
+    const int64_t imageX1 = int64_t(_imageInfo.x0) + _imageInfo.width;
+    const int64_t imageY1 = int64_t(_imageInfo.y0) + _imageInfo.height;
+    std::vector<DecodeRegion> clipped(regions.size());
+    std::vector<RegionGroup> groups;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        const DecodeRegion& r = regions[i];
+        const int64_t x0 = std::max<int64_t>(r.x0, _imageInfo.x0);
+        const int64_t y0 = std::max<int64_t>(r.y0, _imageInfo.y0);
+        const int64_t x1 = std::min<int64_t>(r.x1, imageX1);
+        const int64_t y1 = std::min<int64_t>(r.y1, imageY1);
+        if (x1 <= x0 || y1 <= y0) {
+            failure = DecodeStatus::INVALID_ARGUMENT;
+            continue;
+        }
+        clipped[i] = {(int)x0, (int)y0, (int)x1, (int)y1};
+        groups.push_back({x0, y0, x1, y1, {i}});
+    }
+
+    const opj_tccp_info_t* tccp = _codestreamInfo->m_default_tile_info.tccp_info;
+    const uint32_t block = tccp && tccp->cblkw >= 2 && tccp->cblkw <= 10 ? 1u << tccp->cblkw : 64;
+    groups = CoalesceRegions(std::move(groups), resolutionLevel, block);
+    _metrics.regionsRequested = regions.size();
+    _metrics.regionDecodes = groups.size();
+
+    for (const RegionGroup& group : groups) {
+        if (!DecodeImage(path, resolutionLevel, numQualityLayers, (int)group.x0, (int)group.y0,
+                         (int)group.x1, (int)group.y1, numThreads)) {
+            failure = _status;
+            continue;
+        }
+        // A region decoded on its own is handed over without a copy
+        if (group.members.size() == 1) {
+            images[group.members[0]] = DetachComponent(0);
+            continue;
+        }
+        for (const size_t i : group.members) {
+            images[i] = CropComponent(0, clipped[i], resolutionLevel);
+            if (!images[i]) {
+                failure = _status;
+            }
+        }
+    }
+    _status = failure;
+    return images;
+}
+
+std::vector<std::shared_ptr<ImageData>>
+      J2kCodec::DecodeRegions(const ByteSpan& span, const std::vector<DecodeRegion>& regions,
+                              const int resolutionLevel, const int numQualityLayers,
+                              const int numThreads)
+{
+    return DecodeRegions(UseMemorySource(span), regions, resolutionLevel, numQualityLayers,
+                         numThreads);
+}
+
+std::vector<std::shared_ptr<ImageData>>
+      J2kCodec::DecodeRegions(std::shared_ptr<const OpenedImage> image,
+                              const std::vector<DecodeRegion>& regions,
+                              const int resolutionLevel, const int numQualityLayers,
+                              const int numThreads)
+{
+    if (!image) {
+        Fail(DecodeStatus::INVALID_ARGUMENT);
+        return std::vector<std::shared_ptr<ImageData>>(regions.size());
+    }
+    return DecodeRegions(UseOpenedImage(std::move(image)), regions, resolutionLevel,
+                         numQualityLayers, numThreads);
+}
+
+bool J2kCodec::GetTileLayout(const std::string& path, TileLayout& layout) {
+    _status = DecodeStatus::OK;
+    if (!(IsOpen() && path == _infileName) && !Open(path)) {
+        return false;
+    }
+    layout = {_codestreamInfo->tdx, _codestreamInfo->tdy, _codestreamInfo->tw,
+              _codestreamInfo->th};
+    return true;
+}
+
+bool J2kCodec::Open(const ByteSpan& span, const int numQualityLayers, const int numThreads) {
+  return Open(UseMemorySource(span), numQualityLayers, numThreads);
+}
+
+bool J2kCodec::Open(std::shared_ptr<const OpenedImage> image, const int numQualityLayers,
+                    const int numThreads) {
+  if (!image) {
+    return Fail(DecodeStatus::INVALID_ARGUMENT);
+  }
+  return Open(UseOpenedImage(std::move(image)), numQualityLayers, numThreads);
+}
+
+void J2kCodec::SetMemoryMapped(const bool enabled) {
+  if (enabled != _useMmap) {
+    Reset();
+    _useMmap = enabled;
+  }
+}
+
+std::string J2kCodec::UseMemorySource(const ByteSpan& span) {
+  _memorySource = span;
+  return SpanName(span);
+}
+
+bool J2kCodec::IsMemorySource(const std::string& path) const {
+  return _memorySource.data && path == SpanName(_memorySource);
+}
+
+std::string J2kCodec::UseOpenedImage(std::shared_ptr<const OpenedImage> image) {
+  _opened = std::move(image);
+  return OpenedName(*_opened);
+}
+
+bool J2kCodec::IsOpenedSource(const std::string& path) const {
+  return _opened && path == OpenedName(*_opened);
+}
+
+bool J2kCodec::Open(const std::string& path, const int numQualityLayers,
+                    const int numThreads) {
+  // Set up for what a decode asking for `numThreads` would lease right now, so the
+  // first decode after Open() finds the session it needs
+  ThreadLease lease(ThreadPool::Shared(), numThreads < 0 ? 1 : numThreads);
+  return OpenSession(path, numQualityLayers, lease.Count());
+}
+
+bool J2kCodec::OpenSession(const std::string& path, const int numQualityLayers,
+                           const unsigned int numThreads) {
+  _status = DecodeStatus::OK;
+  if (path != _infileName) {
+    // Keep the source UseMemorySource or UseOpenedImage just selected
+    const ByteSpan memorySource = _memorySource;
+    std::shared_ptr<const OpenedImage> opened = std::move(_opened);
+    Reset();
+    _memorySource = memorySource;
+    _opened = std::move(opened);
+  } else {
+    Destroy();
+  }
+
+  {
+    StageTimer timer(_metrics, DecodeStage::OPEN);
+    // Taken before the stream is opened, a change in between makes the next check reopen
+    if (IsMemorySource(path) || IsOpenedSource(path) || !StatFile(path, _sessionStamp)) {
+      _sessionStamp = {0, 0};
+    }
+    CreateInfileStream(path);
+  }
+  if (!SetupDecoder(numQualityLayers, numThreads)) {
+    Destroy();
+    return false;
+  }
+  _sessionLayers = numQualityLayers;
+  _sessionThreads = numThreads;
+  return true;
+}
+
+bool J2kCodec::IsOpen() const {
+  return _infileStream && _decoder && _image;
+}
+
+void J2kCodec::Reset() {
+  Destroy();
+  _infileName.clear();
+  _infileFormat = -1;
+  _mappedFile.Close();
+  _memorySource = {nullptr, 0};
+  _opened.reset();
+  _index.reset();
+}
+
+void J2kCodec::SetIndexMode(const IndexMode mode) {
+  if (mode != _indexMode) {
+    _indexMode = mode;
+    _index.reset();
+  }
+}
+
+bool J2kCodec::GetRegionByteRanges(const std::string& path, const int x0, const int y0,
+                                   const int x1, const int y1,
+                                   std::vector<ByteRange>& ranges) {
+  _status = DecodeStatus::OK;
+  ranges.clear();
+  if (!(IsOpen() && path == _infileName) && !Open(path)) {
+    return false;
+  }
+  const CodestreamIndex* index = SessionIndex();
+  if (!index) {
+    return Fail(DecodeStatus::UNSUPPORTED);
+  }
+
+  std::vector<uint32_t> tiles;
+  if (x0 >= 0 && y0 >= 0 && x1 >= 0 && y1 >= 0) {
+    tiles = index->TilesInRegion(x0, y0, x1, y1);
+  } else {
+    for (uint32_t t = 0; t < index->NumTiles(); ++t) {
+      tiles.push_back(t);
+    }
+  }
+  ranges = index->RangesForTiles(tiles);
+  return true;
+}
+
+bool J2kCodec::DecodeImage(const std::string& path, const int resolutionLevel,
+                           const int numQualityLayers, const int x0, const int y0,
+                           const int x1, const int y1, const int numThreads,
+                           const int tileId) {
+  // Threads are leased from the process wide budget for this decode only, so idle
+  // sessions hold none and concurrent decodes share the cores
+  ThreadLease lease(ThreadPool::Shared(), numThreads < 0 ? 1 : numThreads);
+  // The quality layer count is fixed when the decoder is set up, everything else can
+  // change between decodes of the same session
+  const bool sameSource = IsOpen() && path == _infileName && numQualityLayers == _sessionLayers;
+  if (!sameSource && !OpenSession(path, numQualityLayers, lease.Count())) {
+    return false;
+  }
+  if (DecodeIndexed(resolutionLevel, x0, y0, x1, y1, tileId, lease.Count())) {
+    _metrics.sessionReused = sameSource;
+    CountDecoded(x0, y0, x1, y1, tileId);
+    return true;
+  }
+
+  // So is the thread count, libopenjp2 refuses opj_codec_set_threads once the header is
+  // read. A session set up for another lease is reopened: with fewer threads it would
+  // leave leased cores idle, with more it would run threads nobody leased. On images of
+  // more than one tile libopenjp2 also refuses a second opj_set_decode_area, so there
+  // a session serves one region or full decode, or any number of tile decodes.
+  const bool singleTile = _codestreamInfo->tw * _codestreamInfo->th == 1;
+  const bool decodable =
+        singleTile || !_sessionDecoded || (tileId >= 0 && !_sessionAreaDecoded);
+  const bool reuse = sameSource && lease.Count() == _sessionThreads && decodable;
+  if (sameSource && !reuse && !OpenSession(path, numQualityLayers, lease.Count())) {
+    return false;
+  }
+  _metrics.sessionReused = reuse;
+  _metrics.decoderThreads = _decoderThreads;
+  if (DecodeSession(resolutionLevel, x0, y0, x1, y1, tileId)) {
+    _decoded = _image;
+    CountDecoded(x0, y0, x1, y1, tileId);
+    return true;
+  }
+  if (reuse) {
+    // A decode the codec should have taken failed on a reused session; retry once from
+    // a freshly parsed header before giving up
+    if (OpenSession(path, numQualityLayers, lease.Count()) &&
+        DecodeSession(resolutionLevel, x0, y0, x1, y1, tileId)) {
+      _decoded = _image;
+      CountDecoded(x0, y0, x1, y1, tileId);
+      return true;
+    }
+  }
+  Destroy();
+  return false;
+}
+
+bool J2kCodec::DecodeSession(const int resolutionLevel, const int x0, const int y0,
+                             const int x1, const int y1, const int tileId) {
+  StageTimer timer(_metrics, DecodeStage::DECODE);
+  // Even a failed decode leaves the codec's state behind
+  _sessionDecoded = true;
+  _sessionAreaDecoded = _sessionAreaDecoded || tileId < 0;
+  if (!opj_set_decoded_resolution_factor(_decoder, resolutionLevel)) {
+    if (_verboseMode) {
+      std::cerr << "Failed to set resolution level " << resolutionLevel << "\n";
+    }
+    return Fail(DecodeStatus::INVALID_ARGUMENT);
+  }
+
+  if (tileId >= 0) {
+    if ((OPJ_UINT32)tileId >= _codestreamInfo->tw * _codestreamInfo->th) {
+      if (_verboseMode) {
+        std::cerr << "Tile " << tileId << " out of range\n";
+      }
+      return Fail(DecodeStatus::INVALID_ARGUMENT);
+    }
+    // Seeks to the tile-parts of this tile and decodes only those, the image is
+    // resized to the (reduced) tile bounds
+    if (!opj_get_decoded_tile(_decoder, _infileStream, _image, (OPJ_UINT32)tileId)) {
+      if (_verboseMode) {
+        std::cerr << "Could not decode tile " << tileId << "\n";
+      }
+      return Fail(DecodeStatus::DECODE_FAILED);
+    }
+    return true;
+  }
+
+  // An all zero area selects the whole image, which also undoes a previous region
+  const bool hasArea = x0 >= 0 && y0 >= 0 && x1 >= 0 && y1 >= 0;
+  if (!opj_set_decode_area(_decoder, _image, hasArea ? x0 : 0, hasArea ? y0 : 0,
+                           hasArea ? x1 : 0, hasArea ? y1 : 0)) {
     if (_verboseMode) {
-      std::cout << "Decode time "
-                << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
-                << " ms" << std::endl;
-    }
-
-    ImageData im = {_image->comps[0].data, _image->comps[0].w, _image->comps[0].h};
-    return std::make_shared<ImageData>(im);
-}
-
-// void J2kCodec::DecodeTileIntoBuffer(const int tileId, const std::string& path,
-//                                           unsigned char& buffer,
-//                                           const int resolutionLevel,
-//                                           const int numQualityLayers, const int x0,
-//                                           const int y0, const int x1, const int y1,
-//                                           const int numThreads)
-// {
-//     auto t1 = Clock::now();
-//     CreateInfileStream(path);
-//     SetupDecoder(resolutionLevel, numQualityLayers, x0, x1, y0, y1, numThreads);
-
-//     OPJ_UINT32 l_data_size;
-//     OPJ_INT32 l_current_tile_x0, l_current_tile_y0, l_current_tile_x1, l_current_tile_y1;
-//     OPJ_UINT32 l_nb_comps = 0;
-//     OPJ_BOOL l_go_on = OPJ_TRUE;
-//     OPJ_UINT32 l_tile_index;
-
-//     if (!opj_read_tile_header(_decoder, _infileStream, &l_tile_index, &l_data_size,
-//                               &l_current_tile_x0, &l_current_tile_y0, &l_current_tile_x1,
-//                               &l_current_tile_y1, &l_nb_comps, &l_go_on)) {
-//         std::cerr << "Could not read tile header" << std::endl;
-//         return;
-//     }
-//     if (!opj_decode_tile_data(_decoder, l_tile_index, buffer, l_data_size,
-//                               _infileStream)) {
-//         std::cerr << "Could not decode tile\n";
-//         return;
-//     }
-
-//     auto t2 = Clock::now();
-
-//     if (_verboseMode) {
-//       std::cout << "Decode tile time "
-//                 << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
-//                 << " ms" << std::endl;
-//     }
-
-// }
-
-// std::shared_ptr<ImageData> J2kCodec::DecodeTile(const int& tileId) {
-//   if (!_isFileLoaded || !_isDecoderSetup) {
-//       std::cerr << "File and Decoder needs to be set up before decoding \n";
-//       return nullptr;
-//   }
-
-//   if (!opj_get_decoded_tile(_decoder, _infileStream, _image, tileId)) {
-//       std::cerr << "Could not decode tile\n";
-//       Destroy();
-//       return nullptr;
-//   }
-//   // Assume greyscale for now
-//   ImageData im = {_image->comps[0].data, _image->comps[0].w, _image->comps[0].h};
-//   return std::make_shared<ImageData>(im);
-// }
+      std::cerr << "Failed to set decode area\n";
+    }
+    return Fail(DecodeStatus::INVALID_ARGUMENT);
+  }
+
+  if (!opj_decode(_decoder, _infileStream, _image)) {
+    if (_verboseMode) {
+      std::cerr << "Could not decode image\n";
+    }
+    return Fail(DecodeStatus::DECODE_FAILED);
+  }
+  return true;
+}
+
+const CodestreamIndex* J2kCodec::SessionIndex() {
+  // Opened images come indexed (or not) already
+  if (IsOpenedSource(_infileName)) {
+    return _opened->Index();
+  }
+  if (_index) {
+    return _index->IsValid() ? _index.get() : nullptr;
+  }
+
+  // Built once per file; a failed build is remembered so it is not retried per decode
+  _index.reset(new CodestreamIndex());
+  const bool sidecar = _indexMode == IndexMode::SIDECAR && !IsMemorySource(_infileName);
+  const std::string sidecarPath = CodestreamIndex::SidecarPath(_infileName);
+  if (sidecar && _index->Load(sidecarPath, _infileName)) {
+    return _index.get();
+  }
+
+  const bool built =
+        _sessionBytes.data ? _index->Build(_sessionBytes) : _index->Build(_infileName);
+  if (!built) {
+    if (_verboseMode) {
+      std::cerr << "Could not index " << _infileName << "\n";
+    }
+    return nullptr;
+  }
+  if (sidecar && !_index->Save(sidecarPath, _infileName) && _verboseMode) {
+    std::cerr << "Could not write index " << sidecarPath << "\n";
+  }
+  return _index.get();
+}
+
+bool J2kCodec::DecodeIndexed(const int resolutionLevel, const int x0, const int y0,
+                             const int x1, const int y1, const int tileId,
+                             const unsigned int numThreads) {
+  const bool hasArea = x0 >= 0 && y0 >= 0 && x1 >= 0 && y1 >= 0;
+  if (_indexMode == IndexMode::OFF || (tileId < 0 && !hasArea)) {
+    return false;
+  }
+  std::vector<uint32_t> tiles;
+  const CodestreamIndex* index = nullptr;
+  {
+    StageTimer timer(_metrics, DecodeStage::INDEX);
+    index = SessionIndex();
+    if (!index || !index->CanExtract() ||
+        (tileId >= 0 && (uint32_t)tileId >= index->NumTiles())) {
+      return false;
+    }
+
+    tiles = tileId >= 0 ? std::vector<uint32_t>{(uint32_t)tileId}
+                        : index->TilesInRegion(x0, y0, x1, y1);
+    // A region covering every tile gains nothing over the session decode
+    if (tiles.empty() || tiles.size() >= index->NumTiles()) {
+      return false;
+    }
+  }
+
+  // Tile decodes of the same tile (other resolutions, a viewer coming back to it) reuse
+  // the substream and its decoder, so its header is only read once. The substream keeps
+  // the file's tile grid, on which libopenjp2 refuses a second opj_set_decode_area, but
+  // opj_get_decoded_tile can be repeated.
+  const bool reuse =
+        _substreamDecoder && _substreamReusable && tileId >= 0 && tiles == _substreamTiles;
+  if (!reuse && !OpenSubstream(*index, tiles, numThreads)) {
+    DestroySubstream();
+    return false;
+  }
+  if (!DecodeSubstream(resolutionLevel, x0, y0, x1, y1, tileId)) {
+    // A failed reuse is retried once from a fresh decoder. Any failure falls back to
+    // the session decode.
+    if (!reuse || !OpenSubstream(*index, tiles, numThreads) ||
+        !DecodeSubstream(resolutionLevel, x0, y0, x1, y1, tileId)) {
+      DestroySubstream();
+      return false;
+    }
+  }
 
-void J2kCodec::Destroy() {
   if (_verboseMode) {
+    std::cout << "Decoded " << tiles.size() << " of " << index->NumTiles()
+              << " tiles from the index (" << _substream.size() << " bytes)" << std::endl;
+  }
+  _decoded = _indexedImage;
+  _metrics.indexed = true;
+  _metrics.decoderThreads = _substreamThreads;
+  return true;
+}
+
+bool J2kCodec::OpenSubstream(const CodestreamIndex& index, const std::vector<uint32_t>& tiles,
+                             const unsigned int numThreads) {
+  DestroySubstream();
+  {
+    StageTimer timer(_metrics, DecodeStage::INDEX);
+    bool extracted;
+    if (IsOpenedSource(_infileName)) {
+      extracted = _opened->ExtractSubstream(tiles, _substream);
+    } else if (_sessionBytes.data) {
+      extracted = index.ExtractSubstream(_sessionBytes, tiles, _substream);
+    } else {
+      extracted = index.ExtractSubstream(_infileName, tiles, _substream);
+    }
+    if (!extracted) {
+      return false;
+    }
+  }
+
+  // The substream is a raw codestream with the file's main header, so the reference
+  // grid, tile numbering and decode parameters are those of the session
+  StageTimer timer(_metrics, DecodeStage::HEADER);
+  opj_dparameters_t params = _decoderParams;
+  params.decod_format = J2K_CFMT;
+  _substreamStream = CreateMemoryStream({_substream.data(), _substream.size()},
+                                        &_streamCounters);
+  _substreamDecoder = opj_create_decompress(OPJ_CODEC_J2K);
+  if (!_substreamStream || !_substreamDecoder) {
+    return false;
+  }
+  SetMessageHandlers(_substreamDecoder);
+  if (!opj_setup_decoder(_substreamDecoder, &params)) {
+    return false;
+  }
+  // Starting a worker pool costs more than one or two tiles gain from it. As for the
+  // session, libopenjp2 only takes the thread count before the header is read.
+  _substreamThreads = 1;
+  if (tiles.size() > 2 && numThreads > 1 &&
+      opj_codec_set_threads(_substreamDecoder, (int)numThreads)) {
+    _substreamThreads = numThreads;
+  }
+  if (!opj_read_header(_substreamStream, _substreamDecoder, &_indexedImage)) {
+    return false;
+  }
+  _substreamTiles = tiles;
+  _substreamReusable = true;
+  return true;
+}
+
+bool J2kCodec::DecodeSubstream(const int resolutionLevel, const int x0, const int y0,
+                               const int x1, const int y1, const int tileId) {
+  StageTimer timer(_metrics, DecodeStage::DECODE);
+  _substreamReusable = _substreamReusable && tileId >= 0;
+  if (!opj_set_decoded_resolution_factor(_substreamDecoder, resolutionLevel)) {
+    return false;
+  }
+  if (tileId >= 0) {
+    return opj_get_decoded_tile(_substreamDecoder, _substreamStream, _indexedImage,
+                                (OPJ_UINT32)tileId);
+  }
+  return opj_set_decode_area(_substreamDecoder, _indexedImage, x0, y0, x1, y1) &&
+         opj_decode(_substreamDecoder, _substreamStream, _indexedImage);
+}
+
+void J2kCodec::DestroySubstream() {
+  if (_substreamStream) {
+    opj_stream_destroy(_substreamStream);
+    _substreamStream = nullptr;
+  }
+  if (_substreamDecoder) {
+    opj_destroy_codec(_substreamDecoder);
+    _substreamDecoder = nullptr;
+  }
+  if (_indexedImage) {
+    if (_decoded == _indexedImage) {
+      _decoded = nullptr;
+    }
+    opj_image_destroy(_indexedImage);
+    _indexedImage = nullptr;
+  }
+  _substreamTiles.clear();
+  _substreamReusable = false;
+  _substreamThreads = 1;
+}
+
+bool J2kCodec::ConvertImage(void* buffer, const SampleFormat format,
+                            const uint32_t numComps) {
+  if (numComps == 0 || numComps > _decoded->numcomps) {
+    if (_verboseMode) {
+      std::cerr << "Image has " << _decoded->numcomps << " components, " << numComps
+                << " requested\n";
+    }
+    return Fail(DecodeStatus::INVALID_ARGUMENT);
+  }
+
+  StageTimer timer(_metrics, DecodeStage::CONVERT);
+  const opj_image_comp_t& first = _decoded->comps[0];
+  std::vector<ComponentPlane> planes(numComps);
+  for (uint32_t c = 0; c < numComps; ++c) {
+    const opj_image_comp_t& comp = _decoded->comps[c];
+    // Interleaving needs every plane on the same grid, subsampled chroma is not handled
+    if (comp.w != first.w || comp.h != first.h || !comp.data) {
+      if (_verboseMode) {
+        std::cerr << "Component " << c << " does not match component 0\n";
+      }
+      return Fail(DecodeStatus::UNSUPPORTED);
+    }
+    planes[c] = {comp.data, comp.prec, comp.sgnd != 0};
+  }
+
+  ConvertSamples(planes.data(), numComps, size_t(first.w) * first.h, buffer, format);
+  return true;
+}
+
+std::shared_ptr<ImageData> J2kCodec::DetachComponent(const uint32_t compno) {
+  opj_image_comp_t& comp = _decoded->comps[compno];
+  int32_t* data = comp.data;
+  // The next decode allocates a fresh plane, so the decoder's buffer can be handed out
+  // instead of copied. It was allocated by the codec and has to be released by it.
+  comp.data = nullptr;
+  return OwnedImage(data, comp.w, comp.h);
+}
+
+std::shared_ptr<ImageData> J2kCodec::CropComponent(const uint32_t compno,
+                                                   const DecodeRegion& region,
+                                                   const int resolutionLevel) {
+  const opj_image_comp_t& comp = _decoded->comps[compno];
+  // The decoded plane starts at (comp.x0, comp.y0) of the reduced component grid
+  const uint32_t x0 = ReducedCoordinate(region.x0, comp.dx, resolutionLevel);
+  const uint32_t y0 = ReducedCoordinate(region.y0, comp.dy, resolutionLevel);
+  const uint32_t x1 = ReducedCoordinate(region.x1, comp.dx, resolutionLevel);
+  const uint32_t y1 = ReducedCoordinate(region.y1, comp.dy, resolutionLevel);
+  // Regions narrower than a sample at this resolution have nothing to cut out
+  if (x1 <= x0 || y1 <= y0) {
+    Fail(DecodeStatus::INVALID_ARGUMENT);
+    return nullptr;
+  }
+  if (!comp.data || x0 < comp.x0 || y0 < comp.y0 || x1 - comp.x0 > comp.w ||
+      y1 - comp.y0 > comp.h) {
+    Fail(DecodeStatus::DECODE_FAILED);
+    return nullptr;
+  }
+  const uint32_t w = x1 - x0;
+  const uint32_t h = y1 - y0;
+  int32_t* data = (int32_t*)opj_image_data_alloc(size_t(w) * h * sizeof(int32_t));
+  if (!data) {
+    Fail(DecodeStatus::OUT_OF_MEMORY);
+    return nullptr;
+  }
+  const int32_t* src = comp.data + size_t(y0 - comp.y0) * comp.w + (x0 - comp.x0);
+  for (uint32_t y = 0; y < h; ++y) {
+    memcpy(data + size_t(y) * w, src + size_t(y) * comp.w, size_t(w) * sizeof(int32_t));
+  }
+  return OwnedImage(data, w, h);
+}
+
+void J2kCodec::Destroy() {
+  if (_verboseMode && (_infileStream || _decoder || _image)) {
     std::cerr << "Destroying..\n";
   }
-  opj_stream_destroy(_infileStream);
+  if (_infileStream) {
+    opj_stream_destroy(_infileStream);
+    _infileStream = nullptr;
+  }
   if (_codestreamInfo) {
     opj_destroy_cstr_info(&_codestreamInfo);
+    _codestreamInfo = nullptr;
   }
-  opj_destroy_codec(_decoder);
-  opj_image_destroy(_image);
- // _isDecoderSetup = false;
-  //_isFileLoaded = false;
+  if (_decoder) {
+    opj_destroy_codec(_decoder);
+    _decoder = nullptr;
+  }
+  if (_image) {
+    opj_image_destroy(_image);
+    _image = nullptr;
+  }
+  DestroySubstream();
+  _decoded = nullptr;
+  _sessionLayers = 0;
+  _sessionThreads = 1;
+  _decoderThreads = 1;
+  _sessionDecoded = false;
+  _sessionAreaDecoded = false;
 }
 
 void J2kCodec::CreateInfileStream(const std::string& filename) {
-  //strcpy(_infileName, filename.c_str());
-  _infileName = filename;
+  if (filename != _infileName) {
+    _infileName = filename;
+    _infileFormat = -1;
+    _mappedFile.Close();
+  }
 
-  _infileStream = opj_stream_create_default_file_stream(_infileName.c_str(), 1);
-  if (!_infileStream){
-    std::cerr << "Failed to create stream from file " << _infileName << "\n";
-    assert(false);
+  // Memory and mmap sources are read in place through custom stream callbacks
+  _sessionBytes = {nullptr, 0};
+  if (IsMemorySource(_infileName)) {
+    _sessionBytes = _memorySource;
+  } else if (IsOpenedSource(_infileName)) {
+    // Mapped opened images are read in place, the others through a positional stream
+    _sessionBytes = _opened->Bytes();
+    if (!_sessionBytes.data) {
+      _infileStream = _opened->CreateStream(&_streamCounters);
+      if (!_infileStream) {
+        if (_verboseMode) {
+          std::cerr << "Failed to create stream from file " << _opened->Path() << "\n";
+        }
+        Fail(DecodeStatus::OPEN_FAILED);
+      }
+      return;
+    }
+  } else if (_useMmap) {
+    if (!_mappedFile.IsOpen() && !_mappedFile.Open(_infileName)) {
+      if (_verboseMode) {
+        std::cerr << "Failed to map file " << _infileName << "\n";
+      }
+      Fail(DecodeStatus::OPEN_FAILED);
+      return;
+    }
+    _sessionBytes = _mappedFile.Span();
   }
 
-  // Infile changed, refresh decoder
-  //_isDecoderSetup = false;
- // _isFileLoaded = true;
+  if (_sessionBytes.data) {
+    _infileStream = CreateMemoryStream(_sessionBytes, &_streamCounters);
+  } else {
+    _infileStream = CreateFileStream(_infileName, &_streamCounters);
+  }
+  if (!_infileStream){
+    if (_verboseMode) {
+      std::cerr << "Failed to create stream from file " << _infileName << "\n";
+    }
+    Fail(DecodeStatus::OPEN_FAILED);
+  }
 }
 
 void J2kCodec::EncodeAsTiles(const char* outfile,
@@ -277,20 +1308,38 @@ void J2kCodec::EncodeAsTiles(const char* outfile,
                                    const unsigned int tileHeight,
                                    const unsigned int numComps,
                                    const unsigned int compPrec) {
-  opj_image_cmptparm_t l_params[4];
+  EncodeAsTiles(outfile, data, imageWidth, imageHeight, tileWidth, tileHeight, numComps,
+                compPrec, EncodeParams());
+}
+
+void J2kCodec::EncodeAsTiles(const char* outfile,
+                                   const int32_t* data,
+                                   const unsigned int imageWidth,
+                                   const unsigned int imageHeight,
+                                   const unsigned int tileWidth,
+                                   const unsigned int tileHeight,
+                                   const unsigned int numComps,
+                                   const unsigned int compPrec,
+                                   const EncodeParams& params) {
+  if (numComps == 0 || numComps > MAX_ENCODE_COMPONENTS || compPrec == 0 || compPrec > 16 ||
+      tileWidth == 0 || tileHeight == 0 || imageWidth == 0 || imageHeight == 0) {
+    std::cerr << "Unsupported encode geometry or precision\n";
+    return;
+  }
+
+  opj_image_cmptparm_t l_params[MAX_ENCODE_COMPONENTS];
   opj_image_cmptparm_t* l_current_param_ptr;
   opj_cparameters_t _encoderParams;
-  opj_image_t* _outImage;
-  opj_codec_t* _encoder;
+  CodecResources enc;
 
   l_current_param_ptr = l_params;
   // Image definition
-  for (int i = 0; i < numComps; ++i) {
+  for (unsigned int i = 0; i < numComps; ++i) {
     l_current_param_ptr->dx = 1;
     l_current_param_ptr->dy = 1;
     l_current_param_ptr->h = (OPJ_UINT32)imageHeight;
     l_current_param_ptr->w = (OPJ_UINT32)imageWidth;
-    l_current_param_ptr->sgnd = 0;
+    l_current_param_ptr->sgnd = params.isSigned ? 1 : 0;
     l_current_param_ptr->prec = (OPJ_UINT32)compPrec;
     l_current_param_ptr->x0 = 0;
     l_current_param_ptr->y0 = 0;
@@ -298,78 +1347,110 @@ void J2kCodec::EncodeAsTiles(const char* outfile,
   }
 
   opj_set_default_encoder_parameters(&_encoderParams);
-  _encoderParams.tcp_numlayers = 1;
-  _encoderParams.cp_fixed_quality = 1;
-  //_encoderParams.tcp_distoratio[0] = 100;
+  if (params.layerRates.empty()) {
+    // Single layer without a rate constraint
+    _encoderParams.tcp_numlayers = 1;
+    _encoderParams.tcp_rates[0] = 0;
+  } else {
+    _encoderParams.tcp_numlayers = (int)std::min<size_t>(params.layerRates.size(), 100);
+    for (int l = 0; l < _encoderParams.tcp_numlayers; ++l) {
+      _encoderParams.tcp_rates[l] = params.layerRates[l];
+    }
+  }
+  _encoderParams.cp_disto_alloc = 1;
   _encoderParams.cp_tx0 = 0;
   _encoderParams.cp_ty0 = 0;
   _encoderParams.tile_size_on = OPJ_TRUE;
   _encoderParams.cp_tdx = tileWidth;
   _encoderParams.cp_tdy = tileHeight;
-  _encoderParams.irreversible = 1;
-  _encoderParams.numresolution = 6;
-  _encoderParams.prog_order = OPJ_LRCP;
+  _encoderParams.irreversible = params.reversible ? 0 : 1;
+  _encoderParams.prog_order = params.progression;
+  _encoderParams.cblockw_init = params.codeBlockWidth;
+  _encoderParams.cblockh_init = params.codeBlockHeight;
+  _encoderParams.tcp_mct = numComps >= 3 ? 1 : 0;
+
+  // Every resolution level needs at least one sample per tile
+  int numResolutions = std::max(1, params.numResolutions);
+  while (numResolutions > 1 &&
+         (1u << (numResolutions - 1)) > std::min(tileWidth, tileHeight)) {
+    --numResolutions;
+  }
+  _encoderParams.numresolution = numResolutions;
+
+  if (params.precinctWidth > 0 && params.precinctHeight > 0) {
+    _encoderParams.csty |= 0x01;
+    _encoderParams.res_spec = numResolutions;
+    for (int r = 0; r < numResolutions; ++r) {
+      _encoderParams.prcw_init[r] = params.precinctWidth;
+      _encoderParams.prch_init[r] = params.precinctHeight;
+    }
+  }
 
   unsigned int len = strlen(outfile);
-  if (strcmp(outfile + len - 4, ".jp2") == 0) {
-    _encoder = opj_create_compress(OPJ_CODEC_JP2);
+  if (len >= 4 && strcmp(outfile + len - 4, ".jp2") == 0) {
+    enc.codec = opj_create_compress(OPJ_CODEC_JP2);
   } else {
-    _encoder = opj_create_compress(OPJ_CODEC_J2K);
+    enc.codec = opj_create_compress(OPJ_CODEC_J2K);
   }
 
-  if (!_encoder) {
+  if (!enc.codec) {
     std::cerr << "Failed to create codec" << std::endl;
-    Destroy();
     return;
   }
 
   //Catch events using our callbacks and give a local context
   if (_verboseMode) {
-    opj_set_info_handler(_encoder, [](const char* msg, void* client_data) {
+    opj_set_info_handler(enc.codec, [](const char* msg, void* client_data) {
                           (void)client_data;
                           std::clog << "[INFO]" << msg;
                         }, 00);
-    opj_set_warning_handler(_encoder, [](const char* msg, void* client_data) {
+    opj_set_warning_handler(enc.codec, [](const char* msg, void* client_data) {
                           (void)client_data;
                           std::cerr << "[WARNING]" << msg;
                         }, 00);
-    opj_set_error_handler(_encoder, [](const char* msg, void* client_data) {
+    opj_set_error_handler(enc.codec, [](const char* msg, void* client_data) {
                           (void)client_data;
                           std::cerr << "[ERROR]" << msg;
                         }, 00);
   }
 
-  _outImage = opj_image_tile_create(numComps, l_params, OPJ_CLRSPC_GRAY);
-  if (!_outImage) {
+  const OPJ_COLOR_SPACE colorSpace = numComps >= 3 ? OPJ_CLRSPC_SRGB : OPJ_CLRSPC_GRAY;
+  enc.image = opj_image_tile_create(numComps, l_params, colorSpace);
+  if (!enc.image) {
     std::cerr << "Failed to create image \n";
-    Destroy();
     return;
   }
 
-  _outImage->x0 = 0;
-  _outImage->y0 = 0;
-  _outImage->x1 = imageWidth;
-  _outImage->y1 = imageHeight;
-  _outImage->color_space = OPJ_CLRSPC_GRAY;
+  enc.image->x0 = 0;
+  enc.image->y0 = 0;
+  enc.image->x1 = imageWidth;
+  enc.image->y1 = imageHeight;
+  enc.image->color_space = colorSpace;
 
-  if (!opj_setup_encoder(_encoder, &_encoderParams, _outImage)) {
+  if (!opj_setup_encoder(enc.codec, &_encoderParams, enc.image)) {
     std::cerr << "Failed to set up encoder\n";
-    Destroy();
     return;
   }
 
-  opj_stream_t* outStream = opj_stream_create_default_file_stream(outfile, OPJ_FALSE);
-  if (!outStream) {
-    std::cerr << "Failed to set up out stream\n";
-    Destroy();
+  // Length markers let decoders jump to tiles and packets without scanning headers
+  const char* extraOptions[3] = {nullptr, nullptr, nullptr};
+  int numOptions = 0;
+  if (params.writePLT) {
+    extraOptions[numOptions++] = "PLT=YES";
+  }
+  if (params.writeTLM) {
+    extraOptions[numOptions++] = "TLM=YES";
+  }
+  if (numOptions && !opj_encoder_set_extra_options(enc.codec, extraOptions)) {
+    std::cerr << "Failed to enable PLT/TLM markers\n";
     return;
   }
 
-  const unsigned int numTiles = (OPJ_UINT32)(imageWidth/tileWidth) * (OPJ_UINT32)(imageHeight/tileHeight);
-  const OPJ_UINT32 dataSize = (OPJ_UINT32)tileWidth * (OPJ_UINT32) tileHeight * (OPJ_UINT32) numComps * (OPJ_UINT32)(compPrec / 8);
-  OPJ_BYTE* outData = (OPJ_BYTE*)malloc(dataSize * sizeof(OPJ_BYTE));
-
-  std::vector<std::vector<unsigned char>> outvec(numTiles);
+  enc.stream = opj_stream_create_default_file_stream(outfile, OPJ_FALSE);
+  if (!enc.stream) {
+    std::cerr << "Failed to set up out stream\n";
+    return;
+  }
 
   //  ___________ nX
   // |   |   |   |
@@ -380,57 +1461,98 @@ void J2kCodec::EncodeAsTiles(const char* outfile,
   // |___|___|___|
   // nY
 
-  const unsigned int numTilesX = imageWidth / tileWidth;
-  const unsigned int numTilesY = imageHeight / tileHeight;
-
-  for (size_t i = 0; i < numTilesY; ++i) {
-    for (size_t j = 0; j < numTilesX; j++) {
-      for (size_t y = 0; y < tileHeight; ++y) {
-        for (size_t x = 0; x < tileWidth; ++x) {
-          const int32_t& intensity =  data[y * imageWidth + j * tileWidth +
-                  i * tileHeight * imageWidth + x];
-          outvec[j + i * numTilesX].push_back(intensity);
-        }
-      }
-    }
+  // Partial tiles on the right and bottom edges are encoded at their actual size
+  const unsigned int numTilesX = (imageWidth + tileWidth - 1) / tileWidth;
+  const unsigned int numTilesY = (imageHeight + tileHeight - 1) / tileHeight;
+  const unsigned int numTiles = numTilesX * numTilesY;
+  // libopenjp2 expects planar tiles with 1 byte samples up to 8 bits, 2 above
+  const size_t sampleSize = compPrec <= 8 ? 1 : 2;
+  const size_t maxDataSize = size_t(tileWidth) * tileHeight * numComps * sampleSize;
+
+  // Tier-1 coding of each tile is spread over threads leased from the shared budget
+  ThreadPool& pool = ThreadPool::Shared();
+  ThreadLease lease(pool, ALL_THREADS);
+  if (lease.Count() > 1 && !opj_codec_set_threads(enc.codec, (int)lease.Count()) &&
+      _verboseMode) {
+    std::cerr << "Encoder does not support " << lease.Count() << " threads\n";
   }
 
-  if (!outData) {
-      std::cerr << "Failed to allocate data \n";
-  }
-
-  if (!opj_start_compress(_encoder, _outImage, outStream)) {
+  if (!opj_start_compress(enc.codec, enc.image, enc.stream)) {
       std::cerr << "Failed to start compress\n";
+      return;
   }
 
-  for (size_t i = 0; i < numTiles; ++i) {
-      if (!opj_write_tile(_encoder, i, &outvec[i][0], dataSize, outStream)) {
-          std::cerr << "Failed to write tile\n";
+  // Tiles are cut out on the pool while the encoder compresses earlier ones. A slot is
+  // only refilled once its tile has been written, which keeps tile-parts in index order
+  // and memory bounded by the window.
+  const unsigned int window = std::min(numTiles, std::max(2u, pool.Size()));
+  std::vector<std::vector<OPJ_BYTE>> slots(window, std::vector<OPJ_BYTE>(maxDataSize));
+  const TilePacker packer(numComps);
+  std::deque<std::future<void>> packed;
+  unsigned int nextTile = 0;
+  bool ok = true;
+
+  for (unsigned int i = 0; i < numTiles && ok; ++i) {
+      for (; nextTile < numTiles && nextTile < i + window; ++nextTile) {
+          OPJ_BYTE* slot = slots[nextTile % window].data();
+          const TileRect rect = TileBounds(nextTile, numTilesX, imageWidth, imageHeight,
+                                           tileWidth, tileHeight);
+          packed.push_back(pool.Submit([=] {
+              packer.Pack(data, imageWidth, numComps, rect, sampleSize, slot);
+          }));
+      }
+
+      packed.front().get();
+      packed.pop_front();
+      const TileRect rect = TileBounds(i, numTilesX, imageWidth, imageHeight, tileWidth,
+                                       tileHeight);
+      const OPJ_UINT32 dataSize = (OPJ_UINT32)(size_t(rect.w) * rect.h * numComps * sampleSize);
+      if (!opj_write_tile(enc.codec, i, slots[i % window].data(), dataSize, enc.stream)) {
+          std::cerr << "Failed to write tile " << i << "\n";
+          ok = false;
       }
   }
+  // Packing tasks still reference the slots
+  for (auto& pending : packed) {
+      pending.wait();
+  }
 
-  if (!opj_end_compress(_encoder, outStream)) {
+  if (ok && !opj_end_compress(enc.codec, enc.stream)) {
       std::cerr << "Failed to end compress\n";
   }
-
-  opj_image_destroy(_outImage);
-  opj_stream_destroy(outStream);
-  opj_destroy_codec(_encoder);
 }
 
-void J2kCodec::SetupDecoder(const int resolutionLevel, const int numQualityLayers, const int x0,
-                  const int y0, const int x1, const int y1,
-                  const int numThreads)
+bool J2kCodec::SetupDecoder(const int numQualityLayers, const unsigned int numThreads)
 {
+    if (!_infileStream) {
+        return false;
+    }
+
+    // Sniff and check once per file, reopening a session on the same file skips the
+    // extra fopen. Bytes already in memory are sniffed in place.
+    if (_infileFormat < 0) {
+        StageTimer timer(_metrics, DecodeStage::OPEN);
+        int format;
+        if (IsOpenedSource(_infileName)) {
+            format = _opened->Format();
+        } else if (_sessionBytes.data) {
+            const bool isFile = !IsMemorySource(_infileName);
+            format = GetFormat(isFile ? _infileName.c_str() : nullptr, _sessionBytes.data,
+                               _sessionBytes.size, _verboseMode);
+        } else {
+            format = GetInfileFormat(_infileName.c_str(), _verboseMode);
+        }
+        if (!CheckSource(format)) {
+            return false;
+        }
+        _infileFormat = format;
+    }
+
     opj_set_default_decoder_parameters(&_decoderParams);
-    _decoderParams.decod_format = GetInfileFormat(_infileName.c_str());
+    _decoderParams.decod_format = _infileFormat;
     _decoderParams.cp_layer = numQualityLayers;
-    _decoderParams.cp_reduce = resolutionLevel;
-
-   // opj_codec_set_threads(_decoder, 4);
-    // if (numThreads != ALL_THREADS) {
-    //   _decoderParams.numThreads = numThreads;
-    // }
+    // Resolution is chosen per decode with opj_set_decoded_resolution_factor
+    _decoderParams.cp_reduce = 0;
 
     switch (_decoderParams.decod_format) {
         case J2K_CFMT: {  // JPEG-2000 codestream
@@ -446,53 +1568,195 @@ void J2kCodec::SetupDecoder(const int resolutionLevel, const int numQualityLayer
         //     break;
         // }
         default:
-            std::cerr << "Unrecognized format for input " << _decoderParams.infile
-                      << " - Accept only .j2k, .jp2, .jpc\n";
-            return;
+            if (_verboseMode) {
+                std::cerr << "Unrecognized format for input " << _infileName
+                          << " - Accept only .j2k, .jp2, .jpc\n";
+            }
+            return Fail(DecodeStatus::UNSUPPORTED);
     }
 
+    if (!_decoder) {
+        if (_verboseMode) {
+            std::cerr << "Failed to create the decoder\n";
+        }
+        return Fail(DecodeStatus::OUT_OF_MEMORY);
+    }
     if (!opj_setup_decoder(_decoder, &_decoderParams)) {
-        std::cerr << "Failed to set up the decoder\n";
-        return;
+        if (_verboseMode) {
+            std::cerr << "Failed to set up the decoder\n";
+        }
+        return Fail(DecodeStatus::INVALID_ARGUMENT);
+    }
+    SetMessageHandlers(_decoder);
+
+    // The worker pool has to be set up before the header is read, libopenjp2 refuses it
+    // afterwards. A library built without thread support refuses it here too and decodes
+    // on the calling thread, which DecodeMetrics::decoderThreads reports.
+    _decoderThreads = 1;
+    if (numThreads > 1) {
+        if (opj_codec_set_threads(_decoder, (int)numThreads)) {
+            _decoderThreads = numThreads;
+        } else if (_verboseMode) {
+            std::cerr << "Decoder does not support " << numThreads << " threads\n";
+        }
     }
 
-    // Read the main header of the codestream and if necessary the JP2 boxes
+    // Read the main header of the codestream and if necessary the JP2 boxes. This is
+    // the only header parse of the session.
+    StageTimer timer(_metrics, DecodeStage::HEADER);
+    memset(&_headerInfo, 0, sizeof(_headerInfo));
     if (!opj_read_header_ex(_infileStream, _decoder, &_headerInfo, &_image)) {
-        std::cerr << "Failed to read the header\n";
-        return;
+        if (_verboseMode) {
+            std::cerr << "Failed to read the header\n";
+        }
+        return Fail(DecodeStatus::MALFORMED);
     }
 
-    if (x0 >= 0  && y0 >= 0 && x1 >= 0 && y1 >= 0) {
-        if (opj_set_decode_area(_decoder, _image, x0, y0, x1, y1)) {
-          std::cerr << "Failed to set decode area\n";
-          return;
+    _imageInfo = {_image->x1 - _image->x0, _image->y1 - _image->y0, _image->numcomps,
+                  _image->numcomps ? _image->comps[0].prec : 0,
+                  _image->numcomps && _image->comps[0].sgnd, _image->x0, _image->y0, 0};
+
+    // Tile grid of the code stream, needed to address tiles by index
+    _codestreamInfo = opj_get_cstr_info(_decoder);
+    if (!_codestreamInfo) {
+        if (_verboseMode) {
+            std::cerr << "Failed to read code stream info\n";
         }
+        return Fail(DecodeStatus::MALFORMED);
     }
+    const opj_tccp_info_t* tccp = _codestreamInfo->m_default_tile_info.tccp_info;
+    _imageInfo.numResolutions = tccp ? tccp->numresolutions : 1;
 
     if (_verboseMode) {
-        // Extract some info from the code stream
-        _codestreamInfo = opj_get_cstr_info(_decoder);
         fprintf(stdout, "The file contains %dx%d tiles\n", _codestreamInfo->tw,
                 _codestreamInfo->th);
-        // Catch events using our callbacks and give a local context
-        opj_set_info_handler(_decoder,
-                             [](const char* msg, void* client_data) {
-                                 (void)client_data;
+    }
+    return true;
+}
+
+bool J2kCodec::CheckSource(const int format) {
+    if (format < 0) {
+        if (_verboseMode) {
+            std::cerr << "Unrecognized format for input " << _infileName
+                      << " - Accept only .j2k, .jp2, .jpc\n";
+        }
+        return Fail(DecodeStatus::UNSUPPORTED);
+    }
+    // Opened images were checked by OpenedImage::Open
+    if (IsOpenedSource(_infileName)) {
+        return true;
+    }
+    // Broken or hostile headers are turned away here, before the codec allocates
+    // anything they describe
+    std::string detail;
+    const DecodeStatus status = _sessionBytes.data
+                                      ? CheckCodestream(_sessionBytes, _limits, &detail)
+                                      : CheckCodestream(_infileName, _limits, &detail);
+    if (status != DecodeStatus::OK) {
+        if (_verboseMode) {
+            std::cerr << "Rejected " << _infileName << ": " << detail << "\n";
+        }
+        return Fail(status);
+    }
+    return true;
+}
+
+bool J2kCodec::Fail(const DecodeStatus status) {
+    _status = status;
+    return false;
+}
+
+void J2kCodec::SetMessageHandlers(opj_codec_t* codec) {
+    // Messages are always counted, only verbose mode prints them
+    opj_set_info_handler(codec,
+                         [](const char* msg, void* client_data) {
+                             J2kCodec* self = static_cast<J2kCodec*>(client_data);
+                             ++self->_metrics.infoMessages;
+                             if (self->_verboseMode) {
                                  std::clog << "[INFO]" << msg;
-                             },
-                             00);
-        opj_set_warning_handler(_decoder,
-                                [](const char* msg, void* client_data) {
-                                    (void)client_data;
+                             }
+                         },
+                         this);
+    opj_set_warning_handler(codec,
+                            [](const char* msg, void* client_data) {
+                                J2kCodec* self = static_cast<J2kCodec*>(client_data);
+                                ++self->_metrics.warnings;
+                                if (self->_verboseMode) {
                                     std::cerr << "[WARNING]" << msg;
-                                },
-                                00);
-        opj_set_error_handler(_decoder,
-                              [](const char* msg, void* client_data) {
-                                  (void)client_data;
+                                }
+                            },
+                            this);
+    opj_set_error_handler(codec,
+                          [](const char* msg, void* client_data) {
+                              J2kCodec* self = static_cast<J2kCodec*>(client_data);
+                              ++self->_metrics.errors;
+                              if (self->_verboseMode) {
                                   std::cerr << "[ERROR]" << msg;
-                              },
-                              00);
+                              }
+                          },
+                          this);
+}
+
+const DecodeMetrics& J2kCodec::LastMetrics() const {
+    return _metrics;
+}
+
+void J2kCodec::SetMetricsSink(MetricsSink sink) {
+    _metricsSink = std::move(sink);
+}
+
+void J2kCodec::SetDecodeLimits(const DecodeLimits& limits) {
+    // Files of the current session were checked against the old limits
+    Reset();
+    _limits = limits;
+}
+
+void J2kCodec::BeginMetrics() {
+    if (_metricsDepth++ > 0) {
+        return;
+    }
+    _metrics = DecodeMetrics();
+    _status = DecodeStatus::OK;
+    _streamCounters = StreamCounters();
+    _metricsStart = Clock::now();
+}
+
+void J2kCodec::EndMetrics() {
+    if (--_metricsDepth > 0) {
+        return;
+    }
+    _metrics.totalNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             Clock::now() - _metricsStart)
+                             .count();
+    _metrics.bytesRead = _streamCounters.bytesRead;
+    _metrics.streamReads = _streamCounters.reads;
+    _metrics.streamSeeks = _streamCounters.seeks;
+    if (_metricsSink) {
+        _metricsSink(_metrics);
+    }
+
+    if (_verboseMode) {
+        const auto ms = [this](const DecodeStage stage) {
+            return _metrics.StageNs(stage) / 1e6;
+        };
+        std::cout << "Decode time " << _metrics.totalNs / 1e6 << " ms (open "
+                  << ms(DecodeStage::OPEN) << ", header " << ms(DecodeStage::HEADER)
+                  << ", index " << ms(DecodeStage::INDEX) << ", decode "
+                  << ms(DecodeStage::DECODE) << ", " << ConvertKernelName() << " convert "
+                  << ms(DecodeStage::CONVERT) << "), " << _metrics.bytesRead
+                  << " bytes read, " << _metrics.tilesDecoded << " tiles" << std::endl;
+    }
+}
+
+void J2kCodec::CountDecoded(const int x0, const int y0, const int x1, const int y1,
+                            const int tileId) {
+    _metrics.tilesDecoded += tileId >= 0 ? 1 : CountTiles(_codestreamInfo, x0, y0, x1, y1);
+    for (uint32_t c = 0; c < _decoded->numcomps; ++c) {
+        const opj_image_comp_t& comp = _decoded->comps[c];
+        if (comp.data) {
+            ++_metrics.planeAllocations;
+            _metrics.planeBytes += uint64_t(comp.w) * comp.h * sizeof(int32_t);
+        }
     }
 }
 } // namespace j2c
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "jp2_boxes.h"
+#include "byte_reader.h"
+#include "codestream_check.h"
+#include <cstdio>
+#include <cstring>
+
+#define JP2_SIGNATURE_BOX "\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a"
+
+#define JP2_BOX_ASOC 0x61736f63 // 'asoc'
+#define JP2_BOX_XML 0x786d6c20  // 'xml '
+
+namespace {
+using j2c::BoxHeader;
+using j2c::DecodeStatus;
+
+// A raw codestream starts with SOC then SIZ, it cannot carry boxes
+bool IsCodestream(const unsigned char* p) {
+    return p[0] == 0xff && p[1] == 0x4f && p[2] == 0xff && p[3] == 0x51;
+}
+
+template <typename Reader>
+DecodeStatus ReadPayload(Reader& reader, const BoxHeader& box, std::vector<uint8_t>& xml,
+                         size_t& length) {
+    if (box.payloadEnd == 0) {
+        // Box extends to EOF
+        if (!reader.ReadToEnd(box.payloadStart, xml, j2c::MAX_XML_BOX_SIZE)) {
+            return DecodeStatus::MALFORMED;
+        }
+        length = xml.size();
+        xml.push_back('\0');
+        return length > 0 ? DecodeStatus::OK : DecodeStatus::NO_XML;
+    }
+
+    const uint64_t payloadLength = box.payloadEnd - box.payloadStart;
+    if (payloadLength == 0) {
+        return DecodeStatus::NO_XML;
+    }
+    if (payloadLength > j2c::MAX_XML_BOX_SIZE) {
+        return DecodeStatus::MALFORMED;
+    }
+    xml.resize(payloadLength + 1);
+    if (!reader.Read(box.payloadStart, xml.data(), payloadLength)) {
+        return DecodeStatus::MALFORMED;
+    }
+    xml[payloadLength] = '\0';
+    length = payloadLength;
+    return DecodeStatus::OK;
+}
+
+// Scans the boxes in [begin, end) for the first XML box. `end` of zero means EOF. A box
+// header that is cut short or does not fit its parent makes the file MALFORMED.
+template <typename Reader>
+DecodeStatus FindXmlBox(Reader& reader, uint64_t begin, const uint64_t end, const int depth,
+                        std::vector<uint8_t>& xml, size_t& length) {
+    const uint64_t limit = end ? end : reader.Size();
+    BoxHeader box;
+    while (begin < limit) {
+        if (!ReadBoxHeader(reader, begin, box) || box.payloadStart > limit ||
+            (box.payloadEnd == 0 && end != 0) || box.payloadEnd > limit) {
+            return DecodeStatus::MALFORMED;
+        }
+
+        if (box.type == JP2_BOX_XML) {
+            return ReadPayload(reader, box, xml, length);
+        }
+        // Labelled metadata is stored as asoc { lbl , xml  }; nesting is shallow in
+        // practice so bound the recursion to stay safe on hostile input.
+        if (box.type == JP2_BOX_ASOC && box.payloadEnd != 0 && depth < 8) {
+            const DecodeStatus status =
+                  FindXmlBox(reader, box.payloadStart, box.payloadEnd, depth + 1, xml, length);
+            if (status != DecodeStatus::NO_XML) {
+                return status;
+            }
+        }
+
+        if (box.payloadEnd == 0) {
+            break;
+        }
+        begin = box.payloadEnd;
+    }
+    return DecodeStatus::NO_XML;
+}
+} // namespace
+
+namespace j2c {
+
+DecodeStatus ReadJp2XmlBox(const std::string& path, std::vector<uint8_t>& xml,
+                           size_t& length) {
+    length = 0;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return DecodeStatus::OPEN_FAILED;
+    }
+
+    // The signature box doubles as the format sniff, so the file is opened only once
+    FileReader reader(f);
+    unsigned char signature[12];
+    DecodeStatus status = DecodeStatus::UNSUPPORTED;
+    if (!reader.Read(0, signature, 12)) {
+        status = ferror(f) ? DecodeStatus::OPEN_FAILED : DecodeStatus::UNSUPPORTED;
+    } else if (memcmp(signature, JP2_SIGNATURE_BOX, 12) == 0) {
+        status = FindXmlBox(reader, 12, 0, 0, xml, length);
+    } else if (IsCodestream(signature)) {
+        status = DecodeStatus::NO_XML;
+    }
+
+    fclose(f);
+    return status;
+}
+
+DecodeStatus ReadJp2XmlBox(const uint8_t* data, const size_t size, std::vector<uint8_t>& xml,
+                           size_t& length) {
+    length = 0;
+    if (!data || size < 12) {
+        return DecodeStatus::UNSUPPORTED;
+    }
+    if (memcmp(data, JP2_SIGNATURE_BOX, 12) != 0) {
+        return IsCodestream(data) ? DecodeStatus::NO_XML : DecodeStatus::UNSUPPORTED;
+    }
+    MemoryReader reader(data, size);
+    return FindXmlBox(reader, 12, 0, 0, xml, length);
+}
+
+} // namespace j2c
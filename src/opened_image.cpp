@@ -0,0 +1,122 @@
+#include "opened_image.h"
+#include "format_defs.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace j2c {
+
+std::shared_ptr<const OpenedImage> OpenedImage::Open(const std::string& path,
+                                                     const bool memoryMapped,
+                                                     const IndexMode indexMode,
+                                                     const DecodeLimits& limits) {
+    std::shared_ptr<OpenedImage> image(new OpenedImage());
+    image->_path = path;
+    if (!(memoryMapped && image->_mapping.Open(path)) && !image->_file.Open(path)) {
+        std::cerr << "Failed to open " << path << "\n";
+        return nullptr;
+    }
+
+    // Rejects broken headers before the codec parses them, on behalf of every codec
+    // that will share this image
+    const ByteSpan bytes = image->Bytes();
+    std::string detail;
+    const DecodeStatus status = bytes.data ? CheckCodestream(bytes, limits, &detail)
+                                           : CheckCodestream(image->_file, limits, &detail);
+    if (status != DecodeStatus::OK) {
+        std::cerr << "Rejected " << path << ": " << detail << "\n";
+        return nullptr;
+    }
+
+    unsigned char magic[12] = {0};
+    if (bytes.data) {
+        memcpy(magic, bytes.data, std::min(bytes.size, sizeof(magic)));
+    } else if (image->_file.ReadAt(0, magic, sizeof(magic)) < 0) {
+        return nullptr;
+    }
+    image->_format = GetMagicFormat(magic, sizeof(magic));
+    if (image->_format < 0) {
+        std::cerr << "Unrecognized format for input " << path << "\n";
+        return nullptr;
+    }
+    if (!image->ReadHeader()) {
+        std::cerr << "Failed to read the header of " << path << "\n";
+        return nullptr;
+    }
+
+    if (indexMode == IndexMode::OFF) {
+        return image;
+    }
+    // The index is optional, decodes without it read the whole file
+    const std::string sidecarPath = CodestreamIndex::SidecarPath(path);
+    if (indexMode == IndexMode::SIDECAR && image->_index.Load(sidecarPath, path)) {
+        return image;
+    }
+    const bool built =
+          bytes.data ? image->_index.Build(bytes) : image->_index.Build(image->_file);
+    if (built && indexMode == IndexMode::SIDECAR) {
+        image->_index.Save(sidecarPath, path);
+    }
+    return image;
+}
+
+bool OpenedImage::ReadHeader() {
+    opj_stream_t* stream = CreateStream();
+    opj_codec_t* codec =
+          opj_create_decompress(_format == JP2_CFMT ? OPJ_CODEC_JP2 : OPJ_CODEC_J2K);
+    opj_image_t* image = nullptr;
+    opj_codestream_info_v2_t* cstrInfo = nullptr;
+    opj_dparameters_t params;
+    opj_set_default_decoder_parameters(&params);
+    params.decod_format = _format;
+
+    const bool ok = stream && codec && opj_setup_decoder(codec, &params) &&
+                    opj_read_header(stream, codec, &image) && image->numcomps > 0 &&
+                    (cstrInfo = opj_get_cstr_info(codec)) != nullptr;
+    if (ok) {
+        _info = {image->x1 - image->x0, image->y1 - image->y0, image->numcomps,
+                 image->comps[0].prec, image->comps[0].sgnd != 0, image->x0, image->y0,
+                 cstrInfo->m_default_tile_info.tccp_info
+                       ? cstrInfo->m_default_tile_info.tccp_info->numresolutions
+                       : 1};
+        _layout = {cstrInfo->tdx, cstrInfo->tdy, cstrInfo->tw, cstrInfo->th};
+    }
+
+    if (cstrInfo) {
+        opj_destroy_cstr_info(&cstrInfo);
+    }
+    if (image) {
+        opj_image_destroy(image);
+    }
+    if (codec) {
+        opj_destroy_codec(codec);
+    }
+    if (stream) {
+        opj_stream_destroy(stream);
+    }
+    return ok;
+}
+
+uint64_t OpenedImage::Size() const {
+    return _mapping.IsOpen() ? _mapping.Span().size : _file.Size();
+}
+
+const CodestreamIndex* OpenedImage::Index() const {
+    return _index.IsValid() ? &_index : nullptr;
+}
+
+opj_stream_t* OpenedImage::CreateStream(StreamCounters* counters) const {
+    return _mapping.IsOpen() ? CreateMemoryStream(_mapping.Span(), counters)
+                             : CreatePositionalStream(_file, counters);
+}
+
+bool OpenedImage::ExtractSubstream(const std::vector<uint32_t>& tiles,
+                                   std::vector<uint8_t>& out) const {
+    if (!_index.IsValid()) {
+        return false;
+    }
+    return _mapping.IsOpen() ? _index.ExtractSubstream(_mapping.Span(), tiles, out)
+                             : _index.ExtractSubstream(_file, tiles, out);
+}
+
+} // namespace j2c
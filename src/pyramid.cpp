@@ -0,0 +1,126 @@
+#include "pyramid.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+namespace {
+uint32_t CeilDivPow2(const uint32_t v, const int r) {
+    return uint32_t((uint64_t(v) + (uint64_t(1) << r) - 1) >> r);
+}
+} // namespace
+
+namespace j2c {
+
+PyramidGenerator::PyramidGenerator(const PyramidOptions& options)
+    : _options(options)
+{
+}
+
+int PyramidGenerator::LevelForSize(const ImageInfo& info, const uint32_t size) {
+    const int coarsest = info.numResolutions > 0 ? int(info.numResolutions) - 1 : 0;
+    for (int r = 0; r < coarsest; ++r) {
+        const uint32_t w = CeilDivPow2(info.x0 + info.width, r) - CeilDivPow2(info.x0, r);
+        const uint32_t h = CeilDivPow2(info.y0 + info.height, r) - CeilDivPow2(info.y0, r);
+        if (std::max(w, h) <= size) {
+            return r;
+        }
+    }
+    return coarsest;
+}
+
+bool PyramidGenerator::Generate(
+      J2kCodec& codec, const std::string& path,
+      const std::function<bool(const PyramidImage& level)>& emit) const {
+    // The session the info comes from is set up like the first decode needs it (the
+    // lowest layer count, the per decode threads), so that decode does not reopen it
+    int firstLayers = _options.thumbnailSize > 0 ? _options.thumbnailQualityLayers : 0;
+    for (const PyramidLevel& level : _options.levels) {
+        firstLayers = firstLayers ? std::min(firstLayers, level.numQualityLayers)
+                                  : level.numQualityLayers;
+    }
+    ImageInfo info;
+    if (!codec.Open(path, std::max(firstLayers, 1), _options.threadsPerDecode) ||
+        !codec.GetImageInfo(path, info) || info.numComps == 0) {
+        return false;
+    }
+
+    struct Work {
+        PyramidLevel level;
+        bool thumbnail;
+    };
+    std::vector<Work> work;
+    if (_options.thumbnailSize > 0) {
+        work.push_back({{LevelForSize(info, _options.thumbnailSize),
+                         _options.thumbnailQualityLayers},
+                        true});
+    }
+    for (const PyramidLevel& level : _options.levels) {
+        if (level.resolutionLevel < 0 || uint32_t(level.resolutionLevel) >= info.numResolutions) {
+            std::cerr << "Skipping resolution level " << level.resolutionLevel << " of " << path
+                      << ", it has " << info.numResolutions << " resolutions\n";
+            continue;
+        }
+        work.push_back({level, false});
+    }
+    // A layer count is fixed per session, so each count opens one. Single tile images
+    // decode every resolution of a count from that session; on tiled images every full
+    // decode after the first reopens it (libopenjp2 decodes those once per header read).
+    std::stable_sort(work.begin(), work.end(), [](const Work& a, const Work& b) {
+        if (a.level.numQualityLayers != b.level.numQualityLayers) {
+            return a.level.numQualityLayers < b.level.numQualityLayers;
+        }
+        return a.level.resolutionLevel > b.level.resolutionLevel;
+    });
+
+    // Samples keep the component precision when it does not fit 8 bits
+    const uint32_t bits = info.prec <= 8 ? 8 : 16;
+    const SampleFormat format = bits == 8 ? SampleFormat::UINT8 : SampleFormat::UINT16;
+    bool ok = true;
+    for (const Work& w : work) {
+        // Scoped to the iteration, the buffer is back in the pool before the next decode
+        const PyramidImage image{w.level, w.thumbnail,
+                                 codec.DecodePooled(path, format, w.level.resolutionLevel,
+                                                    w.level.numQualityLayers, -1, -1, -1, -1,
+                                                    _options.threadsPerDecode),
+                                 bits};
+        if (image.image.buffer.Empty()) {
+            return false;
+        }
+        ok = emit(image) && ok;
+    }
+    return ok;
+}
+
+PyramidStats PyramidGenerator::Run(const std::vector<std::string>& paths,
+                                   const PyramidSink& sink) const {
+    const unsigned int numWorkers =
+          _options.numWorkers ? _options.numWorkers
+                              : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+    std::atomic<size_t> levels(0);
+
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < std::min<size_t>(numWorkers, paths.size()); ++w) {
+        workers.emplace_back([&] {
+            J2kCodec codec(/*verbose=*/false);
+            for (size_t i; (i = next++) < paths.size();) {
+                const bool ok = Generate(codec, paths[i], [&](const PyramidImage& image) {
+                    ++levels;
+                    return sink(paths[i], image);
+                });
+                if (!ok) {
+                    std::cerr << "Failed to generate the pyramid of " << paths[i] << "\n";
+                    ++failed;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return {paths.size(), failed.load(), levels.load()};
+}
+
+} // namespace j2c
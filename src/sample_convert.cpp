@@ -0,0 +1,415 @@
+#include "sample_convert.h"
+#include "sample_kernels.h"
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define J2C_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define J2C_TARGET_SSE41
+#define J2C_TARGET_AVX2
+#else
+#define J2C_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define J2C_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+using j2c::SampleFormat;
+
+// Samples converted per interleave block, small enough to stay in L1
+constexpr size_t BLOCK_SIZE = 256;
+
+struct ConvertParams {
+    int32_t offset;
+    int32_t maxValue;
+    // prec > output bits: out = v >> shiftRight
+    int shiftRight;
+    // prec < output bits: out = (v << shiftLeft) | (v >> shiftReplicate)
+    int shiftLeft;
+    int shiftReplicate;
+    // Very low precision falls back to an exact multiply, scalar only
+    bool multiply;
+    uint32_t outMax;
+    float scale;
+};
+
+ConvertParams MakeParams(uint32_t prec, const bool sgnd, const int outBits) {
+    prec = std::min(std::max(prec, 1u), 30u);
+    ConvertParams p = {};
+    p.offset = sgnd ? int32_t(1) << (prec - 1) : 0;
+    p.maxValue = (int32_t(1) << prec) - 1;
+    p.outMax = outBits >= 32 ? 0 : (1u << outBits) - 1;
+    p.scale = 1.0f / float(p.maxValue);
+    if (outBits == 0) {
+        return p;
+    }
+    if ((int)prec >= outBits) {
+        p.shiftRight = prec - outBits;
+    } else if (2 * (int)prec >= outBits) {
+        p.shiftLeft = outBits - prec;
+        p.shiftReplicate = 2 * prec - outBits;
+    } else {
+        p.multiply = true;
+    }
+    return p;
+}
+
+inline uint32_t ScaleScalar(int32_t v, const ConvertParams& p) {
+    v = std::min(std::max(v + p.offset, 0), p.maxValue);
+    const uint32_t u = (uint32_t)v;
+    if (p.multiply) {
+        return uint32_t((uint64_t(u) * p.outMax + p.maxValue / 2) / uint64_t(p.maxValue));
+    }
+    if (p.shiftLeft) {
+        return (u << p.shiftLeft) | (u >> p.shiftReplicate);
+    }
+    return u >> p.shiftRight;
+}
+
+void ToUint8Scalar(const int32_t* src, const size_t n, void* dst, const ConvertParams& p) {
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = (uint8_t)ScaleScalar(src[i], p);
+    }
+}
+
+void ToUint16Scalar(const int32_t* src, const size_t n, void* dst, const ConvertParams& p) {
+    uint16_t* out = static_cast<uint16_t*>(dst);
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = (uint16_t)ScaleScalar(src[i], p);
+    }
+}
+
+void ToFloatScalar(const int32_t* src, const size_t n, void* dst, const ConvertParams& p) {
+    float* out = static_cast<float*>(dst);
+    for (size_t i = 0; i < n; ++i) {
+        const int32_t v = std::min(std::max(src[i] + p.offset, 0), p.maxValue);
+        out[i] = float(v) * p.scale;
+    }
+}
+
+#ifdef J2C_X86
+J2C_TARGET_SSE41 inline __m128i ScaleSSE41(__m128i v, const ConvertParams& p) {
+    v = _mm_add_epi32(v, _mm_set1_epi32(p.offset));
+    v = _mm_min_epi32(_mm_max_epi32(v, _mm_setzero_si128()), _mm_set1_epi32(p.maxValue));
+    if (p.shiftLeft) {
+        return _mm_or_si128(_mm_sll_epi32(v, _mm_cvtsi32_si128(p.shiftLeft)),
+                            _mm_srl_epi32(v, _mm_cvtsi32_si128(p.shiftReplicate)));
+    }
+    return _mm_srl_epi32(v, _mm_cvtsi32_si128(p.shiftRight));
+}
+
+J2C_TARGET_SSE41 void ToUint8SSE41(const int32_t* src, const size_t n, void* dst,
+                                   const ConvertParams& p) {
+    if (p.multiply) {
+        return ToUint8Scalar(src, n, dst, p);
+    }
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i a = ScaleSSE41(_mm_loadu_si128((const __m128i*)(src + i)), p);
+        const __m128i b = ScaleSSE41(_mm_loadu_si128((const __m128i*)(src + i + 4)), p);
+        const __m128i c = ScaleSSE41(_mm_loadu_si128((const __m128i*)(src + i + 8)), p);
+        const __m128i d = ScaleSSE41(_mm_loadu_si128((const __m128i*)(src + i + 12)), p);
+        const __m128i packed = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+    ToUint8Scalar(src + i, n - i, out + i, p);
+}
+
+J2C_TARGET_SSE41 void ToUint16SSE41(const int32_t* src, const size_t n, void* dst,
+                                    const ConvertParams& p) {
+    if (p.multiply) {
+        return ToUint16Scalar(src, n, dst, p);
+    }
+    uint16_t* out = static_cast<uint16_t*>(dst);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = ScaleSSE41(_mm_loadu_si128((const __m128i*)(src + i)), p);
+        const __m128i b = ScaleSSE41(_mm_loadu_si128((const __m128i*)(src + i + 4)), p);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi32(a, b));
+    }
+    ToUint16Scalar(src + i, n - i, out + i, p);
+}
+
+J2C_TARGET_SSE41 void ToFloatSSE41(const int32_t* src, const size_t n, void* dst,
+                                   const ConvertParams& p) {
+    float* out = static_cast<float*>(dst);
+    const __m128i offset = _mm_set1_epi32(p.offset);
+    const __m128i maxValue = _mm_set1_epi32(p.maxValue);
+    const __m128 scale = _mm_set1_ps(p.scale);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(src + i)), offset);
+        v = _mm_min_epi32(_mm_max_epi32(v, _mm_setzero_si128()), maxValue);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+    ToFloatScalar(src + i, n - i, out + i, p);
+}
+
+J2C_TARGET_AVX2 inline __m256i ScaleAVX2(__m256i v, const ConvertParams& p) {
+    v = _mm256_add_epi32(v, _mm256_set1_epi32(p.offset));
+    v = _mm256_min_epi32(_mm256_max_epi32(v, _mm256_setzero_si256()),
+                         _mm256_set1_epi32(p.maxValue));
+    if (p.shiftLeft) {
+        return _mm256_or_si256(_mm256_sll_epi32(v, _mm_cvtsi32_si128(p.shiftLeft)),
+                               _mm256_srl_epi32(v, _mm_cvtsi32_si128(p.shiftReplicate)));
+    }
+    return _mm256_srl_epi32(v, _mm_cvtsi32_si128(p.shiftRight));
+}
+
+J2C_TARGET_AVX2 void ToUint8AVX2(const int32_t* src, const size_t n, void* dst,
+                                 const ConvertParams& p) {
+    if (p.multiply) {
+        return ToUint8Scalar(src, n, dst, p);
+    }
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    // The packs work per 128-bit lane, this puts the 4-byte groups back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i a = ScaleAVX2(_mm256_loadu_si256((const __m256i*)(src + i)), p);
+        const __m256i b = ScaleAVX2(_mm256_loadu_si256((const __m256i*)(src + i + 8)), p);
+        const __m256i c = ScaleAVX2(_mm256_loadu_si256((const __m256i*)(src + i + 16)), p);
+        const __m256i d = ScaleAVX2(_mm256_loadu_si256((const __m256i*)(src + i + 24)), p);
+        const __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(a, b),
+                                                   _mm256_packus_epi32(c, d));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    ToUint8Scalar(src + i, n - i, out + i, p);
+}
+
+J2C_TARGET_AVX2 void ToUint16AVX2(const int32_t* src, const size_t n, void* dst,
+                                  const ConvertParams& p) {
+    if (p.multiply) {
+        return ToUint16Scalar(src, n, dst, p);
+    }
+    uint16_t* out = static_cast<uint16_t*>(dst);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256i a = ScaleAVX2(_mm256_loadu_si256((const __m256i*)(src + i)), p);
+        const __m256i b = ScaleAVX2(_mm256_loadu_si256((const __m256i*)(src + i + 8)), p);
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), packed);
+    }
+    ToUint16Scalar(src + i, n - i, out + i, p);
+}
+
+J2C_TARGET_AVX2 void ToFloatAVX2(const int32_t* src, const size_t n, void* dst,
+                                 const ConvertParams& p) {
+    float* out = static_cast<float*>(dst);
+    const __m256i offset = _mm256_set1_epi32(p.offset);
+    const __m256i maxValue = _mm256_set1_epi32(p.maxValue);
+    const __m256 scale = _mm256_set1_ps(p.scale);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(src + i)), offset);
+        v = _mm256_min_epi32(_mm256_max_epi32(v, _mm256_setzero_si256()), maxValue);
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    ToFloatScalar(src + i, n - i, out + i, p);
+}
+
+bool CpuHasAVX2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool CpuHasSSE41() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+#endif // J2C_X86
+
+typedef void (*ConvertKernel)(const int32_t*, size_t, void*, const ConvertParams&);
+
+struct KernelTable {
+    ConvertKernel toUint8;
+    ConvertKernel toUint16;
+    ConvertKernel toFloat;
+    const char* name;
+};
+
+// Picked once on first use
+const KernelTable& Kernels() {
+    static const KernelTable table = [] {
+#ifdef J2C_X86
+        if (CpuHasAVX2()) {
+            return KernelTable{ToUint8AVX2, ToUint16AVX2, ToFloatAVX2, "avx2"};
+        }
+        if (CpuHasSSE41()) {
+            return KernelTable{ToUint8SSE41, ToUint16SSE41, ToFloatSSE41, "sse4.1"};
+        }
+#endif
+        return KernelTable{ToUint8Scalar, ToUint16Scalar, ToFloatScalar, "scalar"};
+    }();
+    return table;
+}
+
+template <uint32_t Prec, bool Sgnd, uint32_t OutBits>
+void ToFixedScalar(const int32_t* src, const size_t n, void* dst, const ConvertParams&) {
+    typedef typename std::conditional<OutBits == 8, uint8_t, uint16_t>::type T;
+    j2c::ScaleRow<Prec, Sgnd, OutBits>(src, n, static_cast<T*>(dst));
+}
+
+// Scalar kernels for the common precisions, [16 bit output][8, 12, 16 bit][signed]
+const ConvertKernel FIXED_KERNELS[2][3][2] = {
+    {{ToFixedScalar<8, false, 8>, ToFixedScalar<8, true, 8>},
+     {ToFixedScalar<12, false, 8>, ToFixedScalar<12, true, 8>},
+     {ToFixedScalar<16, false, 8>, ToFixedScalar<16, true, 8>}},
+    {{ToFixedScalar<8, false, 16>, ToFixedScalar<8, true, 16>},
+     {ToFixedScalar<12, false, 16>, ToFixedScalar<12, true, 16>},
+     {ToFixedScalar<16, false, 16>, ToFixedScalar<16, true, 16>}}};
+
+// The SIMD kernels shift by register at the same speed as by constant, so a fixed
+// precision kernel only replaces the scalar ones
+ConvertKernel SelectComponentKernel(const ConvertKernel kernel, const int outBits,
+                                    const uint32_t prec, const bool sgnd) {
+    if (kernel != ToUint8Scalar && kernel != ToUint16Scalar) {
+        return kernel;
+    }
+    const int precIndex = prec == 8 ? 0 : prec == 12 ? 1 : prec == 16 ? 2 : -1;
+    return precIndex < 0 ? kernel : FIXED_KERNELS[outBits == 16][precIndex][sgnd];
+}
+
+ConvertKernel SelectKernel(const SampleFormat format, int& outBits) {
+    const KernelTable& kernels = Kernels();
+    switch (format) {
+        case SampleFormat::UINT8:
+            outBits = 8;
+            return kernels.toUint8;
+        case SampleFormat::UINT16:
+            outBits = 16;
+            return kernels.toUint16;
+        case SampleFormat::FLOAT32:
+            break;
+    }
+    outBits = 0;
+    return kernels.toFloat;
+}
+
+template <typename T>
+void ConvertInterleaved(const j2c::ComponentPlane* planes, const uint32_t numComps,
+                        const size_t count, T* dst, const ConvertKernel* kernels,
+                        const ConvertParams* params) {
+    constexpr uint32_t MAX_BLOCKS = 4;
+    T blockStorage[MAX_BLOCKS][BLOCK_SIZE];
+    const T* blocks[MAX_BLOCKS];
+    for (uint32_t c = 0; c < MAX_BLOCKS; ++c) {
+        blocks[c] = blockStorage[c];
+    }
+
+    const j2c::InterleaveKernel<T> interleave = j2c::SelectInterleave<T>(numComps);
+
+    // Groups of up to four components are converted into L1 sized blocks and then
+    // scattered, so the SIMD kernels always see contiguous input
+    for (uint32_t first = 0; first < numComps; first += MAX_BLOCKS) {
+        const uint32_t group = std::min(MAX_BLOCKS, numComps - first);
+        for (size_t offset = 0; offset < count; offset += BLOCK_SIZE) {
+            const size_t n = std::min(BLOCK_SIZE, count - offset);
+            for (uint32_t c = 0; c < group; ++c) {
+                kernels[first + c](planes[first + c].data + offset, n, blockStorage[c],
+                                   params[first + c]);
+            }
+            if (group == numComps) {
+                interleave(blocks, numComps, n, dst + offset * numComps);
+                continue;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                for (uint32_t c = 0; c < group; ++c) {
+                    dst[(offset + i) * numComps + first + c] = blocks[c][i];
+                }
+            }
+        }
+    }
+}
+} // namespace
+
+namespace j2c {
+
+size_t SampleSize(const SampleFormat format) {
+    switch (format) {
+        case SampleFormat::UINT8:
+            return 1;
+        case SampleFormat::UINT16:
+            return 2;
+        case SampleFormat::FLOAT32:
+            return 4;
+    }
+    return 0;
+}
+
+void ConvertSamples(const ComponentPlane* planes, const uint32_t numComps,
+                    const size_t count, void* dst, const SampleFormat format) {
+    if (!numComps || !count) {
+        return;
+    }
+
+    int outBits = 0;
+    const ConvertKernel kernel = SelectKernel(format, outBits);
+
+    // Kernels are picked once per call from the component layout
+    std::vector<ConvertParams> params(numComps);
+    std::vector<ConvertKernel> kernels(numComps);
+    for (uint32_t c = 0; c < numComps; ++c) {
+        params[c] = MakeParams(planes[c].prec, planes[c].sgnd, outBits);
+        kernels[c] = SelectComponentKernel(kernel, outBits, planes[c].prec, planes[c].sgnd);
+    }
+
+    if (numComps == 1) {
+        kernels[0](planes[0].data, count, dst, params[0]);
+        return;
+    }
+
+    switch (format) {
+        case SampleFormat::UINT8:
+            ConvertInterleaved(planes, numComps, count, static_cast<uint8_t*>(dst),
+                               kernels.data(), params.data());
+            break;
+        case SampleFormat::UINT16:
+            ConvertInterleaved(planes, numComps, count, static_cast<uint16_t*>(dst),
+                               kernels.data(), params.data());
+            break;
+        case SampleFormat::FLOAT32:
+            ConvertInterleaved(planes, numComps, count, static_cast<float*>(dst),
+                               kernels.data(), params.data());
+            break;
+    }
+}
+
+void ConvertPlane(const ComponentPlane& plane, const uint32_t width, const uint32_t height,
+                  void* dst, const size_t dstStride, const SampleFormat format) {
+    int outBits = 0;
+    const ConvertKernel kernel = SelectComponentKernel(SelectKernel(format, outBits), outBits,
+                                                       plane.prec, plane.sgnd);
+    const ConvertParams params = MakeParams(plane.prec, plane.sgnd, outBits);
+    const size_t rowBytes = size_t(width) * SampleSize(format);
+    if (dstStride == rowBytes) {
+        kernel(plane.data, size_t(width) * height, dst, params);
+        return;
+    }
+    for (uint32_t y = 0; y < height; ++y) {
+        kernel(plane.data + size_t(y) * width, width,
+               static_cast<uint8_t*>(dst) + y * dstStride, params);
+    }
+}
+
+const char* ConvertKernelName() {
+    return Kernels().name;
+}
+
+} // namespace j2c
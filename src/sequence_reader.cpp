@@ -0,0 +1,159 @@
+#include "sequence_reader.h"
+#include "format_defs.h"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <limits>
+
+namespace {
+bool ReadFile(const std::string& path, std::vector<uint8_t>& data) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+    bool ok = !ec && size > 0;
+    if (ok) {
+        data.resize(size_t(size));
+        ok = fread(data.data(), 1, data.size(), f) == data.size();
+    }
+    fclose(f);
+    return ok;
+}
+} // namespace
+
+namespace j2c {
+
+SequenceReader::SequenceReader(std::vector<std::string> paths, const SequenceOptions& options)
+    : _paths(std::move(paths))
+    , _options(options)
+    , _slots(std::max<size_t>(1, options.lookahead) + 1)
+    , _decodeQueue(_slots.size())
+    // At most one buffer per slot is out at a time, the slot count bounds the pool
+    , _framePool(std::make_shared<BufferPool>(std::numeric_limits<size_t>::max()))
+{
+    _reader = std::thread(&SequenceReader::ReadFrames, this);
+    for (unsigned int d = 0; d < std::max(1u, options.numDecoders); ++d) {
+        _decoders.emplace_back(&SequenceReader::DecodeFrames, this);
+    }
+}
+
+SequenceReader::~SequenceReader() {
+    Stop();
+}
+
+std::vector<std::string> SequenceReader::ListDirectory(const std::string& directory) {
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        const int format = FormatFromExtension(it->path().string().c_str());
+        if (it->is_regular_file(ec) && (format == J2K_CFMT || format == JP2_CFMT)) {
+            paths.push_back(it->path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+bool SequenceReader::Next(SequenceFrame& frame) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    // The previous frame is done with, its buffers go to the frame after the lookahead
+    if (_next > 0) {
+        Slot& previous = _slots[(_next - 1) % _slots.size()];
+        if (previous.state == SlotState::DONE) {
+            previous.image.buffer.Release();
+            previous.state = SlotState::FREE;
+            _changed.notify_all();
+        }
+    }
+    if (_next >= _paths.size()) {
+        return false;
+    }
+
+    Slot& slot = _slots[_next % _slots.size()];
+    _changed.wait(lock, [&] { return slot.state == SlotState::DONE && slot.index == _next; });
+    frame.index = _next;
+    frame.path = _paths[_next];
+    const bool ok = slot.status == DecodeStatus::OK;
+    frame.data = ok ? slot.image.buffer.Data() : nullptr;
+    frame.status = slot.status;
+    frame.w = ok ? slot.image.w : 0;
+    frame.h = ok ? slot.image.h : 0;
+    frame.numComps = ok ? slot.image.numComps : 0;
+    ++_next;
+    return true;
+}
+
+void SequenceReader::ReadFrames() {
+    for (size_t i = 0; i < _paths.size(); ++i) {
+        Slot& slot = _slots[i % _slots.size()];
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _changed.wait(lock, [&] { return _stopping || slot.state == SlotState::FREE; });
+            if (_stopping) {
+                break;
+            }
+        }
+        // A free slot belongs to the reader until it is queued
+        slot.index = i;
+        slot.status =
+              ReadFile(_paths[i], slot.input) ? DecodeStatus::OK : DecodeStatus::OPEN_FAILED;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            slot.state = SlotState::LOADED;
+        }
+        if (!_decodeQueue.Push(i)) {
+            break;
+        }
+    }
+    _decodeQueue.Close();
+}
+
+void SequenceReader::DecodeFrames() {
+    J2kCodec codec(/*verbose=*/false);
+    codec.SetBufferPool(_framePool);
+    size_t i;
+    while (_decodeQueue.Pop(i)) {
+        Slot& slot = _slots[i % _slots.size()];
+        bool stopping;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            stopping = _stopping;
+        }
+        if (slot.status == DecodeStatus::OK && !stopping) {
+            slot.image = codec.DecodePooled({slot.input.data(), slot.input.size()},
+                                            _options.format, _options.resolutionLevel,
+                                            _options.numQualityLayers, _options.x0,
+                                            _options.y0, _options.x1, _options.y1,
+                                            _options.threadsPerDecode);
+            slot.status = codec.LastStatus();
+            // The input buffer is refilled with a later frame, drop the session on it
+            codec.Reset();
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            slot.state = SlotState::DONE;
+        }
+        _changed.notify_all();
+    }
+}
+
+void SequenceReader::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _changed.notify_all();
+    _decodeQueue.Close();
+    if (_reader.joinable()) {
+        _reader.join();
+    }
+    for (auto& decoder : _decoders) {
+        decoder.join();
+    }
+    _decoders.clear();
+}
+
+} // namespace j2c
@@ -0,0 +1,95 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+namespace {
+unsigned int HardwareThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+} // namespace
+
+namespace j2c {
+
+ThreadPool& ThreadPool::Shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+    : _stopping(false)
+    , _budget(HardwareThreads())
+    , _leased(0)
+    , _policy(ThreadPolicy::INTRA_IMAGE)
+{
+    if (numThreads == 0) {
+        numThreads = HardwareThreads();
+    }
+    _budget = numThreads;
+    _workers.reserve(numThreads);
+    for (unsigned int i = 0; i < numThreads; ++i) {
+        _workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_taskMutex);
+        _stopping = true;
+    }
+    _taskReady.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::SetPolicy(const ThreadPolicy policy) {
+    std::lock_guard<std::mutex> lock(_budgetMutex);
+    _policy = policy;
+}
+
+ThreadPolicy ThreadPool::Policy() const {
+    std::lock_guard<std::mutex> lock(_budgetMutex);
+    return _policy;
+}
+
+unsigned int ThreadPool::AcquireThreads(const unsigned int requested) {
+    std::lock_guard<std::mutex> lock(_budgetMutex);
+    unsigned int count = 1;
+    if (_policy == ThreadPolicy::INTRA_IMAGE) {
+        const unsigned int wanted = requested == 0 ? _budget : std::min(requested, _budget);
+        const unsigned int available = _leased < _budget ? _budget - _leased : 0;
+        count = std::max(1u, std::min(wanted, available));
+    }
+    _leased += count;
+    return count;
+}
+
+void ThreadPool::ReleaseThreads(const unsigned int count) {
+    std::lock_guard<std::mutex> lock(_budgetMutex);
+    _leased -= std::min(count, _leased);
+}
+
+void ThreadPool::Enqueue(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(_taskMutex);
+        _tasks.push_back(std::move(task));
+    }
+    _taskReady.notify_one();
+}
+
+void ThreadPool::WorkerLoop() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_taskMutex);
+            _taskReady.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+            if (_tasks.empty()) {
+                return;
+            }
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+} // namespace j2c
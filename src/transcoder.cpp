@@ -0,0 +1,221 @@
+#include "transcoder.h"
+#include "format_defs.h"
+#include "bounded_queue.h"
+#include "image_writer.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+namespace {
+using Buffer = std::vector<uint8_t>;
+
+// One file moving through the stages. `data` holds the input bytes, then the decoded
+// samples, then the output bytes; each stage swaps in a buffer from its own pool.
+struct Item {
+    size_t job;
+    Buffer data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numComps;
+    // 8 or 16, the sample size the decoder produced
+    uint32_t bits;
+};
+
+struct Pipeline {
+    explicit Pipeline(const size_t depth)
+        : decodeQueue(depth)
+        , convertQueue(depth)
+        , writeQueue(depth)
+        , freeInput(depth)
+        , freeSamples(depth)
+        , freeOutput(depth)
+    {
+        // Buffers keep their capacity between files, so a batch of similar images
+        // stops allocating after the first few
+        for (size_t i = 0; i < depth; ++i) {
+            freeInput.Push(Buffer());
+            freeSamples.Push(Buffer());
+            freeOutput.Push(Buffer());
+        }
+    }
+
+    j2c::BoundedQueue<Item> decodeQueue;
+    j2c::BoundedQueue<Item> convertQueue;
+    j2c::BoundedQueue<Item> writeQueue;
+    j2c::BoundedQueue<Buffer> freeInput;
+    j2c::BoundedQueue<Buffer> freeSamples;
+    j2c::BoundedQueue<Buffer> freeOutput;
+    std::atomic<size_t> failed{0};
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesWritten{0};
+};
+
+uint32_t CeilDivPow2(const uint32_t v, const int r) {
+    return uint32_t((uint64_t(v) + (uint64_t(1) << r) - 1) >> r);
+}
+
+bool ReadFile(const std::string& path, Buffer& data) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+    bool ok = !ec && size > 0;
+    if (ok) {
+        data.resize(size_t(size));
+        ok = fread(data.data(), 1, data.size(), f) == data.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+j2c::SampleImage Samples(const Item& item) {
+    return {item.data.data(), item.width, item.height, item.numComps, item.bits};
+}
+} // namespace
+
+namespace j2c {
+
+Transcoder::Transcoder(const TranscodeOptions& options)
+    : _options(options)
+{
+}
+
+TranscodeStats Transcoder::Run(const std::vector<TranscodeJob>& jobs) {
+    Pipeline pipeline(std::max<size_t>(1, _options.depth));
+    const unsigned int numDecoders =
+          _options.numDecoders ? _options.numDecoders
+                               : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<unsigned int> activeDecoders(numDecoders);
+
+    // Read: load input files into recycled buffers, I/O overlaps with decoding
+    std::thread reader([&] {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            Item item = {i, Buffer(), 0, 0, 0, 0};
+            pipeline.freeInput.Pop(item.data);
+            if (!ReadFile(jobs[i].input, item.data)) {
+                std::cerr << "Failed to read " << jobs[i].input << "\n";
+                ++pipeline.failed;
+                pipeline.freeInput.Push(std::move(item.data));
+                continue;
+            }
+            pipeline.bytesRead += item.data.size();
+            pipeline.decodeQueue.Push(std::move(item));
+        }
+        pipeline.decodeQueue.Close();
+    });
+
+    // Decode: each worker owns a codec and decodes straight from the input buffer
+    std::vector<std::thread> decoders;
+    for (unsigned int d = 0; d < numDecoders; ++d) {
+        decoders.emplace_back([&] {
+            J2kCodec codec(/*verbose=*/false);
+            Item item;
+            while (pipeline.decodeQueue.Pop(item)) {
+                const ByteSpan span = {item.data.data(), item.data.size()};
+                const int r = _options.resolutionLevel;
+                ImageInfo info;
+                Buffer samples;
+                bool haveSamples = false;
+                bool ok = codec.GetImageInfo(span, info) && info.numComps > 0;
+                if (ok) {
+                    item.width = CeilDivPow2(info.x0 + info.width, r) - CeilDivPow2(info.x0, r);
+                    item.height =
+                          CeilDivPow2(info.y0 + info.height, r) - CeilDivPow2(info.y0, r);
+                    item.numComps = info.numComps;
+                    item.bits = info.prec <= 8 ? 8 : 16;
+                    haveSamples = pipeline.freeSamples.Pop(samples);
+                    samples.resize(size_t(item.width) * item.height * item.numComps *
+                                   (item.bits / 8));
+                    codec.DecodeIntoBuffer(span, samples.data(),
+                                           item.bits == 8 ? SampleFormat::UINT8
+                                                          : SampleFormat::UINT16,
+                                           r, _options.numQualityLayers, -1, -1, -1, -1,
+                                           _options.threadsPerDecode);
+                    ok = codec.LastStatus() == DecodeStatus::OK;
+                }
+                const DecodeStatus status = codec.LastStatus();
+                // The session reads the input buffer in place, drop it before recycling
+                codec.Reset();
+                pipeline.freeInput.Push(std::move(item.data));
+
+                if (!ok) {
+                    std::cerr << "Failed to decode " << jobs[item.job].input << " ("
+                              << StatusName(status) << ")\n";
+                    ++pipeline.failed;
+                    if (haveSamples) {
+                        pipeline.freeSamples.Push(std::move(samples));
+                    }
+                    continue;
+                }
+                item.data = std::move(samples);
+                pipeline.convertQueue.Push(std::move(item));
+            }
+            if (--activeDecoders == 0) {
+                pipeline.convertQueue.Close();
+            }
+        });
+    }
+
+    // Convert: lay the samples out for the output format
+    std::thread converter([&] {
+        Item item;
+        while (pipeline.convertQueue.Pop(item)) {
+            const TranscodeJob& job = jobs[item.job];
+            Buffer out;
+            pipeline.freeOutput.Pop(out);
+            const bool ok =
+                  LayoutImage(Samples(item), FormatFromExtension(job.output.c_str()), out);
+            pipeline.freeSamples.Push(std::move(item.data));
+            if (!ok) {
+                std::cerr << "Cannot write " << job.output << " in this format\n";
+                ++pipeline.failed;
+                pipeline.freeOutput.Push(std::move(out));
+                continue;
+            }
+            item.data = std::move(out);
+            pipeline.writeQueue.Push(std::move(item));
+        }
+        pipeline.writeQueue.Close();
+    });
+
+    // Write: store the bytes or re-encode; EncodeAsTiles spreads over the shared pool
+    ImageEncodeOptions encodeOptions;
+    encodeOptions.tileWidth = _options.tileWidth;
+    encodeOptions.tileHeight = _options.tileHeight;
+    encodeOptions.encodeParams = _options.encodeParams;
+    std::thread writer([&] {
+        J2kCodec encoder(/*verbose=*/false);
+        Item item;
+        while (pipeline.writeQueue.Pop(item)) {
+            const TranscodeJob& job = jobs[item.job];
+            uint64_t written = 0;
+            // item.data holds the laid out body, the geometry is the decoded image's
+            if (WriteImage(encoder, item.data, Samples(item), job.output,
+                           FormatFromExtension(job.output.c_str()), encodeOptions, written)) {
+                pipeline.bytesWritten += written;
+            } else {
+                std::cerr << "Failed to write " << job.output << "\n";
+                ++pipeline.failed;
+            }
+            pipeline.freeOutput.Push(std::move(item.data));
+        }
+    });
+
+    reader.join();
+    for (auto& decoder : decoders) {
+        decoder.join();
+    }
+    converter.join();
+    writer.join();
+
+    return {jobs.size(), pipeline.failed.load(), pipeline.bytesRead.load(),
+            pipeline.bytesWritten.load()};
+}
+
+} // namespace j2c
@@ -0,0 +1,535 @@
+#include "xml_json.h"
+#include <cstring>
+
+namespace {
+constexpr uint32_t NO_NODE = UINT32_MAX;
+// Deeper documents are rejected rather than risking the stack
+constexpr size_t MAX_XML_DEPTH = 256;
+
+const char TEXT_NAME[] = "#text";
+const char ATTRIBUTE_PREFIX = '@';
+
+bool IsWhitespace(const char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Characters of element names, as accepted by rapidxml
+bool IsNameChar(const char c) {
+    return c != '\0' && !IsWhitespace(c) && c != '/' && c != '>' && c != '?';
+}
+
+bool IsAttributeNameChar(const char c) {
+    return c != '\0' && !IsWhitespace(c) && c != '/' && c != '<' && c != '>' && c != '=' &&
+           c != '?' && c != '!';
+}
+
+// rapidxml reads numeric entities through one hex digit table, also for decimal ones
+int DigitValue(const char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool AppendUtf8(std::string& out, const unsigned long code) {
+    if (code < 0x80) {
+        out += char(code);
+    } else if (code < 0x800) {
+        out += char(0xC0 | (code >> 6));
+        out += char(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += char(0xE0 | (code >> 12));
+        out += char(0x80 | ((code >> 6) & 0x3F));
+        out += char(0x80 | (code & 0x3F));
+    } else if (code < 0x110000) {
+        out += char(0xF0 | (code >> 18));
+        out += char(0x80 | ((code >> 12) & 0x3F));
+        out += char(0x80 | ((code >> 6) & 0x3F));
+        out += char(0x80 | (code & 0x3F));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Escapes like rapidjson's Writer, which xml2json serializes with
+void AppendEscaped(std::string& out, std::string_view s) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (const char c : s) {
+        const unsigned char u = static_cast<unsigned char>(c);
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (u < 0x20) {
+                    out += "\\u00";
+                    out += hex[u >> 4];
+                    out += hex[u & 0xF];
+                } else {
+                    out += c;
+                }
+        }
+    }
+}
+} // namespace
+
+namespace j2c {
+
+void XmlJsonConverter::SetKeyFilter(const std::vector<std::string>& keys) {
+    _keys = keys;
+    _keySet.clear();
+    for (const std::string& key : _keys) {
+        _keySet.insert(key);
+    }
+}
+
+bool XmlJsonConverter::Convert(const uint8_t* xml, const size_t length) {
+    _json.clear();
+    if (!xml || length >= UINT32_MAX) {
+        return false;
+    }
+    _begin = reinterpret_cast<const char*>(xml);
+    // Box payloads are often NUL padded, the first NUL ends the document
+    const void* nul = memchr(_begin, 0, length);
+    _end = nul ? static_cast<const char*>(nul) : _begin + length;
+    _pos = _begin;
+    _nodes.clear();
+    _attributes.clear();
+    _values.clear();
+    _depth = 0;
+
+    // Node 0 stands for the document, its children are the top level nodes
+    uint32_t lastRoot = NO_NODE;
+    AddNode(NodeType::ELEMENT, NO_NODE, lastRoot);
+    lastRoot = NO_NODE;
+    if (At(0) == '\xEF' && At(1) == '\xBB' && At(2) == '\xBF') {
+        _pos += 3;
+    }
+    while (true) {
+        SkipWhitespace();
+        if (_pos >= _end) {
+            break;
+        }
+        if (At(0) != '<' || !ParseNode(0, lastRoot)) {
+            return false;
+        }
+    }
+
+    const bool filtered = !_keySet.empty();
+    if (filtered) {
+        MarkKept();
+    }
+    // The document is an object of its top level nodes, repeated names are not merged
+    _json += '{';
+    bool first = true;
+    for (uint32_t n = _nodes[0].firstChild; n != NO_NODE; n = _nodes[n].nextSibling) {
+        const Node& node = _nodes[n];
+        if (filtered && !node.keep) {
+            continue;
+        }
+        if (!first) {
+            _json += ',';
+        }
+        first = false;
+        EmitString(node.type == NodeType::ELEMENT ? Name(node) : std::string_view());
+        _json += ':';
+        EmitNode(n, !filtered || node.match, 0);
+    }
+    _json += '}';
+    return true;
+}
+
+void XmlJsonConverter::SkipWhitespace() {
+    while (_pos < _end && IsWhitespace(*_pos)) {
+        ++_pos;
+    }
+}
+
+bool XmlJsonConverter::SkipPast(const char* marker) {
+    const size_t n = strlen(marker);
+    for (; _pos + n <= _end; ++_pos) {
+        if (memcmp(_pos, marker, n) == 0) {
+            _pos += n;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t XmlJsonConverter::AddNode(const NodeType type, const uint32_t parent,
+                                   uint32_t& lastChild) {
+    const uint32_t index = uint32_t(_nodes.size());
+    Node node = {};
+    node.type = type;
+    node.parent = parent;
+    node.firstAttribute = uint32_t(_attributes.size());
+    node.firstChild = NO_NODE;
+    node.nextSibling = NO_NODE;
+    node.nextValue = NO_NODE;
+    _nodes.push_back(node);
+    if (parent != NO_NODE) {
+        if (lastChild == NO_NODE) {
+            _nodes[parent].firstChild = index;
+        } else {
+            _nodes[lastChild].nextSibling = index;
+        }
+        ++_nodes[parent].numChildren;
+    }
+    lastChild = index;
+    return index;
+}
+
+// At '<'. Declarations, processing instructions, comments and DOCTYPE are skipped like
+// rapidxml does with default flags.
+bool XmlJsonConverter::ParseNode(const uint32_t parent, uint32_t& lastChild) {
+    if (At(1) == '?') {
+        _pos += 2;
+        return SkipPast("?>");
+    }
+    if (At(1) != '!') {
+        ++_pos;
+        return ParseElement(parent, lastChild);
+    }
+
+    if (At(2) == '-' && At(3) == '-') {
+        _pos += 4;
+        return SkipPast("-->");
+    }
+    if (_end - _pos >= 9 && memcmp(_pos, "<![CDATA[", 9) == 0) {
+        _pos += 9;
+        const char* start = _pos;
+        if (!SkipPast("]]>")) {
+            return false;
+        }
+        const uint32_t node = AddNode(NodeType::CDATA, parent, lastChild);
+        _nodes[node].valueOffset = uint32_t(_values.size());
+        _nodes[node].valueLength = uint32_t(_pos - 3 - start);
+        _values.append(start, _pos - 3 - start);
+        return true;
+    }
+    if (_end - _pos >= 10 && memcmp(_pos, "<!DOCTYPE", 9) == 0 && IsWhitespace(_pos[9])) {
+        _pos += 10;
+        while (At(0) != '>') {
+            if (At(0) == '\0') {
+                return false;
+            }
+            if (At(0) == '[') {
+                // Internal subset, matched by bracket depth
+                ++_pos;
+                for (int depth = 1; depth > 0; ++_pos) {
+                    const char c = At(0);
+                    if (c == '\0') {
+                        return false;
+                    }
+                    depth += c == '[' ? 1 : c == ']' ? -1 : 0;
+                }
+            } else {
+                ++_pos;
+            }
+        }
+        ++_pos;
+        return true;
+    }
+    // Any other <! node
+    _pos += 2;
+    return SkipPast(">");
+}
+
+bool XmlJsonConverter::ParseElement(const uint32_t parent, uint32_t& lastChild) {
+    if (++_depth > MAX_XML_DEPTH) {
+        return false;
+    }
+    const char* name = _pos;
+    while (IsNameChar(At(0))) {
+        ++_pos;
+    }
+    if (_pos == name) {
+        return false;
+    }
+    const uint32_t node = AddNode(NodeType::ELEMENT, parent, lastChild);
+    _nodes[node].nameOffset = uint32_t(name - _begin);
+    _nodes[node].nameLength = uint32_t(_pos - name);
+
+    SkipWhitespace();
+    while (IsAttributeNameChar(At(0))) {
+        Attribute attribute;
+        attribute.nameOffset = uint32_t(_pos - _begin);
+        while (IsAttributeNameChar(At(0))) {
+            ++_pos;
+        }
+        attribute.nameLength = uint32_t(_pos - _begin) - attribute.nameOffset;
+        SkipWhitespace();
+        if (At(0) != '=') {
+            return false;
+        }
+        ++_pos;
+        SkipWhitespace();
+        const char quote = At(0);
+        if (quote != '"' && quote != '\'') {
+            return false;
+        }
+        ++_pos;
+        if (!ParseText(quote, attribute.valueOffset, attribute.valueLength)) {
+            return false;
+        }
+        ++_pos;
+        SkipWhitespace();
+        _attributes.push_back(attribute);
+        ++_nodes[node].numAttributes;
+    }
+
+    if (At(0) == '>') {
+        ++_pos;
+        if (!ParseContents(node)) {
+            return false;
+        }
+    } else if (At(0) == '/' && At(1) == '>') {
+        _pos += 2;
+    } else {
+        return false;
+    }
+    --_depth;
+    return true;
+}
+
+bool XmlJsonConverter::ParseContents(const uint32_t node) {
+    uint32_t lastChild = NO_NODE;
+    while (true) {
+        // Whitespace only runs between tags make no data node. Text keeps its leading
+        // and trailing whitespace.
+        const char* contentsStart = _pos;
+        SkipWhitespace();
+        if (At(0) == '\0') {
+            return false;
+        }
+        if (At(0) != '<') {
+            _pos = contentsStart;
+            const uint32_t data = AddNode(NodeType::DATA, node, lastChild);
+            if (!ParseText('<', _nodes[data].valueOffset, _nodes[data].valueLength)) {
+                return false;
+            }
+        }
+        if (At(1) == '/') {
+            // Closing tag, its name is not checked against the element
+            _pos += 2;
+            while (IsNameChar(At(0))) {
+                ++_pos;
+            }
+            SkipWhitespace();
+            if (At(0) != '>') {
+                return false;
+            }
+            ++_pos;
+            return true;
+        }
+        if (!ParseNode(node, lastChild)) {
+            return false;
+        }
+    }
+}
+
+// Copies text up to `terminator` into _values, expanding entities. Unknown entities
+// are kept verbatim.
+bool XmlJsonConverter::ParseText(const char terminator, uint32_t& offset, uint32_t& length) {
+    offset = uint32_t(_values.size());
+    while (At(0) != terminator) {
+        const char c = At(0);
+        if (c == '\0') {
+            return false;
+        }
+        if (c != '&') {
+            ++_pos;
+            _values += c;
+            continue;
+        }
+        if (At(1) == 'a' && At(2) == 'm' && At(3) == 'p' && At(4) == ';') {
+            _values += '&';
+            _pos += 5;
+        } else if (At(1) == 'a' && At(2) == 'p' && At(3) == 'o' && At(4) == 's' &&
+                   At(5) == ';') {
+            _values += '\'';
+            _pos += 6;
+        } else if (At(1) == 'q' && At(2) == 'u' && At(3) == 'o' && At(4) == 't' &&
+                   At(5) == ';') {
+            _values += '"';
+            _pos += 6;
+        } else if (At(1) == 'g' && At(2) == 't' && At(3) == ';') {
+            _values += '>';
+            _pos += 4;
+        } else if (At(1) == 'l' && At(2) == 't' && At(3) == ';') {
+            _values += '<';
+            _pos += 4;
+        } else if (At(1) == '#') {
+            const bool hex = At(2) == 'x';
+            _pos += hex ? 3 : 2;
+            unsigned long code = 0;
+            for (int digit; (digit = DigitValue(At(0))) >= 0; ++_pos) {
+                code = code * (hex ? 16 : 10) + unsigned(digit);
+                if (code >= 0x110000) {
+                    return false;
+                }
+            }
+            if (At(0) != ';' || !AppendUtf8(_values, code)) {
+                return false;
+            }
+            ++_pos;
+        } else {
+            ++_pos;
+            _values += '&';
+        }
+    }
+    length = uint32_t(_values.size()) - offset;
+    return true;
+}
+
+void XmlJsonConverter::MarkKept() {
+    // Children come after their parents, so one backwards pass reaches every ancestor
+    for (size_t n = _nodes.size(); n-- > 1;) {
+        Node& node = _nodes[n];
+        if (node.type == NodeType::ELEMENT) {
+            node.match = _keySet.count(Name(node)) != 0;
+            node.keep = node.keep || node.match;
+        }
+        if (node.keep && node.parent != NO_NODE) {
+            _nodes[node.parent].keep = true;
+        }
+    }
+}
+
+// `full` emits the node as xml2json would, otherwise only the kept elements below it
+void XmlJsonConverter::EmitNode(const uint32_t index, const bool full, const size_t depth) {
+    const Node& node = _nodes[index];
+    if (node.type != NodeType::ELEMENT) {
+        EmitString(Value(node));
+        return;
+    }
+    if (full) {
+        const bool textOnly =
+              node.numChildren == 1 && _nodes[node.firstChild].type == NodeType::DATA;
+        if (node.numAttributes == 0 && node.numChildren == 0) {
+            _json += "null";
+            return;
+        }
+        if (node.numAttributes == 0 && textOnly) {
+            EmitString(Value(_nodes[node.firstChild]));
+            return;
+        }
+    }
+    EmitObject(index, full, depth);
+}
+
+void XmlJsonConverter::EmitObject(const uint32_t index, const bool full, const size_t depth) {
+    if (_members.size() <= depth) {
+        _members.resize(depth + 1);
+    }
+    _members[depth].clear();
+
+    // Collect members the way xml2json adds them to a rapidjson object: a repeated name
+    // becomes an array, and RemoveMember moves the last member into the freed slot
+    // before the array is appended at the end
+    const Node& node = _nodes[index];
+    for (uint32_t c = node.firstChild; c != NO_NODE; c = _nodes[c].nextSibling) {
+        Node& child = _nodes[c];
+        if (!full && !child.keep) {
+            continue;
+        }
+        child.nextValue = NO_NODE;
+        const std::string_view name =
+              child.type == NodeType::ELEMENT ? Name(child) : std::string_view(TEXT_NAME);
+        std::vector<Member>& members = _members[depth];
+        size_t m = 0;
+        while (m < members.size() && members[m].name != name) {
+            ++m;
+        }
+        if (m == members.size()) {
+            members.push_back({name, c, c, 1});
+            continue;
+        }
+        Member merged = members[m];
+        _nodes[merged.last].nextValue = c;
+        merged.last = c;
+        ++merged.count;
+        members[m] = members.back();
+        members.pop_back();
+        members.push_back(merged);
+    }
+
+    _json += '{';
+    bool first = true;
+    if (full) {
+        const bool textOnly =
+              node.numChildren == 1 && _nodes[node.firstChild].type == NodeType::DATA;
+        // <e attr="x">text</e> puts the text before the attributes
+        if (textOnly) {
+            EmitString(TEXT_NAME);
+            _json += ':';
+            EmitString(Value(_nodes[node.firstChild]));
+            first = false;
+            _members[depth].clear();
+        }
+        for (uint32_t a = 0; a < node.numAttributes; ++a) {
+            const Attribute& attribute = _attributes[node.firstAttribute + a];
+            if (!first) {
+                _json += ',';
+            }
+            first = false;
+            _json += '"';
+            _json += ATTRIBUTE_PREFIX;
+            AppendEscaped(_json, std::string_view(_begin + attribute.nameOffset,
+                                                  attribute.nameLength));
+            _json += "\":";
+            EmitString(std::string_view(_values.data() + attribute.valueOffset,
+                                        attribute.valueLength));
+        }
+    }
+    // Indexed access, emitting children reuses deeper member lists and may grow _members
+    for (size_t m = 0; m < _members[depth].size(); ++m) {
+        const Member member = _members[depth][m];
+        if (!first) {
+            _json += ',';
+        }
+        first = false;
+        EmitString(member.name);
+        _json += ':';
+        if (member.count > 1) {
+            _json += '[';
+        }
+        for (uint32_t v = member.first; v != NO_NODE; v = _nodes[v].nextValue) {
+            if (v != member.first) {
+                _json += ',';
+            }
+            EmitNode(v, full || _nodes[v].match, depth + 1);
+        }
+        if (member.count > 1) {
+            _json += ']';
+        }
+    }
+    _json += '}';
+}
+
+void XmlJsonConverter::EmitString(std::string_view s) {
+    _json += '"';
+    AppendEscaped(_json, s);
+    _json += '"';
+}
+
+std::string_view XmlJsonConverter::Name(const Node& node) const {
+    return std::string_view(_begin + node.nameOffset, node.nameLength);
+}
+
+std::string_view XmlJsonConverter::Value(const Node& node) const {
+    return std::string_view(_values.data() + node.valueOffset, node.valueLength);
+}
+
+} // namespace j2c
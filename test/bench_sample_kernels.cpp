@@ -0,0 +1,176 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include "sample_convert.h"
+#include "sample_kernels.h"
+
+using namespace j2c;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+namespace {
+// Best of `iterations` runs of `op`, in GB/s of `bytes` moved (read plus written)
+double Throughput(const int iterations, const size_t bytes, const std::function<void()>& op) {
+  op();
+  double best = 0;
+  for (int i = 0; i < iterations; ++i) {
+    auto t1 = Clock::now();
+    op();
+    auto t2 = Clock::now();
+    const double sec = std::chrono::duration<double>(t2 - t1).count();
+    best = std::max(best, sec > 0 ? bytes / 1e9 / sec : 0);
+  }
+  return best;
+}
+
+void Report(const std::string& name, const double generic, const double fixed,
+            const bool same) {
+  std::cout << name << ": generic " << generic << " GB/s, fixed " << fixed << " GB/s ("
+            << fixed / generic << "x)" << (same ? "" : " MISMATCH") << "\n";
+}
+
+// The loop ConvertSamples ran before the fixed precision kernels, precision known at
+// runtime only
+template <typename T>
+void ScaleGeneric(const int32_t* src, const size_t n, T* dst, const uint32_t prec,
+                  const bool sgnd, const int outBits) {
+  const int32_t offset = sgnd ? int32_t(1) << (prec - 1) : 0;
+  const int32_t maxValue = (int32_t(1) << prec) - 1;
+  for (size_t i = 0; i < n; ++i) {
+    const uint32_t u = (uint32_t)std::min(std::max(src[i] + offset, 0), maxValue);
+    dst[i] = (int)prec >= outBits ? T(u >> (prec - outBits))
+                                  : T((u << (outBits - prec)) | (u >> (2 * prec - outBits)));
+  }
+}
+
+// Interleaved samples to planes, row by row as EncodeAsTiles packs tiles
+template <typename T>
+void GatherCase(const std::vector<int32_t>& image, const unsigned int size,
+                const uint32_t numComps, const int iterations) {
+  const size_t planeSize = size_t(size) * size;
+  std::vector<T> a(planeSize * numComps), b(planeSize * numComps);
+  const auto run = [&](std::vector<T>& out, const GatherKernel<T> gather) {
+    std::vector<T*> rows(numComps);
+    for (uint32_t c = 0; c < numComps; ++c) {
+      rows[c] = out.data() + c * planeSize;
+    }
+    for (unsigned int y = 0; y < size; ++y) {
+      gather(image.data() + size_t(y) * size * numComps, numComps, size, rows.data());
+      for (uint32_t c = 0; c < numComps; ++c) {
+        rows[c] += size;
+      }
+    }
+  };
+  const size_t bytes = planeSize * numComps * (sizeof(int32_t) + sizeof(T));
+  const double generic = Throughput(iterations, bytes, [&] { run(a, GatherRowGeneric<T>); });
+  const double fixed = Throughput(iterations, bytes, [&] { run(b, SelectGather<T>(numComps)); });
+  Report("gather " + std::to_string(numComps) + "x" + std::to_string(8 * sizeof(T)),
+         generic, fixed, a == b);
+}
+
+// Planes to interleaved samples in the L1 sized blocks ConvertSamples uses
+template <typename T>
+void InterleaveCase(const unsigned int size, const uint32_t numComps, const int iterations) {
+  constexpr size_t BLOCK_SIZE = 256;
+  const size_t planeSize = size_t(size) * size;
+  std::vector<T> planes(planeSize * numComps);
+  for (size_t i = 0; i < planes.size(); ++i) {
+    planes[i] = T(i * 2654435761u >> 7);
+  }
+  std::vector<T> a(planes.size()), b(planes.size());
+  const auto run = [&](std::vector<T>& out, const InterleaveKernel<T> interleave) {
+    std::vector<const T*> blocks(numComps);
+    for (size_t offset = 0; offset < planeSize; offset += BLOCK_SIZE) {
+      const size_t n = std::min(BLOCK_SIZE, planeSize - offset);
+      for (uint32_t c = 0; c < numComps; ++c) {
+        blocks[c] = planes.data() + c * planeSize + offset;
+      }
+      interleave(blocks.data(), numComps, n, out.data() + offset * numComps);
+    }
+  };
+  const size_t bytes = 2 * planes.size() * sizeof(T);
+  const double generic =
+      Throughput(iterations, bytes, [&] { run(a, InterleaveRowGeneric<T>); });
+  const double fixed =
+      Throughput(iterations, bytes, [&] { run(b, SelectInterleave<T>(numComps)); });
+  Report("interleave " + std::to_string(numComps) + "x" + std::to_string(8 * sizeof(T)),
+         generic, fixed, a == b);
+}
+
+template <uint32_t Prec, bool Sgnd, uint32_t OutBits, typename T>
+void ScaleCase(const std::vector<int32_t>& samples, const int iterations) {
+  std::vector<T> a(samples.size()), b(samples.size()), c(samples.size());
+  const size_t bytes = samples.size() * (sizeof(int32_t) + sizeof(T));
+  const double generic = Throughput(iterations, bytes, [&] {
+    ScaleGeneric(samples.data(), samples.size(), a.data(), Prec, Sgnd, OutBits);
+  });
+  const double fixed = Throughput(iterations, bytes, [&] {
+    ScaleRow<Prec, Sgnd, OutBits>(samples.data(), samples.size(), b.data());
+  });
+  const ComponentPlane plane = {samples.data(), Prec, Sgnd};
+  const double library = Throughput(iterations, bytes, [&] {
+    ConvertSamples(&plane, 1, samples.size(), c.data(),
+                   OutBits == 8 ? SampleFormat::UINT8 : SampleFormat::UINT16);
+  });
+  const std::string name = "scale " + std::to_string(Prec) + (Sgnd ? "s" : "u") + "->" +
+                           std::to_string(OutBits);
+  Report(name, generic, fixed, a == b && b == c);
+  std::cout << "  ConvertSamples (" << ConvertKernelName() << "): " << library << " GB/s\n";
+}
+} // namespace
+
+// Times the compile time specialized sample kernels against the generic loops they
+// replace on a synthetic image: the encoder's planar gather, the decoder's interleave
+// and the precision scaling. A plain copy of the same image gives the memory bandwidth
+// they are measured against.
+int main(int argc, char* argv[]) {
+  unsigned int size = 2048;
+  int iterations = 10;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "--size") {
+      size = (unsigned int)std::max(64, std::stoi(argv[i + 1]));
+    } else if (arg == "--iterations") {
+      iterations = std::max(1, std::stoi(argv[i + 1]));
+    } else {
+      std::cerr << "[ERROR] input format. Example: \n ./bench_sample_kernels [--size 2048] "
+                   "[--iterations 10]\n";
+      return 0;
+    }
+  }
+
+  // Four interleaved components of 16 bit samples, signed ones come from the same bits
+  std::vector<int32_t> image(size_t(size) * size * 4);
+  uint32_t seed = 12345;
+  for (auto& v : image) {
+    seed = seed * 1664525u + 1013904223u;
+    v = int32_t(seed >> 16) - 16384;
+  }
+
+  std::vector<int32_t> copy(image.size());
+  const double bandwidth = Throughput(iterations, 2 * image.size() * sizeof(int32_t), [&] {
+    std::memcpy(copy.data(), image.data(), image.size() * sizeof(int32_t));
+  });
+  std::cout << "image: " << size << "x" << size << ", memcpy " << bandwidth << " GB/s\n";
+
+  for (const uint32_t numComps : {1u, 3u, 4u}) {
+    GatherCase<uint8_t>(image, size, numComps, iterations);
+    GatherCase<uint16_t>(image, size, numComps, iterations);
+  }
+  for (const uint32_t numComps : {3u, 4u}) {
+    InterleaveCase<uint8_t>(size, numComps, iterations);
+    InterleaveCase<uint16_t>(size, numComps, iterations);
+  }
+
+  const std::vector<int32_t> samples(image.begin(), image.begin() + size_t(size) * size);
+  ScaleCase<8, false, 8, uint8_t>(samples, iterations);
+  ScaleCase<12, false, 8, uint8_t>(samples, iterations);
+  ScaleCase<12, true, 16, uint16_t>(samples, iterations);
+  ScaleCase<16, false, 16, uint16_t>(samples, iterations);
+  ScaleCase<8, false, 16, uint16_t>(samples, iterations);
+  return 0;
+}
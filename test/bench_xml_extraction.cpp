@@ -0,0 +1,140 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include "j2kcodec.h"
+#include "xml_json.h"
+#include "xml2json.hpp"
+
+using namespace j2c;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Compares the decoder based fetchXMLData against the box walking fetchXMLBox over
+// every .jp2 file below a directory and reports files/sec for both, then does the same
+// for the JSON conversion with xml2json and XmlJsonConverter.
+int main(int argc, char* argv[]) {
+  if (argc < 3 || std::string(argv[1]) != "-m") {
+    std::cerr << "[ERROR] input format. Example: \n ./bench_xml_extraction -m directorypath [--iterations N]\n";
+    return 0;
+  }
+  int iterations = 1;
+  if (argc == 5 && std::string(argv[3]) == "--iterations") {
+    iterations = std::max(1, std::stoi(argv[4]));
+  }
+
+  std::vector<std::string> files;
+  for (auto& dirEntry : std::filesystem::recursive_directory_iterator(argv[2])) {
+    if (dirEntry.is_regular_file() && dirEntry.path().extension() == ".jp2") {
+      files.push_back(dirEntry.path().string());
+    }
+  }
+  if (files.empty()) {
+    std::cerr << "[ERROR] no .jp2 files found in " << argv[2] << "\n";
+    return 0;
+  }
+
+  // Current path: one codec per file, exactly like the extractor tools do
+  size_t decoderBytes = 0;
+  auto t1 = Clock::now();
+  for (int it = 0; it < iterations; ++it) {
+    for (const auto& path : files) {
+      J2kCodec j(/*verbose=*/false);
+      decoderBytes += j.fetchXMLData(path).length;
+    }
+  }
+  auto t2 = Clock::now();
+
+  size_t boxBytes = 0;
+  size_t mismatches = 0;
+  J2kCodec boxCodec(/*verbose=*/false);
+  auto t3 = Clock::now();
+  for (int it = 0; it < iterations; ++it) {
+    for (const auto& path : files) {
+      boxBytes += boxCodec.fetchXMLBox(path).length;
+    }
+  }
+  auto t4 = Clock::now();
+
+  // Verify both paths agree before trusting the numbers
+  for (const auto& path : files) {
+    J2kCodec j(/*verbose=*/false);
+    const XmlData a = j.fetchXMLData(path);
+    const XmlData b = boxCodec.fetchXMLBox(path);
+    size_t lenA = a.length;
+    while (lenA > 0 && a.data[lenA - 1] == '\0') {
+      --lenA;
+    }
+    if (lenA != b.length || memcmp(a.data, b.data, lenA) != 0) {
+      std::cerr << "[WARNING] XML differs for " << path << "\n";
+      ++mismatches;
+    }
+  }
+
+  // JSON conversion of the payloads already in memory. xml2json needs a terminated
+  // string, which the box reader provides, and parses it in place, so it gets a copy.
+  std::vector<std::vector<uint8_t>> payloads;
+  for (const auto& path : files) {
+    const XmlData xml = boxCodec.fetchXMLBox(path);
+    if (xml.data) {
+      payloads.emplace_back(xml.data, xml.data + xml.length + 1);
+    }
+  }
+  std::vector<uint8_t> scratch;
+  const auto domJson = [&](const std::vector<uint8_t>& xml) {
+    scratch.assign(xml.begin(), xml.end());
+    return xml2json(reinterpret_cast<const char*>(scratch.data()));
+  };
+  size_t domBytes = 0;
+  auto t5 = Clock::now();
+  for (int it = 0; it < iterations; ++it) {
+    for (const auto& xml : payloads) {
+      domBytes += domJson(xml).size();
+    }
+  }
+  auto t6 = Clock::now();
+
+  size_t streamBytes = 0;
+  XmlJsonConverter converter;
+  auto t7 = Clock::now();
+  for (int it = 0; it < iterations; ++it) {
+    for (const auto& xml : payloads) {
+      if (converter.Convert(xml.data(), xml.size() - 1)) {
+        streamBytes += converter.Json().size();
+      }
+    }
+  }
+  auto t8 = Clock::now();
+
+  size_t jsonMismatches = 0;
+  for (const auto& xml : payloads) {
+    if (!converter.Convert(xml.data(), xml.size() - 1) ||
+        converter.Json() != domJson(xml)) {
+      ++jsonMismatches;
+    }
+  }
+
+  const double numFiles = double(files.size()) * iterations;
+  const double decoderSec = std::chrono::duration<double>(t2 - t1).count();
+  const double boxSec = std::chrono::duration<double>(t4 - t3).count();
+  const double numPayloads = double(payloads.size()) * iterations;
+  const double domSec = std::chrono::duration<double>(t6 - t5).count();
+  const double streamSec = std::chrono::duration<double>(t8 - t7).count();
+  std::cout << "files: " << files.size() << " x " << iterations << "\n"
+            << "fetchXMLData: " << numFiles / decoderSec << " files/sec ("
+            << decoderBytes << " bytes)\n"
+            << "fetchXMLBox:  " << numFiles / boxSec << " files/sec (" << boxBytes
+            << " bytes)\n"
+            << "speedup: " << decoderSec / boxSec << "x, mismatches: " << mismatches
+            << "\n"
+            << "xml2json:         " << numPayloads / domSec << " files/sec (" << domBytes
+            << " bytes)\n"
+            << "XmlJsonConverter: " << numPayloads / streamSec << " files/sec ("
+            << streamBytes << " bytes)\n"
+            << "speedup: " << domSec / streamSec << "x, mismatches: " << jsonMismatches
+            << "\n";
+  return 0;
+}
@@ -1,34 +1,33 @@
 #include <iostream>
 #include <string>
 #include "j2kcodec.h"
-#include "xml2json.hpp"
 
 using namespace j2c;
 
 int main(int argc, char* argv[]) {
+  if (argc < 3 || std::string(argv[1]) != "-m") {
+    std::cerr << "[ERROR] input format. Example: \n ./decode -m filename [resolution level]\n";
+    return 0;
+  }
+  const std::string path = argv[2];
+  const int resolutionLevel = argc > 3 ? std::stoi(argv[3]) : 0;
 
-  SimpleJ2kCodec j(/*verbose=*/false);
-  return 0;
-  // TODO
-  //j.CreateInfileStream("helio335.jp2");
-  //auto img2 = j.Decode(path, 0); // Must go first lol
-  //auto img = j.DecodeTile(0);
-  //j.EncodeAsTiles("out.j2k", img2->data, 4096, 4096, 512, 512, 1, 8);
-
-  //for (int i = 0; i < 1; i++) {
-  //  std::cerr << img->data[i] << " ";
-  //}
-
-  //for (int i = 0; i < 1; i++) {
-  //  std::cerr << img2->data[i] << " ";
- // }
+  J2kCodec j(/*verbose=*/true);
+  ImageInfo info;
+  TileLayout layout;
+  if (!j.GetImageInfo(path, info) || !j.GetTileLayout(path, layout)) {
+    std::cerr << "[ERROR] could not open " << path << "\n";
+    return 1;
+  }
+  std::cout << path << ": " << info.width << " x " << info.height << ", " << info.numComps
+            << " components, " << info.prec << " bits, " << layout.numTilesX << " x "
+            << layout.numTilesY << " tiles\n";
 
-  //j.Encode("outloders.j2k");
-  // j.SetResolutionFactor(2);
-  // auto tile1 = j.DecodeTile(0);
-  // for (int i = 0; i < tile1->w * tile1->h; i++) {
-  //   std::cout<< tile1->data[i] << " ";
-  // }
-
-//  std::cout << "Res " << tile1->w << " x " << tile1->h;
+  auto image = j.Decode(path, resolutionLevel);
+  if (!image) {
+    std::cerr << "[ERROR] could not decode " << path << "\n";
+    return 1;
+  }
+  std::cout << "Res " << image->w << " x " << image->h << "\n";
+  return 0;
 }
@@ -1,7 +1,8 @@
+#include <fstream>
 #include <iostream>
 #include <string>
 #include "j2kcodec.h"
-#include "xml2json.hpp"
+#include "xml_json.h"
 
 using namespace j2c;
 
@@ -18,16 +19,23 @@ int main(int argc, char* argv[]) {
   }
 
   const std::string path = argv[2];
-  const XmlData xmlData = j.fetchXMLData(path);
-  const std::string jsonData = xml2json(reinterpret_cast<char*>(xmlData.data));
+  const XmlData xmlData = j.fetchXMLBox(path);
+  if (!xmlData.data) {
+    std::cerr << "[ERROR] no XML box found in " << path << "\n";
+    return 0;
+  }
+  XmlJsonConverter converter;
+  if (!converter.Convert(xmlData.data, xmlData.length)) {
+    std::cerr << "[ERROR] malformed XML in " << path << "\n";
+    return 0;
+  }
+  const std::string& jsonData = converter.Json();
 
   size_t lastindex = path.find_last_of(".");
   std::string basename = path.substr(0, lastindex);
   std::ofstream myfile(basename + ".json");
   if (myfile.is_open()) {
-    for (int i = 0; i < jsonData.size(); ++i) {
-      myfile << jsonData[i];
-    }
+    myfile.write(jsonData.data(), jsonData.size());
     myfile.close();
   }
 
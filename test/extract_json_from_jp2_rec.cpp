@@ -1,43 +1,132 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
 #include "j2kcodec.h"
-#include "xml2json.hpp"
+#include "bounded_queue.h"
+#include "xml_json.h"
 #include <filesystem>
 
 using namespace j2c;
 
-void extractJSON(const std::string& path) {
-	J2kCodec j(/*verbose=*/false);
-	const XmlData xmlData = j.fetchXMLData(path);
-	const std::string jsonData = xml2json(reinterpret_cast<char*>(xmlData.data));
+typedef std::chrono::high_resolution_clock Clock;
+
+struct CrawlStats {
+	std::atomic<size_t> files{0};
+	std::atomic<size_t> failures{0};
+	std::atomic<size_t> bytesWritten{0};
+};
+
+bool writeFile(const std::string& path, const std::string& data) {
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	const bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+	return fclose(f) == 0 && ok;
+}
+
+bool extractJSON(J2kCodec& j, XmlJsonConverter& converter, const std::string& path,
+                 CrawlStats& stats) {
+	const XmlData xmlData = j.fetchXMLBox(path);
+	if (!xmlData.data || !converter.Convert(xmlData.data, xmlData.length)) {
+		return false;
+	}
+	const std::string& jsonData = converter.Json();
 
 	size_t lastindex = path.find_last_of(".");
 	std::string basename = path.substr(0, lastindex);
-	std::ofstream myfile(basename + ".json");
-	if (myfile.is_open()) {
-		for (int i = 0; i < jsonData.size(); ++i) {
-			myfile << jsonData[i];
+	if (!writeFile(basename + ".json", jsonData)) {
+		return false;
+	}
+	stats.bytesWritten += jsonData.size();
+	return true;
+}
+
+// Each worker owns one codec and converter for the whole run and pulls paths until the
+// walk is done
+void worker(BoundedQueue<std::string>& queue, const std::vector<std::string>& keys,
+            CrawlStats& stats) {
+	J2kCodec j(/*verbose=*/false);
+	XmlJsonConverter converter;
+	converter.SetKeyFilter(keys);
+	std::string path;
+	while (queue.Pop(path)) {
+		if (!extractJSON(j, converter, path, stats)) {
+			std::cerr << "[WARNING] failed to extract " << path << "\n";
+			++stats.failures;
 		}
-		myfile.close();
+		++stats.files;
 	}
 }
 
 int main(int argc, char* argv[]) {
-	if (argc != 3 || std::string(argv[1]) != "-m") {
-		std::cerr << "[ERROR] input format. Example: \n ./extract_json_from_jp2_rec -m directorypath\n";
+	unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::string> keys;
+	bool validArgs = argc >= 3 && argc % 2 == 1 && std::string(argv[1]) == "-m";
+	for (int i = 3; validArgs && i + 1 < argc; i += 2) {
+		const std::string arg = argv[i];
+		if (arg == "--threads") {
+			// Anything but a positive number is a usage error, not an exception
+			char* end = nullptr;
+			const long n = strtol(argv[i + 1], &end, 10);
+			validArgs = end != argv[i + 1] && *end == '\0' && n > 0 && n <= 4096;
+			numThreads = validArgs ? (unsigned int)n : numThreads;
+		}
+		else if (arg == "--keys") {
+			// Comma separated element names, only these (and their parents) are written
+			std::stringstream list(argv[i + 1]);
+			for (std::string key; std::getline(list, key, ',');) {
+				if (!key.empty()) {
+					keys.push_back(key);
+				}
+			}
+		}
+		else {
+			validArgs = false;
+		}
+	}
+	if (!validArgs) {
+		std::cerr << "[ERROR] input format. Example: \n ./extract_json_from_jp2_rec -m directorypath [--threads N] [--keys DATE-OBS,WAVELNTH]\n";
 		return 0;
 	}
 
 	const std::string dirpath = std::string(argv[2]);
-	using std::experimental::filesystem::recursive_directory_iterator;
-	for (auto& dirEntry : recursive_directory_iterator(dirpath)) {
-		if (is_regular_file(dirEntry.path())) {
-			const std::string path = dirEntry.path().string();
-			if (path.substr(path.find_last_of(".") + 1) == "jp2") {
-				extractJSON(path);
-			}
+	CrawlStats stats;
+	// 64 entries per worker keeps everyone busy without letting the walk run far ahead
+	BoundedQueue<std::string> queue(numThreads * 64);
+
+	auto t1 = Clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < numThreads; ++i) {
+		workers.emplace_back(worker, std::ref(queue), std::cref(keys), std::ref(stats));
+	}
+
+	std::error_code ec;
+	using std::filesystem::recursive_directory_iterator;
+	for (recursive_directory_iterator it(dirpath, ec), end; !ec && it != end; it.increment(ec)) {
+		if (it->is_regular_file(ec) && it->path().extension() == ".jp2") {
+			queue.Push(it->path().string());
 		}
 	}
-		   
-	return 0;
+	if (ec) {
+		std::cerr << "[WARNING] directory walk stopped early: " << ec.message() << "\n";
+	}
+	queue.Close();
+	for (auto& w : workers) {
+		w.join();
+	}
+	auto t2 = Clock::now();
+
+	const double seconds = std::chrono::duration<double>(t2 - t1).count();
+	std::cout << "Processed " << stats.files << " files with " << numThreads << " threads in "
+	          << seconds << " s (" << (seconds > 0 ? stats.files / seconds : 0.0) << " files/sec), "
+	          << stats.failures << " failures, " << stats.bytesWritten << " bytes written\n";
+	return stats.failures ? 1 : 0;
 }
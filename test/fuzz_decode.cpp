@@ -0,0 +1,42 @@
+#include <cstddef>
+#include <cstdint>
+#include "j2kcodec.h"
+#include "xml_json.h"
+
+using namespace j2c;
+
+// libFuzzer harness over the decode and XML paths: structural check, header parse,
+// full, region and pooled decodes at the coarsest resolution, and XML box extraction
+// and conversion. Configure with -DJ2KCODEC_FUZZ=ON using clang and run
+// ./fuzz_decode {corpus directory}.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  // Tight enough that no input makes a run allocate more than a few hundred MB
+  DecodeLimits limits;
+  limits.maxPixels = 1ull << 24;
+  limits.maxComponents = 16;
+  limits.maxTileComponents = 1ull << 12;
+  limits.maxMetadataBytes = 1ull << 20;
+
+  const ByteSpan span = {data, size};
+  J2kCodec codec(/*verbose=*/false);
+  codec.SetDecodeLimits(limits);
+  ImageInfo info;
+  if (codec.GetImageInfo(span, info)) {
+    // The coarsest resolution keeps runs short, the region goes through the index
+    const int level = info.numResolutions > 0 ? (int)info.numResolutions - 1 : 0;
+    codec.Decode(span, level);
+    codec.Decode(span, level, 1, (int)info.x0, (int)info.y0,
+                 (int)(info.x0 + info.width / 2 + 1), (int)(info.y0 + info.height / 2 + 1));
+    PooledImage image = codec.DecodePooled(span, SampleFormat::UINT8, level);
+    (void)image;
+  }
+
+  XmlJsonConverter converter;
+  const XmlData xml = codec.fetchXMLBox(span);
+  if (xml.data) {
+    converter.Convert(xml.data, xml.length);
+  }
+  // The converter also sees the raw input, as if it were a box payload
+  converter.Convert(data, size);
+  return 0;
+}
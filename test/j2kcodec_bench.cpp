@@ -0,0 +1,733 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include "decode_service.h"
+#include "j2kcodec.h"
+#include "opened_image.h"
+#include "thread_pool.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace j2c;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+namespace {
+struct BenchOptions {
+  unsigned int size = 4096;
+  unsigned int tile = 512;
+  unsigned int region = 512;
+  int iterations = 10;
+  std::vector<int> threads;
+  std::string outfile;
+  std::string workdir;
+  // Heap retained for libopenjp2 by RetainHeapForDecode, 0 leaves malloc alone
+  size_t retainHeapMb = 0;
+};
+
+struct BenchResult {
+  std::string name;
+  int threads;
+  int iterations;
+  double p50Ms;
+  double p99Ms;
+  double meanMs;
+  double mbPerSec;
+  uint64_t peakRssKb;
+};
+
+uint64_t PeakRssKb() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize / 1024;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Nearest rank percentile of sorted samples
+double Percentile(const std::vector<double>& sorted, const double p) {
+  const size_t rank = (size_t)std::ceil(p * sorted.size());
+  return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+// Runs `op` once to warm up (sessions, page cache) and then `iterations` timed times.
+// `op` returns the bytes it produced, which gives the throughput.
+BenchResult Measure(const std::string& name, const int threads, const int iterations,
+                    const std::function<size_t(int)>& op) {
+  op(0);
+  std::vector<double> samples;
+  size_t bytes = 0;
+  for (int i = 0; i < iterations; ++i) {
+    auto t1 = Clock::now();
+    bytes += op(i);
+    auto t2 = Clock::now();
+    samples.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+  }
+
+  std::sort(samples.begin(), samples.end());
+  double total = 0;
+  for (const double s : samples) {
+    total += s;
+  }
+  const BenchResult result = {name, threads, iterations, Percentile(samples, 0.5),
+                              Percentile(samples, 0.99), total / iterations,
+                              total > 0 ? (bytes / 1e6) / (total / 1e3) : 0, PeakRssKb()};
+  std::cerr << name << " threads=" << threads << " p50=" << result.p50Ms
+            << "ms p99=" << result.p99Ms << "ms " << result.mbPerSec << " MB/s\n";
+  return result;
+}
+
+// Region `i` of a fixed pseudo random sequence, so every run reads the same tiles
+DecodeRegion RegionAt(const BenchOptions& options, const int i) {
+  const unsigned int span = options.size - options.region + 1;
+  const int x0 = int((unsigned int)(i * 7919u) % span);
+  const int y0 = int((unsigned int)(i * 104729u) % span);
+  return {x0, y0, x0 + int(options.region), y0 + int(options.region)};
+}
+
+// Eight overlapping half size regions around spot `i`, a viewer's burst of requests
+std::vector<DecodeRegion> BurstAt(const BenchOptions& options, const int i) {
+  const unsigned int half = options.region / 2;
+  // The burst spans 1.75 regions of half size
+  const unsigned int room = options.size - (half + 3 * half / 4) + 1;
+  const unsigned int x0 = (unsigned int)(i * 7919u) % room;
+  const unsigned int y0 = (unsigned int)(i * 104729u) % room;
+  std::vector<DecodeRegion> regions;
+  for (unsigned int k = 0; k < 8; ++k) {
+    const int dx = int(x0 + (k % 4) * half / 4);
+    const int dy = int(y0 + (k / 4) * half / 2);
+    regions.push_back({dx, dy, dx + int(half), dy + int(half)});
+  }
+  return regions;
+}
+
+DecodeRequest RegionRequest(const std::string& path, const DecodeRegion& r) {
+  DecodeRequest request;
+  request.path = path;
+  request.x0 = r.x0;
+  request.y0 = r.y0;
+  request.x1 = r.x1;
+  request.y1 = r.y1;
+  return request;
+}
+
+bool SamePixels(const std::shared_ptr<ImageData>& a, const std::shared_ptr<ImageData>& b) {
+  return a && b && a->w == b->w && a->h == b->h &&
+         std::equal(a->data, a->data + size_t(a->w) * a->h, b->data);
+}
+
+bool SameIndex(const CodestreamIndex& a, const CodestreamIndex& b) {
+  const auto& x = a.TileParts();
+  const auto& y = b.TileParts();
+  if (!a.IsValid() || !b.IsValid() || a.NumTiles() != b.NumTiles() ||
+      x.size() != y.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (x[i].offset != y[i].offset || x[i].length != y[i].length ||
+        x[i].dataOffset != y[i].dataOffset || x[i].tileIndex != y[i].tileIndex ||
+        x[i].partIndex != y[i].partIndex || x[i].firstPacket != y[i].firstPacket ||
+        x[i].numPackets != y[i].numPackets) {
+      return false;
+    }
+  }
+  for (uint32_t tile = 0; tile < a.NumTiles(); ++tile) {
+    const auto ra = a.RangesForTiles({tile});
+    const auto rb = b.RangesForTiles({tile});
+    const auto sameRange = [](const ByteRange& l, const ByteRange& r) {
+      return l.offset == r.offset && l.length == r.length;
+    };
+    if (ra.size() != rb.size() ||
+        !std::equal(ra.begin(), ra.end(), rb.begin(), sameRange)) {
+      return false;
+    }
+  }
+  return a.PacketLengths() == b.PacketLengths();
+}
+
+// Smooth gradients with some noise so the encoder does real work at every resolution
+std::vector<int32_t> MakeImage(const unsigned int size) {
+  std::vector<int32_t> pixels(size_t(size) * size);
+  uint32_t seed = 12345;
+  for (unsigned int y = 0; y < size; ++y) {
+    for (unsigned int x = 0; x < size; ++x) {
+      seed = seed * 1664525u + 1013904223u;
+      const int value = int((x * 255u) / size + (y * 127u) / size) / 2 + int(seed >> 28);
+      pixels[size_t(y) * size + x] = std::min(255, value);
+    }
+  }
+  return pixels;
+}
+
+void AppendUint32BE(std::string& out, const uint32_t v) {
+  const char bytes[4] = {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+  out.append(bytes, 4);
+}
+
+void AppendBox(std::string& out, const char* type, const std::string& payload) {
+  AppendUint32BE(out, uint32_t(payload.size() + 8));
+  out.append(type, 4);
+  out += payload;
+}
+
+// Wraps a greyscale 8 bit codestream in a minimal JP2 with an XML box in front of it,
+// the layout the metadata extractors are used on
+bool WriteJp2WithXml(const std::string& j2kPath, const std::string& jp2Path,
+                     const unsigned int size) {
+  std::ifstream in(j2kPath, std::ios::binary);
+  std::stringstream codestream;
+  codestream << in.rdbuf();
+  if (!in || codestream.str().empty()) {
+    return false;
+  }
+
+  std::string ihdr;
+  AppendUint32BE(ihdr, size);
+  AppendUint32BE(ihdr, size);
+  ihdr += std::string("\x00\x01\x07\x07\x00\x00", 6); // 1 comp, 8 bit, JPEG 2000, no IPR
+  std::string colr = std::string("\x01\x00\x00", 3);   // enumerated colour space
+  AppendUint32BE(colr, 17);                            // greyscale
+  std::string jp2h;
+  AppendBox(jp2h, "ihdr", ihdr);
+  AppendBox(jp2h, "colr", colr);
+
+  std::string xml = "<?xml version=\"1.0\"?><meta><fits>";
+  for (int i = 0; i < 200; ++i) {
+    xml += "<KEY" + std::to_string(i) + ">" + std::to_string(i * 0.5) + "</KEY" +
+           std::to_string(i) + ">";
+  }
+  xml += "</fits></meta>";
+
+  std::string file("\x00\x00\x00\x0c\x6a\x50\x20\x20\x0d\x0a\x87\x0a", 12);
+  AppendBox(file, "ftyp", std::string("jp2 \x00\x00\x00\x00jp2 ", 12));
+  AppendBox(file, "jp2h", jp2h);
+  AppendBox(file, "xml ", xml);
+  AppendBox(file, "jp2c", codestream.str());
+
+  std::ofstream out(jp2Path, std::ios::binary);
+  out.write(file.data(), file.size());
+  return bool(out);
+}
+
+std::vector<int> ParseList(const std::string& s) {
+  std::vector<int> values;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    values.push_back(std::max(1, std::stoi(item)));
+  }
+  return values;
+}
+
+void WriteJson(std::ostream& out, const BenchOptions& options,
+               const std::vector<BenchResult>& results) {
+  out << "{\n  \"benchmark\": \"j2kcodec\",\n"
+      << "  \"image\": {\"width\": " << options.size << ", \"height\": " << options.size
+      << ", \"tile\": " << options.tile << ", \"region\": " << options.region
+      << ", \"components\": 1, \"precision\": 8},\n"
+      << "  \"iterations\": " << options.iterations << ",\n"
+      << "  \"peak_rss_kb\": " << PeakRssKb() << ",\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult& r = results[i];
+    out << "    {\"name\": \"" << r.name << "\", \"threads\": " << r.threads
+        << ", \"iterations\": " << r.iterations << ", \"p50_ms\": " << r.p50Ms
+        << ", \"p99_ms\": " << r.p99Ms << ", \"mean_ms\": " << r.meanMs
+        << ", \"mb_per_s\": " << r.mbPerSec << ", \"peak_rss_kb\": " << r.peakRssKb << "}"
+        << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+}
+} // namespace
+
+// Generates a synthetic tiled image and times the main library paths across thread
+// counts. Results go to stdout (or --out) as JSON so runs can be diffed between
+// versions; a readable summary goes to stderr.
+int main(int argc, char* argv[]) {
+  BenchOptions options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "--size") {
+      options.size = (unsigned int)std::max(64, std::stoi(argv[i + 1]));
+    } else if (arg == "--tile") {
+      options.tile = (unsigned int)std::max(64, std::stoi(argv[i + 1]));
+    } else if (arg == "--region") {
+      options.region = (unsigned int)std::max(16, std::stoi(argv[i + 1]));
+    } else if (arg == "--iterations") {
+      options.iterations = std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--threads") {
+      options.threads = ParseList(argv[i + 1]);
+    } else if (arg == "--out") {
+      options.outfile = argv[i + 1];
+    } else if (arg == "--workdir") {
+      options.workdir = argv[i + 1];
+    } else if (arg == "--retain-heap") {
+      options.retainHeapMb = (size_t)std::max(0, std::stoi(argv[i + 1]));
+    } else {
+      std::cerr << "[ERROR] input format. Example: \n ./j2kcodec_bench [--size 4096] "
+                   "[--tile 512] [--region 512] [--iterations 10] [--threads 1,2,4] "
+                   "[--out results.json] [--workdir dir] [--retain-heap MB]\n";
+      return 1;
+    }
+  }
+
+  ThreadPool& pool = ThreadPool::Shared();
+  if (options.threads.empty()) {
+    for (unsigned int n = 1; n < pool.Size(); n *= 2) {
+      options.threads.push_back((int)n);
+    }
+    options.threads.push_back((int)pool.Size());
+  }
+  options.region = std::min(options.region, options.size);
+
+  const std::filesystem::path workdir =
+        options.workdir.empty() ? std::filesystem::temp_directory_path() / "j2kcodec_bench"
+                                : std::filesystem::path(options.workdir);
+  std::filesystem::create_directories(workdir);
+  const std::string j2kPath = (workdir / "synthetic.j2k").string();
+  const std::string jp2Path = (workdir / "synthetic.jp2").string();
+
+  const std::vector<int32_t> pixels = MakeImage(options.size);
+  const size_t imageBytes = pixels.size();
+  std::vector<BenchResult> results;
+
+  for (const int threads : options.threads) {
+    // EncodeAsTiles takes every core the shared budget has left, so hold back the rest
+    const unsigned int held = pool.Size() > (unsigned int)threads ? pool.Size() - threads : 0;
+    std::unique_ptr<ThreadLease> holdBack;
+    if (held > 0) {
+      holdBack.reset(new ThreadLease(pool, held));
+    }
+    J2kCodec encoder(/*verbose=*/false);
+    results.push_back(Measure("encode_tiled", threads, options.iterations, [&](int) {
+      encoder.EncodeAsTiles(j2kPath.c_str(), pixels.data(), options.size, options.size,
+                            options.tile, options.tile, 1, 8);
+      return imageBytes;
+    }));
+  }
+  if (!std::filesystem::exists(j2kPath) || !WriteJp2WithXml(j2kPath, jp2Path, options.size)) {
+    std::cerr << "[ERROR] could not write the synthetic image to " << workdir << "\n";
+    return 1;
+  }
+
+  J2kCodec probe(/*verbose=*/false);
+  ImageInfo info;
+  TileLayout layout;
+  if (!probe.GetImageInfo(j2kPath, info) || !probe.GetTileLayout(j2kPath, layout)) {
+    std::cerr << "[ERROR] could not read back " << j2kPath << "\n";
+    return 1;
+  }
+  const int numLevels = EncodeParams().numResolutions;
+  std::vector<float> floatBuffer(imageBytes);
+
+  for (const int threads : options.threads) {
+    // One codec per configuration, so decodes after the warm up reuse the file, its
+    // index and mmap like a long running caller would. Full decodes of the tiled image
+    // still parse the header each time, libopenjp2 decodes it once per header read.
+    J2kCodec codec(/*verbose=*/false);
+
+    results.push_back(Measure("decode_full", threads, options.iterations, [&](int) {
+      auto image = codec.Decode(j2kPath, 0, 1, -1, -1, -1, -1, threads);
+      return image ? size_t(image->w) * image->h : 0;
+    }));
+
+    for (int level = 1; level < numLevels; ++level) {
+      results.push_back(Measure("decode_res" + std::to_string(level), threads,
+                                options.iterations, [&](int) {
+        auto image = codec.Decode(j2kPath, level, 1, -1, -1, -1, -1, threads);
+        return image ? size_t(image->w) * image->h : 0;
+      }));
+    }
+
+    const auto regionOp = [&](int i) {
+      const DecodeRegion r = RegionAt(options, i);
+      auto image = codec.Decode(j2kPath, 0, 1, r.x0, r.y0, r.x1, r.y1, threads);
+      return image ? size_t(image->w) * image->h : 0;
+    };
+    codec.SetIndexMode(IndexMode::OFF);
+    results.push_back(Measure("decode_region", threads, options.iterations, regionOp));
+    codec.SetIndexMode(IndexMode::MEMORY);
+    results.push_back(Measure("decode_region_indexed", threads, options.iterations, regionOp));
+
+    // A burst of overlapping viewport requests around one spot, one by one and batched
+    results.push_back(Measure("decode_region_burst", threads, options.iterations, [&](int i) {
+      size_t pixels = 0;
+      for (const DecodeRegion& r : BurstAt(options, i)) {
+        auto image = codec.Decode(j2kPath, 0, 1, r.x0, r.y0, r.x1, r.y1, threads);
+        pixels += image ? size_t(image->w) * image->h : 0;
+      }
+      return pixels;
+    }));
+    results.push_back(Measure("decode_region_batched", threads, options.iterations, [&](int i) {
+      size_t pixels = 0;
+      for (const auto& image : codec.DecodeRegions(j2kPath, BurstAt(options, i), 0, 1, threads)) {
+        pixels += image ? size_t(image->w) * image->h : 0;
+      }
+      return pixels;
+    }));
+
+    results.push_back(Measure("decode_into_buffer_u8", threads, options.iterations, [&](int) {
+      codec.DecodeIntoBuffer(j2kPath, floatBuffer.data(), SampleFormat::UINT8, 0, 1, -1, -1,
+                             -1, -1, threads);
+      return imageBytes;
+    }));
+    results.push_back(Measure("decode_into_buffer_f32", threads, options.iterations, [&](int) {
+      codec.DecodeIntoBuffer(j2kPath, floatBuffer.data(), SampleFormat::FLOAT32, 0, 1, -1,
+                             -1, -1, -1, threads);
+      return imageBytes * sizeof(float);
+    }));
+    results.push_back(Measure("decode_pooled_u8", threads, options.iterations, [&](int) {
+      PooledImage image = codec.DecodePooled(j2kPath, SampleFormat::UINT8, 0, 1, -1, -1, -1,
+                                             -1, threads);
+      return image.buffer.Size();
+    }));
+  }
+
+  // DecodeService on one worker, held on a first request while the rest queue up: they
+  // have to complete highest priority first and in submission order within a priority,
+  // cancelled ones as cancelled, the others with the pixels of a plain decode
+  {
+    DecodeServiceOptions serviceOptions;
+    serviceOptions.numWorkers = 1;
+    DecodeService service(serviceOptions);
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    DecodeRequest plug;
+    plug.path = j2kPath;
+    plug.resolutionLevel = numLevels - 1;
+    plug.tileId = 0;
+    DecodeTicket plugTicket = service.Submit(
+          plug, [&](const DecodeRequest&, const DecodeResult&) { released.wait(); });
+    while (service.Pending() > 0) {
+      std::this_thread::yield();
+    }
+
+    const int numRequests = 24;
+    std::mutex orderMutex;
+    std::vector<int> completed;
+    std::vector<DecodeTicket> tickets;
+    for (int i = 0; i < numRequests; ++i) {
+      DecodeRequest request = RegionRequest(j2kPath, RegionAt(options, i));
+      request.priority = (i * 5) % 3;
+      const auto record = [&, i](const DecodeRequest&, const DecodeResult&) {
+        std::lock_guard<std::mutex> lock(orderMutex);
+        completed.push_back(i);
+      };
+      tickets.push_back(service.Submit(request, record));
+      if (i % 7 == 3) {
+        tickets.back().Cancel();
+      }
+    }
+    release.set_value();
+    plugTicket.Get();
+
+    std::vector<int> expected(numRequests);
+    for (int i = 0; i < numRequests; ++i) {
+      expected[i] = i;
+    }
+    std::stable_sort(expected.begin(), expected.end(),
+                     [](const int a, const int b) { return (a * 5) % 3 > (b * 5) % 3; });
+    J2kCodec reference(/*verbose=*/false);
+    bool ok = true;
+    for (int i = 0; i < numRequests; ++i) {
+      const DecodeResult result = tickets[i].Get();
+      const DecodeRegion r = RegionAt(options, i);
+      ok = ok && (i % 7 == 3 ? result.cancelled && !result.image
+                             : !result.cancelled &&
+                                     SamePixels(result.image, reference.Decode(j2kPath, 0, 1,
+                                                                               r.x0, r.y0, r.x1,
+                                                                               r.y1, 1)));
+    }
+    if (!ok || completed != expected) {
+      std::cerr << "[ERROR] DecodeService completed requests out of priority order, "
+                   "missed a cancellation or returned other pixels than a plain decode\n";
+      return 1;
+    }
+    std::cerr << "decode_service_order ok\n";
+  }
+
+  // The same regions through a DecodeService with one worker per thread, and through
+  // one codec per thread splitting them up front
+  const int serviceRequests = 32;
+  for (const int threads : options.threads) {
+    DecodeServiceOptions serviceOptions;
+    serviceOptions.numWorkers = (unsigned int)threads;
+    DecodeService service(serviceOptions);
+    results.push_back(Measure("service_regions", threads, options.iterations, [&](int i) {
+      std::vector<DecodeRequest> requests;
+      for (int k = 0; k < serviceRequests; ++k) {
+        requests.push_back(RegionRequest(j2kPath, RegionAt(options, i * serviceRequests + k)));
+      }
+      size_t pixels = 0;
+      for (DecodeTicket& ticket : service.SubmitBatch(std::move(requests))) {
+        const DecodeResult result = ticket.Get();
+        pixels += result.image ? size_t(result.image->w) * result.image->h : 0;
+      }
+      return pixels;
+    }));
+
+    std::vector<std::unique_ptr<J2kCodec>> codecs;
+    for (int t = 0; t < threads; ++t) {
+      codecs.emplace_back(new J2kCodec(/*verbose=*/false));
+    }
+    results.push_back(Measure("thread_codecs_regions", threads, options.iterations, [&](int i) {
+      std::atomic<size_t> pixels(0);
+      std::vector<std::thread> workers;
+      for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+          for (int k = t; k < serviceRequests; k += threads) {
+            const DecodeRegion r = RegionAt(options, i * serviceRequests + k);
+            auto image = codecs[t]->Decode(j2kPath, 0, 1, r.x0, r.y0, r.x1, r.y1, 1);
+            pixels += image ? size_t(image->w) * image->h : 0;
+          }
+        });
+      }
+      for (auto& worker : workers) {
+        worker.join();
+      }
+      return pixels.load();
+    }));
+  }
+
+  // One OpenedImage shared by a codec per thread, read through the mapping and with
+  // pread. Every region has to match a decode of the path.
+  for (const bool memoryMapped : {true, false}) {
+    const auto image = OpenedImage::Open(j2kPath, memoryMapped, IndexMode::MEMORY);
+    if (!image || !image->Index() || (memoryMapped && image->Bytes().size == 0)) {
+      std::cerr << "[ERROR] could not open " << j2kPath << " as a shared image\n";
+      return 1;
+    }
+    const std::string name = memoryMapped ? "opened_regions_mmap" : "opened_regions_pread";
+    for (const int threads : options.threads) {
+      std::vector<std::unique_ptr<J2kCodec>> codecs;
+      for (int t = 0; t < threads; ++t) {
+        codecs.emplace_back(new J2kCodec(/*verbose=*/false));
+      }
+      std::atomic<int> mismatches(0);
+      const auto decodeRegions = [&](const int i, const bool check) {
+        std::atomic<size_t> pixels(0);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+          workers.emplace_back([&, t] {
+            J2kCodec pathCodec(/*verbose=*/false);
+            for (int k = t; k < serviceRequests; k += threads) {
+              const DecodeRegion r = RegionAt(options, i * serviceRequests + k);
+              auto decoded = codecs[t]->Decode(image, 0, 1, r.x0, r.y0, r.x1, r.y1, 1);
+              pixels += decoded ? size_t(decoded->w) * decoded->h : 0;
+              if (check && !SamePixels(decoded, pathCodec.Decode(j2kPath, 0, 1, r.x0, r.y0,
+                                                                 r.x1, r.y1, 1))) {
+                ++mismatches;
+              }
+            }
+          });
+        }
+        for (auto& worker : workers) {
+          worker.join();
+        }
+        return pixels.load();
+      };
+      decodeRegions(0, true);
+      if (mismatches > 0) {
+        std::cerr << "[ERROR] " << mismatches << " regions of the shared image ("
+                  << (memoryMapped ? "mmap" : "pread") << ", " << threads
+                  << " threads) differ from decodes of the path\n";
+        return 1;
+      }
+      results.push_back(Measure(name, threads, options.iterations,
+                                [&](int i) { return decodeRegions(i, false); }));
+    }
+  }
+  std::cerr << "opened_image_regions ok\n";
+
+  // A sidecar saved and loaded again has to describe the same tile-parts, serve shared
+  // images and codecs with the same pixels and be rejected once the file is touched
+  {
+    const std::string sidecarPath = CodestreamIndex::SidecarPath(j2kPath);
+    CodestreamIndex built;
+    CodestreamIndex loaded;
+    bool ok = built.Build(j2kPath) && built.Save(sidecarPath, j2kPath) &&
+              loaded.Load(sidecarPath, j2kPath) && SameIndex(built, loaded);
+
+    const DecodeRegion r = RegionAt(options, 5);
+    J2kCodec reference(/*verbose=*/false);
+    const auto expected = reference.Decode(j2kPath, 0, 1, r.x0, r.y0, r.x1, r.y1, 1);
+    for (int k = 0; ok && k < 2; ++k) {
+      // The first open may build and save the sidecar, the second has to load it
+      const auto image = OpenedImage::Open(j2kPath, true, IndexMode::SIDECAR);
+      J2kCodec codec(/*verbose=*/false);
+      ok = image && image->Index() && SameIndex(built, *image->Index()) &&
+           SamePixels(expected, codec.Decode(image, 0, 1, r.x0, r.y0, r.x1, r.y1, 1));
+    }
+    J2kCodec sidecarCodec(/*verbose=*/false);
+    sidecarCodec.SetIndexMode(IndexMode::SIDECAR);
+    ok = ok && SamePixels(expected,
+                          sidecarCodec.Decode(j2kPath, 0, 1, r.x0, r.y0, r.x1, r.y1, 1));
+
+    std::error_code error;
+    const auto mtime = std::filesystem::last_write_time(j2kPath, error);
+    std::filesystem::last_write_time(j2kPath, mtime + std::chrono::seconds(2), error);
+    CodestreamIndex stale;
+    ok = ok && !error && !stale.Load(sidecarPath, j2kPath);
+    std::filesystem::remove(sidecarPath, error);
+    if (!ok) {
+      std::cerr << "[ERROR] the sidecar index of " << j2kPath
+                << " did not round trip, decoded other pixels or survived a touched file\n";
+      return 1;
+    }
+    std::cerr << "sidecar_round_trip ok\n";
+  }
+
+  // A burst submitted within the batch window of one worker has to be decoded in fewer
+  // groups than it has regions, each region with the pixels of an unbatched decode
+  {
+    std::atomic<uint64_t> regionsRequested(0);
+    std::atomic<uint64_t> regionDecodes(0);
+    DecodeServiceOptions serviceOptions;
+    serviceOptions.numWorkers = 1;
+    serviceOptions.batchWindow = std::chrono::milliseconds(50);
+    serviceOptions.maxBatch = 8;
+    // A region the worker decoded on its own reports no batch, it counts as one decode
+    serviceOptions.metricsSink = [&](const DecodeMetrics& metrics) {
+      regionsRequested += metrics.regionsRequested ? metrics.regionsRequested : 1;
+      regionDecodes += metrics.regionsRequested ? metrics.regionDecodes : 1;
+    };
+    DecodeService service(serviceOptions);
+    const std::vector<DecodeRegion> regions = BurstAt(options, 1);
+    std::vector<DecodeTicket> tickets;
+    for (const DecodeRegion& r : regions) {
+      tickets.push_back(service.Submit(RegionRequest(j2kPath, r)));
+    }
+    J2kCodec reference(/*verbose=*/false);
+    bool ok = true;
+    for (size_t k = 0; k < regions.size(); ++k) {
+      const DecodeRegion& r = regions[k];
+      ok = SamePixels(tickets[k].Get().image,
+                      reference.Decode(j2kPath, 0, 1, r.x0, r.y0, r.x1, r.y1, 1)) &&
+           ok;
+    }
+    if (!ok || regionsRequested != regions.size() || regionDecodes >= regionsRequested) {
+      std::cerr << "[ERROR] DecodeService batched " << regionsRequested << " of "
+                << regions.size() << " regions into " << regionDecodes
+                << " decodes, or returned other pixels than unbatched decodes\n";
+      return 1;
+    }
+    std::cerr << "decode_service_batch ok (" << regionsRequested << " regions, "
+              << regionDecodes << " decodes)\n";
+  }
+
+  // Bursts through one worker, each region on its own and coalesced within the window.
+  // A full batch closes the window early, so the batched case does not wait it out.
+  for (const bool batched : {false, true}) {
+    DecodeServiceOptions serviceOptions;
+    serviceOptions.numWorkers = 1;
+    serviceOptions.batchWindow = std::chrono::milliseconds(batched ? 50 : 0);
+    serviceOptions.maxBatch = 8;
+    DecodeService service(serviceOptions);
+    results.push_back(Measure(batched ? "service_burst_batched" : "service_burst", 1,
+                              options.iterations, [&](int i) {
+      std::vector<DecodeRequest> requests;
+      for (const DecodeRegion& r : BurstAt(options, i)) {
+        requests.push_back(RegionRequest(j2kPath, r));
+      }
+      size_t pixels = 0;
+      for (DecodeTicket& ticket : service.SubmitBatch(std::move(requests))) {
+        const DecodeResult result = ticket.Get();
+        pixels += result.image ? size_t(result.image->w) * result.image->h : 0;
+      }
+      return pixels;
+    }));
+  }
+
+  // The malloc thresholds are process wide and stay raised, so the retained heap run
+  // comes after every other decode case
+  if (options.retainHeapMb > 0) {
+    if (!RetainHeapForDecode(options.retainHeapMb * 1024 * 1024)) {
+      std::cerr << "[WARNING] RetainHeapForDecode is not fully supported here\n";
+    }
+    for (const int threads : options.threads) {
+      J2kCodec codec(/*verbose=*/false);
+      results.push_back(Measure("decode_pooled_u8_retained", threads, options.iterations,
+                                [&](int) {
+        PooledImage image = codec.DecodePooled(j2kPath, SampleFormat::UINT8, 0, 1, -1, -1,
+                                               -1, -1, threads);
+        return image.buffer.Size();
+      }));
+    }
+  }
+
+  // Metadata paths are single threaded
+  J2kCodec xmlCodec(/*verbose=*/false);
+  results.push_back(Measure("xml_box", 1, options.iterations, [&](int) {
+    return xmlCodec.fetchXMLBox(jp2Path).length;
+  }));
+  results.push_back(Measure("xml_header", 1, options.iterations, [&](int) {
+    J2kCodec j(/*verbose=*/false);
+    return j.fetchXMLData(jp2Path).length;
+  }));
+
+  // A cached decode after the file is rewritten must see the new pixels, not the view
+  // the reused session still has of the old file
+  {
+    const unsigned int small = 256;
+    const std::string rewritePath = (workdir / "rewritten.j2k").string();
+    std::vector<int32_t> first = MakeImage(small);
+    std::vector<int32_t> second(first.size());
+    std::transform(first.begin(), first.end(), second.begin(),
+                   [](const int32_t v) { return 255 - v; });
+    J2kCodec writer(/*verbose=*/false);
+    J2kCodec cached(/*verbose=*/false);
+    cached.SetDecodeCache(std::make_shared<DecodeCache>(64ull * 1024 * 1024));
+    writer.EncodeAsTiles(rewritePath.c_str(), first.data(), small, small, 128, 128, 1, 8);
+    const auto before = cached.Decode(rewritePath, 0, 1, -1, -1, -1, -1, 1);
+    writer.EncodeAsTiles(rewritePath.c_str(), second.data(), small, small, 128, 128, 1, 8);
+    // Coarse file system clocks could otherwise leave the mtime unchanged
+    std::error_code ec;
+    const auto written = std::filesystem::last_write_time(rewritePath, ec);
+    std::filesystem::last_write_time(rewritePath, written + std::chrono::seconds(2), ec);
+    const auto after = cached.Decode(rewritePath, 0, 1, -1, -1, -1, -1, 1);
+    J2kCodec fresh(/*verbose=*/false);
+    if (!SamePixels(after, fresh.Decode(rewritePath, 0, 1, -1, -1, -1, -1, 1)) ||
+        SamePixels(before, after)) {
+      std::cerr << "[ERROR] cached decode of " << rewritePath
+                << " returned the file as it was before it was rewritten\n";
+      return 1;
+    }
+    std::cerr << "decode_cached_rewrite ok\n";
+  }
+
+  if (options.outfile.empty()) {
+    WriteJson(std::cout, options, results);
+  } else {
+    std::ofstream out(options.outfile);
+    WriteJson(out, options, results);
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include "sequence_reader.h"
+
+using namespace j2c;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Plays back the JPEG 2000 frames of a directory in name order and reports the frame
+// rate, with and without the prefetching SequenceReader.
+int main(int argc, char* argv[]) {
+  std::string input;
+  SequenceOptions options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "-i") {
+      input = argv[i + 1];
+    } else if (arg == "--res") {
+      options.resolutionLevel = std::max(0, std::stoi(argv[i + 1]));
+    } else if (arg == "--layers") {
+      options.numQualityLayers = std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--lookahead") {
+      options.lookahead = (size_t)std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--decoders") {
+      options.numDecoders = (unsigned int)std::max(1, std::stoi(argv[i + 1]));
+    }
+  }
+  if (input.empty() || !std::filesystem::is_directory(input)) {
+    std::cerr << "[ERROR] input format. Example: \n ./play_sequence -i {directory} "
+                 "[--res N] [--layers N] [--lookahead N] [--decoders N]\n";
+    return 0;
+  }
+  const std::vector<std::string> paths = SequenceReader::ListDirectory(input);
+  if (paths.empty()) {
+    std::cerr << "[ERROR] no JPEG 2000 files found in " << input << "\n";
+    return 0;
+  }
+
+  // Baseline: open, parse and decode each frame when it is due
+  auto start = Clock::now();
+  size_t decoded = 0;
+  {
+    J2kCodec codec(/*verbose=*/false);
+    for (const auto& path : paths) {
+      PooledImage image = codec.DecodePooled(path, options.format,
+                                             options.resolutionLevel,
+                                             options.numQualityLayers, -1, -1, -1, -1, 1);
+      decoded += image.buffer.Empty() ? 0 : 1;
+    }
+  }
+  const double sequentialSeconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+  start = Clock::now();
+  size_t played = 0;
+  {
+    SequenceReader reader(paths, options);
+    SequenceFrame frame;
+    while (reader.Next(frame)) {
+      if (!frame.data) {
+        std::cerr << "[WARNING] could not decode " << frame.path << " ("
+                  << StatusName(frame.status) << ")\n";
+        continue;
+      }
+      ++played;
+    }
+  }
+  const double sequenceSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::cout << paths.size() << " frames\n"
+            << "sequential: " << decoded << " decoded, "
+            << decoded / std::max(sequentialSeconds, 1e-9) << " frames/s\n"
+            << "sequence reader: " << played << " decoded, "
+            << played / std::max(sequenceSeconds, 1e-9) << " frames/s (lookahead "
+            << options.lookahead << ", " << options.numDecoders << " decoders)\n";
+  return 0;
+}
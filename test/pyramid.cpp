@@ -0,0 +1,117 @@
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include "format_defs.h"
+#include "image_writer.h"
+#include "pyramid.h"
+
+using namespace j2c;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Writes resolution levels and a thumbnail of every JPEG 2000 file below a directory
+// (or a single file) into `outdir` as {name}_r{level}.{format} and {name}_thumb.{format}.
+int main(int argc, char* argv[]) {
+  std::string input;
+  std::string outdir;
+  std::string format;
+  PyramidOptions options;
+  int numQualityLayers = 1;
+  std::vector<int> levels;
+  ImageEncodeOptions encodeOptions;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "-i") {
+      input = argv[i + 1];
+    } else if (arg == "-o") {
+      outdir = argv[i + 1];
+    } else if (arg == "-f") {
+      format = argv[i + 1];
+    } else if (arg == "--levels") {
+      std::stringstream list(argv[i + 1]);
+      for (std::string level; std::getline(list, level, ',');) {
+        levels.push_back(std::max(0, std::stoi(level)));
+      }
+    } else if (arg == "--layers") {
+      numQualityLayers = std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--thumbnail") {
+      options.thumbnailSize = (uint32_t)std::max(0, std::stoi(argv[i + 1]));
+    } else if (arg == "--tile") {
+      encodeOptions.tileWidth = encodeOptions.tileHeight =
+            (unsigned int)std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--workers") {
+      options.numWorkers = (unsigned int)std::max(0, std::stoi(argv[i + 1]));
+    }
+  }
+  const int outFormat = FormatFromExtension(("." + format).c_str());
+  if (input.empty() || outdir.empty() || outFormat < 0 ||
+      (levels.empty() && options.thumbnailSize == 0)) {
+    std::cerr << "[ERROR] input format. Example: \n ./pyramid -i {file|directory} -o outdir "
+                 "-f raw|rawl|pgm|ppm|pgx|j2k|jp2 [--levels 1,2,3] [--layers N] "
+                 "[--thumbnail 256] [--tile N] [--workers N]\n";
+    return 0;
+  }
+  for (const int level : levels) {
+    options.levels.push_back({level, numQualityLayers});
+  }
+
+  const auto isCodestream = [](const std::filesystem::path& path) {
+    const int f = FormatFromExtension(path.string().c_str());
+    return f == J2K_CFMT || f == JP2_CFMT;
+  };
+  const std::filesystem::path root(input);
+  std::vector<std::string> paths;
+  if (std::filesystem::is_directory(root)) {
+    for (auto& dirEntry : std::filesystem::recursive_directory_iterator(root)) {
+      if (dirEntry.is_regular_file() && isCodestream(dirEntry.path())) {
+        paths.push_back(dirEntry.path().string());
+      }
+    }
+  } else {
+    paths.push_back(input);
+  }
+  if (paths.empty()) {
+    std::cerr << "[ERROR] no JPEG 2000 files found in " << input << "\n";
+    return 0;
+  }
+
+  std::atomic<uint64_t> bytesWritten(0);
+  const auto sink = [&](const std::string& path, const PyramidImage& level) {
+    // Per worker thread, the sink runs on the thread that decoded the level
+    thread_local J2kCodec encoder(/*verbose=*/false);
+    thread_local std::vector<uint8_t> body;
+    const SampleImage samples = {level.image.buffer.Data(), level.image.w, level.image.h,
+                                 level.image.numComps, level.bits};
+    std::filesystem::path relative = std::filesystem::is_directory(root)
+                                           ? std::filesystem::relative(path, root)
+                                           : std::filesystem::path(path).filename();
+    const std::string suffix =
+          level.thumbnail ? "_thumb" : "_r" + std::to_string(level.level.resolutionLevel);
+    relative.replace_filename(relative.stem().string() + suffix + "." + format);
+    const std::string output = (std::filesystem::path(outdir) / relative).string();
+
+    uint64_t written = 0;
+    if (!LayoutImage(samples, outFormat, body) ||
+        !WriteImage(encoder, body, samples, output, outFormat, encodeOptions, written)) {
+      std::cerr << "Failed to write " << output << "\n";
+      return false;
+    }
+    bytesWritten += written;
+    return true;
+  };
+
+  auto t1 = Clock::now();
+  const PyramidStats stats = PyramidGenerator(options).Run(paths, sink);
+  auto t2 = Clock::now();
+
+  const double sec = std::chrono::duration<double>(t2 - t1).count();
+  std::cout << stats.files - stats.failed << " of " << stats.files << " files, "
+            << stats.levels << " levels in " << sec << " s (" << stats.files / sec
+            << " files/sec), " << bytesWritten / 1e6 << " MB written\n";
+  return stats.failed ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include "format_defs.h"
+#include "transcoder.h"
+
+using namespace j2c;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Converts every JPEG 2000 file below a directory (or a single file) into `outdir`,
+// keeping the relative layout and swapping the extension for the output format.
+int main(int argc, char* argv[]) {
+  std::string input;
+  std::string outdir;
+  std::string format;
+  TranscodeOptions options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "-i") {
+      input = argv[i + 1];
+    } else if (arg == "-o") {
+      outdir = argv[i + 1];
+    } else if (arg == "-f") {
+      format = argv[i + 1];
+    } else if (arg == "--res") {
+      options.resolutionLevel = std::max(0, std::stoi(argv[i + 1]));
+    } else if (arg == "--layers") {
+      options.numQualityLayers = std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--tile") {
+      options.tileWidth = options.tileHeight = (unsigned int)std::max(1, std::stoi(argv[i + 1]));
+    } else if (arg == "--decoders") {
+      options.numDecoders = (unsigned int)std::max(0, std::stoi(argv[i + 1]));
+    } else if (arg == "--depth") {
+      options.depth = (size_t)std::max(1, std::stoi(argv[i + 1]));
+    }
+  }
+  if (input.empty() || outdir.empty() || format.empty() ||
+      FormatFromExtension(("." + format).c_str()) < 0) {
+    std::cerr << "[ERROR] input format. Example: \n ./transcode -i {file|directory} -o outdir "
+                 "-f raw|rawl|pgm|ppm|pgx|j2k|jp2 [--res N] [--layers N] [--tile N] "
+                 "[--decoders N] [--depth N]\n";
+    return 0;
+  }
+
+  const auto isCodestream = [](const std::filesystem::path& path) {
+    const int f = FormatFromExtension(path.string().c_str());
+    return f == J2K_CFMT || f == JP2_CFMT;
+  };
+  std::vector<TranscodeJob> jobs;
+  const std::filesystem::path root(input);
+  const auto addJob = [&](const std::filesystem::path& path,
+                          const std::filesystem::path& relative) {
+    std::filesystem::path out = std::filesystem::path(outdir) / relative;
+    out.replace_extension("." + format);
+    jobs.push_back({path.string(), out.string()});
+  };
+  if (std::filesystem::is_directory(root)) {
+    for (auto& dirEntry : std::filesystem::recursive_directory_iterator(root)) {
+      if (dirEntry.is_regular_file() && isCodestream(dirEntry.path())) {
+        addJob(dirEntry.path(), std::filesystem::relative(dirEntry.path(), root));
+      }
+    }
+  } else {
+    addJob(root, root.filename());
+  }
+  if (jobs.empty()) {
+    std::cerr << "[ERROR] no JPEG 2000 files found in " << input << "\n";
+    return 0;
+  }
+
+  auto t1 = Clock::now();
+  const TranscodeStats stats = Transcoder(options).Run(jobs);
+  auto t2 = Clock::now();
+
+  const double sec = std::chrono::duration<double>(t2 - t1).count();
+  std::cout << stats.files - stats.failed << " of " << stats.files << " files transcoded in "
+            << sec << " s (" << stats.files / sec << " files/sec), "
+            << stats.bytesRead / 1e6 << " MB read, " << stats.bytesWritten / 1e6
+            << " MB written\n";
+  return stats.failed ? 1 : 0;
+}